@@ -33,8 +33,18 @@
 #include "duerapp_media.h"
 #include "duerapp_event.h"
 #include "duerapp_alert.h"
+#include "duerapp_uplink.h"
+#include "duerapp_uplink_bench.h"
+#include "duerapp_mixer_bench.h"
+#include "duerapp_cache.h"
+#include "duerapp_mixer.h"
+#include "duerapp_volume.h"
+#include "duerapp_load.h"
+#include "duerapp_alert_bench.h"
+#include "duerapp_cache_bench.h"
 #include "duerapp.h"
 #include "lightduer_system_info.h"
+#include "lightduer_adapter.h"
 #include "led.h"
 #include "button.h"
 
@@ -314,6 +324,27 @@ void duer_test_start(const char *profile)
     free((void *)data);
 }
 
+// "content,dialog,alert,tone" ring sizes in ms, 0 or left out keeps the default
+static void duer_args_ring_ms(const char *arg)
+{
+    static const duer_mixer_stream_t streams[] = {
+        MIXER_STREAM_CONTENT, MIXER_STREAM_DIALOG, MIXER_STREAM_ALERT, MIXER_STREAM_TONE
+    };
+    char *end = NULL;
+
+    for (int i = 0; i < (int)(sizeof(streams) / sizeof(streams[0])) && *arg; i++) {
+        int ms = (int)strtol(arg, &end, 10);
+        duer_mixer_set_ring_ms(streams[i], ms);
+        if (MIXER_STREAM_CONTENT == streams[i]) {
+            duer_mixer_set_ring_ms(MIXER_STREAM_CONTENT_B, ms);
+        }
+        if (*end != ',') {
+            break;
+        }
+        arg = end + 1;
+    }
+}
+
 static void duer_args_usage(char *param) {
     fprintf(stderr, "Usage: %s [options]\n\n", param);
     fprintf(stderr,
@@ -321,6 +352,23 @@ static void duer_args_usage(char *param) {
     "-p  the profile which will be used\n"
     "-r  the alarm bell file\n"
     "-w  the kws module file\n"
+    "-u  uplink stall policy: block, drop or cache(default)\n"
+    "-f  uplink send unit in ms, e.g. 40, 80(default) or 160\n"
+    "-l  follow-up listening window in seconds, 0 disables\n"
+    "-b  audio prebuffer in ms for queued tracks, default 2000\n"
+    "-c  media cache size in MB, default 32, 0 disables\n"
+    "-o  ALSA output device, default \"default\"\n"
+    "-k  output period in frames at 48 kHz, default 192 (4 ms)\n"
+    "-m  ALSA mixer control for the volume, default Master\n"
+    "-R  mixer ring per stream in ms as content,dialog,alert,tone, default 300,40,100,20\n"
+    "-L  media load run on the urls in this file, no cloud; use with -o null\n"
+    "-T  load run time in seconds, default 600\n"
+    "-x  crossfade between music tracks in ms, default 0 (off)\n"
+    "-A  alert store benchmark with this many alerts, then exit\n"
+    "-S  alert stress run with this many alerts in virtual time, then exit\n"
+    "-C  media cache run with this many urls from a local http stand-in, then exit\n"
+    "-U  uplink run with this many seconds of speech per send unit, mock transport, then exit\n"
+    "-M  output latency run with this many marked frames per stream and period, then exit\n"
     "-h  Print this message\n\n"
     );
 }
@@ -338,7 +386,14 @@ int main(int argc, char *argv[])
     // Check input arguments
     int sleep_time = 0;
     int c = 0;
-    while((c = getopt(argc, argv, "p:r:w:s:t:")) != -1) {
+    const char *load_file = NULL;
+    int load_time = 600;
+    int alert_bench = 0;
+    int alert_stress = 0;
+    int cache_bench = 0;
+    int uplink_bench = 0;
+    int mixer_bench = 0;
+    while((c = getopt(argc, argv, "p:r:w:s:t:u:f:l:b:c:o:k:m:R:L:T:x:A:S:C:U:M:")) != -1) {
         switch(c) {
             case 'p':
                 s_pro_path = optarg;
@@ -359,10 +414,99 @@ int main(int argc, char *argv[])
             case 's':
                 sleep_time = atoi(optarg);
                 break;
+            case 'u':
+                if (strcmp(optarg, "block") == 0) {
+                    duer_uplink_set_policy(UPLINK_POLICY_BLOCK);
+                } else if (strcmp(optarg, "drop") == 0) {
+                    duer_uplink_set_policy(UPLINK_POLICY_DROP_OLDEST);
+                } else {
+                    duer_uplink_set_policy(UPLINK_POLICY_CACHE);
+                }
+                break;
+            case 'f':
+                duer_uplink_set_frame(atoi(optarg), atoi(optarg) + atoi(optarg) / 2);
+                break;
+            case 'l':
+                duer_recorder_set_follow_up(atoi(optarg));
+                break;
+            case 'b':
+                duer_media_set_prebuffer(atoi(optarg), -1);
+                break;
+            case 'c':
+                duer_cache_set_limit(atoi(optarg));
+                break;
+            case 'o':
+                duer_mixer_set_device(optarg);
+                break;
+            case 'k':
+                duer_mixer_set_period(atoi(optarg));
+                break;
+            case 'm':
+                duer_volume_set_control(NULL, optarg);
+                break;
+            case 'R':
+                duer_args_ring_ms(optarg);
+                break;
+            case 'L':
+                load_file = optarg;
+                break;
+            case 'T':
+                load_time = atoi(optarg);
+                break;
+            case 'x':
+                duer_media_set_crossfade(atoi(optarg));
+                break;
+            case 'A':
+                alert_bench = atoi(optarg);
+                break;
+            case 'S':
+                alert_stress = atoi(optarg);
+                break;
+            case 'C':
+                cache_bench = atoi(optarg);
+                break;
+            case 'U':
+                uplink_bench = atoi(optarg);
+                break;
+            case 'M':
+                mixer_bench = atoi(optarg);
+                break;
         }
     }
     if(sleep_time>0)
          sleep(sleep_time);
+
+    if (alert_bench > 0) {
+        return duer_alert_bench_store(alert_bench) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (alert_stress > 0) {
+        // mutexes and memory for the alert module, nothing connects
+        baidu_ca_adapter_initialize();
+        return duer_alert_bench_stress(alert_stress) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (cache_bench > 0) {
+        return duer_cache_bench_run(cache_bench) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (uplink_bench > 0) {
+        // memory for the speex encoder, nothing connects
+        baidu_ca_adapter_initialize();
+        return duer_uplink_bench_run(uplink_bench) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (mixer_bench > 0) {
+        return duer_mixer_bench_run(mixer_bench) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (load_file) {
+        duer_load_init();
+        duer_media_init();
+        int ret = duer_load_run(load_file, load_time);
+        duer_media_destroy();
+        return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     
     if(NULL == s_pro_path) {
         duer_args_usage(argv[0]);
@@ -380,6 +524,11 @@ int main(int argc, char *argv[])
 
 	duer_hotwords_detect_start(kws_model_fn);
 	
+    // alerts from before the restart ring even if the cloud is unreachable
+    if (NULL != duer_get_alert_ring()) {
+        duer_alert_load();
+    }
+
     // try conntect baidu cloud
     duer_test_start(s_pro_path);
 
@@ -19,6 +19,7 @@
  * Desc: Duer Alert function file.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,13 +29,25 @@
 
 #include "lightduer_dcs_alert.h"
 #include "duerapp_media.h"
-#include "lightduer_net_ntp.h"
+#include "duerapp_mixer.h"
 #include "lightduer_types.h"
-#include "lightduer_timers.h"
 #include "lightduer_mutex.h"
 #include "lightduer_memory.h"
 #include "duerapp_config.h"
 #include "duerapp_alert.h"
+#include "duerapp_sched.h"
+#include "duerapp_alert_store.h"
+#include "duerapp_alert_journal.h"
+#include "duerapp_clock.h"
+#include "duerapp_alert_prefetch.h"
+
+// an alert missed while the device was off still rings when it is this late
+#define ALERT_REPLAY_GRACE_MS       (60 * 1000)
+#define ALERT_COMPACT_INTERVAL_MS   (60 * 60 * 1000)
+// a clock correction smaller than this leaves the timer where it is
+#define ALERT_REARM_MIN_MS          (100)
+// events kept while offline, the oldest go first when it overflows
+#define ALERT_EVENT_QUEUE_MAX       (64)
 
 typedef struct _duerapp_alert_node {
     char *token;
@@ -42,21 +55,156 @@ typedef struct _duerapp_alert_node {
     char *time;
     int ring_count;
     bool isbell;
-    duer_timer_handler handle;
+    bool fired;             // not journaled again, a reboot must not ring it twice
+    bool prefetched;        // every asset is in the cache
+    // first runs the set job, then waits for the alert time
+    duer_sched_timer_t timer;
+    duer_alert_entry_t entry;
     char *ring_tab[0];
 } duerapp_alert_node;
 
-typedef struct _duer_alert_list {
-    struct _duer_alert_list *next;
-    duerapp_alert_node *data;
-} duer_alert_list_t;
+// what the bell thread needs, copied: the alert may be deleted while it rings
+typedef struct _duer_bell_job {
+    struct _duer_bell_job *next;
+    char *token;
+    int ring_count;
+    char *ring_tab[0];
+} duer_bell_job_t;
+
+// copied out under the lock, GetAllAlerts builds its JSON from this
+typedef struct _duer_alert_snapshot {
+    const char *token;
+    const char *type;
+    const char *time;
+    bool isbell;
+} duer_alert_snapshot_t;
 
-static duer_alert_list_t s_alert_head;
+// an event the cloud has not taken yet
+typedef struct _duer_alert_event {
+    struct _duer_alert_event *next;
+    duer_dcs_alert_event_type type;
+    char token[0];
+} duer_alert_event_t;
+
+// by token and by deadline, guarded by s_alert_mutex
+static duer_alert_store_t s_alert_store;
 static duer_mutex_t s_alert_mutex = NULL;
-static duer_mutex_t s_bell_mutex = NULL;
 static char *s_ring_path = NULL;
 static GMainLoop *s_loop = NULL;
-static bool s_is_bell = false;
+static volatile bool s_is_bell = false;
+// stop the batch ringing now, checked before each pipeline runs
+static bool s_bell_stop = false;
+// fired in the current tick, only the scheduler thread touches it
+static duer_bell_job_t *s_bell_pending = NULL;
+// alerts that fired and wait for the bell thread, oldest first
+static duer_bell_job_t *s_bell_jobs = NULL;
+static pthread_mutex_t s_bell_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_bell_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t s_bell_tid;
+static bool s_bell_started = false;
+static bool s_loaded = false;
+// journal writes are made under s_alert_mutex
+static bool s_journal_open = false;
+static duer_sched_timer_t s_compact_timer;
+static duer_sched_timer_t s_reconcile_timer;
+// walks the deadline index for alerts due within ALERT_PREFETCH_LEAD_S
+static duer_sched_timer_t s_fetch_timer;
+// wall ms the walk has reached, alerts set behind it are queued at once
+static int64_t s_fetch_horizon = 0;
+// an alert in range still misses an asset: walk the range again
+static bool s_fetch_retry = false;
+static bool s_prefetch_on = false;
+// set by bus_call, only the bell thread plays
+static bool s_play_failed = false;
+// events go to the cloud unless a benchmark takes them
+static duer_alert_report_cb s_report = NULL;
+// alerts restored at boot ring before the DCS is up, their events wait here
+static duer_alert_event_t *s_events = NULL;
+static int s_event_num = 0;
+static bool s_dcs_ready = false;
+static pthread_mutex_t s_event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Send what waited, in order, until the first one fails again. With
+ * s_event_lock held.
+ */
+static void duer_alert_event_send_queued(void)
+{
+    while (s_events && s_dcs_ready) {
+        duer_alert_event_t *event = s_events;
+        if (duer_dcs_report_alert_event(event->token, event->type) != DUER_OK) {
+            break;
+        }
+        s_events = event->next;
+        s_event_num--;
+        DUER_FREE(event);
+    }
+}
+
+static void duer_alert_event_queue(const char *token, duer_dcs_alert_event_type type)
+{
+    duer_alert_event_t **tail = &s_events;
+    duer_alert_event_t *event = (duer_alert_event_t *)DUER_MALLOC(sizeof(duer_alert_event_t)
+                                + strlen(token) + 1);
+
+    if (!event) {
+        DUER_LOGE("alert event %d of %s lost: no memory", type, token);
+        return;
+    }
+    event->next = NULL;
+    event->type = type;
+    strcpy(event->token, token);
+    if (s_event_num == ALERT_EVENT_QUEUE_MAX) {
+        duer_alert_event_t *oldest = s_events;
+        DUER_LOGW("alert event %d of %s dropped", oldest->type, oldest->token);
+        s_events = oldest->next;
+        s_event_num--;
+        DUER_FREE(oldest);
+    }
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = event;
+    s_event_num++;
+}
+
+static void duer_alert_report(const char *token, duer_dcs_alert_event_type type)
+{
+    if (s_report) {
+        s_report(token, type);
+        return;
+    }
+    pthread_mutex_lock(&s_event_lock);
+    duer_alert_event_send_queued();
+    // keep the order: nothing overtakes an event still waiting
+    if (s_events || !s_dcs_ready || duer_dcs_report_alert_event(token, type) != DUER_OK) {
+        duer_alert_event_queue(token, type);
+    }
+    pthread_mutex_unlock(&s_event_lock);
+}
+
+static void duer_alert_event_flush(void)
+{
+    int left = 0;
+
+    pthread_mutex_lock(&s_event_lock);
+    duer_alert_event_send_queued();
+    left = s_event_num;
+    pthread_mutex_unlock(&s_event_lock);
+    if (left) {
+        DUER_LOGW("%d alert events still wait for the cloud", left);
+    }
+}
+
+static void duer_alert_watch_remove(guint bus_watch_id)
+{
+    // g_source_remove() only looks in the global default context
+    GSource *source = g_main_context_find_source_by_id(g_main_loop_get_context(s_loop),
+                                                       bus_watch_id);
+    if (source) {
+        g_source_destroy(source);
+    }
+}
 
 bool duer_alert_bell()
 {
@@ -123,48 +271,16 @@ static char *duer_get_assets_url_str(const baidu_json *assets, const char *asset
 
 static duer_errcode_t duer_alert_list_push(duerapp_alert_node *data)
 {
-    duer_errcode_t rt = DUER_OK;
-    duer_alert_list_t *new_node = NULL;
-    duer_alert_list_t *tail = &s_alert_head;
-
-    do {
-        new_node = (duer_alert_list_t *)DUER_MALLOC(sizeof(duer_alert_list_t));
-        if (!new_node) {
-            DUER_LOGE("Memory too low");
-            rt = DUER_ERR_MEMORY_OVERLOW;
-            break;
-        }
-        new_node->next = NULL;
-        new_node->data = data;
-
-        while (tail->next) {
-            tail = tail->next;
-        }
-
-        tail->next = new_node;
-    } while(0);
-
-    return rt;
+    if (duer_alert_store_put(&s_alert_store, &data->entry) != 0) {
+        DUER_LOGE("Memory too low");
+        return DUER_ERR_MEMORY_OVERLOW;
+    }
+    return DUER_OK;
 }
 
-static duer_errcode_t duer_alert_list_remove(duerapp_alert_node *data)
+static void duer_alert_list_remove(duerapp_alert_node *data)
 {
-    duer_alert_list_t *pre = &s_alert_head;
-    duer_alert_list_t *cur = NULL;
-    duer_errcode_t rt = DUER_ERR_FAILED;
-
-    while (pre->next) {
-        cur = pre->next;
-        if (cur->data == data) {
-            pre->next = cur->next;
-            DUER_FREE(cur);
-            rt = DUER_OK;
-            break;
-        }
-        pre = pre->next;
-    }
-
-    return rt;
+    duer_alert_store_remove(&s_alert_store, &data->entry);
 }
 
 static duerapp_alert_node *duer_create_alert_node(const baidu_json *data)
@@ -211,7 +327,13 @@ static duerapp_alert_node *duer_create_alert_node(const baidu_json *data)
 
     alert->ring_count = playorder_count;
     alert->isbell = false;
-    alert->handle = NULL;
+    alert->fired = false;
+    alert->prefetched = false;
+    duer_sched_timer_init(&alert->timer, NULL, alert);
+    alert->entry.token = NULL;
+    alert->entry.deadline = 0;
+    alert->entry.stored = false;
+    alert->entry.data = alert;
     alert->ring_tab[0] = NULL;
     alert->token = duer_get_json_value_str(token);
     alert->type = duer_get_json_value_str(type);
@@ -231,6 +353,7 @@ static duerapp_alert_node *duer_create_alert_node(const baidu_json *data)
         }
         return NULL;
     }
+    alert->entry.token = alert->token;
 
     for(int i = 0; i < playorder_count; i++) {
         playorder_id = baidu_json_GetArrayItem(playorder, i);
@@ -244,9 +367,61 @@ static duerapp_alert_node *duer_create_alert_node(const baidu_json *data)
     return alert;
 }
 
+static char *duer_alert_strdup(const char *str);
+static void duer_free_alert_node(duerapp_alert_node *alert);
+
+static duerapp_alert_node *duer_alert_node_from_record(const duer_alert_record_t *record)
+{
+    duerapp_alert_node *alert = (duerapp_alert_node *)DUER_MALLOC(sizeof(duerapp_alert_node)
+                                + record->ring_count * sizeof(char *));
+    if (!alert) {
+        DUER_LOGE("alert malloc failed.");
+        return NULL;
+    }
+    alert->ring_count = record->ring_count;
+    alert->isbell = false;
+    alert->fired = false;
+    alert->prefetched = false;
+    duer_sched_timer_init(&alert->timer, NULL, alert);
+    alert->token = duer_alert_strdup(record->token);
+    alert->type = duer_alert_strdup(record->type);
+    alert->time = duer_alert_strdup(record->time);
+    for (int i = 0; i < record->ring_count; i++) {
+        alert->ring_tab[i] = duer_alert_strdup(record->ring_tab[i]);
+    }
+    alert->entry.token = alert->token;
+    alert->entry.deadline = record->deadline;
+    alert->entry.stored = false;
+    alert->entry.data = alert;
+    if (!(alert->token && alert->type && alert->time)) {
+        duer_free_alert_node(alert);
+        return NULL;
+    }
+    return alert;
+}
+
+/*
+ * Rings past the journal limit are dropped from the record, the alert in
+ * memory keeps them all.
+ */
+static void duer_alert_record_fill(const duerapp_alert_node *alert, duer_alert_record_t *record)
+{
+    record->deadline = alert->entry.deadline;
+    record->token = alert->token;
+    record->type = alert->type;
+    record->time = alert->time;
+    record->ring_count = alert->ring_count < ALERT_JOURNAL_RINGS_MAX
+                         ? alert->ring_count : ALERT_JOURNAL_RINGS_MAX;
+    for (int i = 0; i < record->ring_count; i++) {
+        record->ring_tab[i] = alert->ring_tab[i];
+    }
+}
+
 static void duer_free_alert_node(duerapp_alert_node *alert)
 {
     if (alert) {
+        // also waits out a callback that is running on the scheduler thread
+        duer_sched_cancel(&alert->timer);
         for(int i = 0; i < alert->ring_count; i++) {
             if(alert->ring_tab[i]) {
                 DUER_FREE(alert->ring_tab[i]);
@@ -268,11 +443,6 @@ static void duer_free_alert_node(duerapp_alert_node *alert)
             alert->time = NULL;
         }
 
-        if (alert->handle) {
-            duer_timer_release(alert->handle);
-            alert->handle = NULL;
-        }
-
         DUER_FREE(alert);
     }
 }
@@ -295,6 +465,7 @@ static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data)
 
                 DUER_LOGE("gstreamer play : %s\n", error->message);
                 g_error_free (error);
+                s_play_failed = true;
 
                 g_main_loop_quit(loop);
             }
@@ -302,13 +473,25 @@ static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data)
         default:
             break;
     }
+
+    return TRUE;
+}
+
+static bool duer_bell_stopping(void)
+{
+    bool stop = false;
+
+    pthread_mutex_lock(&s_bell_job_lock);
+    stop = s_bell_stop;
+    pthread_mutex_unlock(&s_bell_job_lock);
+    return stop;
 }
 
 static void duer_alert_play_local(const char *path) {
     GstElement *pipeline = gst_pipeline_new("audio-player");
     GstElement *source = gst_element_factory_make("filesrc", "file-source");
     GstElement *decoder = gst_element_factory_make("mad", "mad-decoder");
-    GstElement *sink = gst_element_factory_make("autoaudiosink", "audio-output");
+    GstElement *sink = duer_mixer_make_sink(MIXER_STREAM_ALERT);
     if (!(pipeline && source && decoder && sink)) {
         DUER_LOGE("create alert element failed!");
         return;
@@ -322,110 +505,285 @@ static void duer_alert_play_local(const char *path) {
 
     gst_bin_add_many(GST_BIN(pipeline), source, decoder, sink, NULL);
     gst_element_link_many(source, decoder, sink, NULL);
+    duer_mixer_set_active(MIXER_STREAM_ALERT, true);
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    g_main_loop_run(s_loop);
+    if (!duer_bell_stopping()) {
+        g_main_loop_run(s_loop);
+    }
+    if (!duer_bell_stopping()) {
+        duer_mixer_drain(MIXER_STREAM_ALERT);
+    }
+    duer_mixer_set_active(MIXER_STREAM_ALERT, false);
     gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(GST_OBJECT(pipeline));
-    g_source_remove(bus_watch_id);
+    duer_alert_watch_remove(bus_watch_id);
 }
 
-static void duer_alert_play_url(const char *url) {
+/*
+ * Returns false when the asset could not be played, e.g. the network is down.
+ */
+static bool duer_alert_play_url(const char *url) {
     GstElement *pipeline = gst_element_factory_make("playbin", "alert");
     if (!pipeline) {
         DUER_LOGE("create alert element failed!");
-        return;
+        return false;
     }
 
     g_object_set(G_OBJECT(pipeline), "uri", url, NULL);
+    g_object_set(G_OBJECT(pipeline), "audio-sink", duer_mixer_make_sink(MIXER_STREAM_ALERT), NULL);
 
     GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
     guint bus_watch_id = gst_bus_add_watch(bus, bus_call, s_loop);
     gst_object_unref(bus);
+    s_play_failed = false;
+    duer_mixer_set_active(MIXER_STREAM_ALERT, true);
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    g_main_loop_run(s_loop);
+    if (!duer_bell_stopping()) {
+        g_main_loop_run(s_loop);
+    }
+    if (!duer_bell_stopping()) {
+        duer_mixer_drain(MIXER_STREAM_ALERT);
+    }
+    duer_mixer_set_active(MIXER_STREAM_ALERT, false);
     gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(GST_OBJECT(pipeline));
-    g_source_remove(bus_watch_id);
+    duer_alert_watch_remove(bus_watch_id);
+    return !s_play_failed;
 }
 
-static void duer_bell_thread(duerapp_alert_node *alert_info)
-{
-    duer_mutex_lock(s_bell_mutex);
-    pthread_detach(pthread_self());
-    duer_media_audio_stop();
-    duer_media_speak_stop();
+static duerapp_alert_node *duer_find_target_alert(const char *token);
 
-    s_loop = g_main_loop_new(NULL, FALSE);
-    if (!s_loop) {
-        DUER_LOGE("create alert loop failed!");
-        duer_mutex_unlock(s_bell_mutex);
-        return;
+static char *duer_alert_strdup(const char *str)
+{
+    char *ret = NULL;
+    int len = 0;
+    if (str) {
+        len = strlen(str) + 1;
+        ret = (char *)DUER_MALLOC(len);
+        if (ret) {
+            snprintf(ret, len, "%s", str);
+        }
     }
+    return ret;
+}
 
-    alert_info->isbell = true;
-    s_is_bell = true;
+static duer_bell_job_t *duer_bell_job_new(const duerapp_alert_node *alert)
+{
+    duer_bell_job_t *job = (duer_bell_job_t *)DUER_MALLOC(sizeof(duer_bell_job_t)
+                           + alert->ring_count * sizeof(char *));
+    if (!job) {
+        DUER_LOGE("bell job malloc failed.");
+        return NULL;
+    }
+    job->next = NULL;
+    job->ring_count = alert->ring_count;
+    job->token = duer_alert_strdup(alert->token);
+    for (int i = 0; i < alert->ring_count; i++) {
+        job->ring_tab[i] = duer_alert_strdup(alert->ring_tab[i]);
+    }
+    return job;
+}
 
-    if(alert_info->ring_count) {
-        // play url
-        for(int i = 0; i < alert_info->ring_count; i++) {
-            duer_alert_play_url(alert_info->ring_tab[i]);
-            if(!s_is_bell) {
-                break;
-            }
+static void duer_bell_job_free(duer_bell_job_t *job)
+{
+    for (int i = 0; i < job->ring_count; i++) {
+        if (job->ring_tab[i]) {
+            DUER_FREE(job->ring_tab[i]);
         }
-    } else {
-        // play loacl
-        duer_alert_play_local(s_ring_path);
     }
+    if (job->token) {
+        DUER_FREE(job->token);
+    }
+    DUER_FREE(job);
+}
 
-    duer_dcs_report_alert_event(alert_info->token, ALERT_STOP);
+static void duer_alert_set_isbell(const char *token, bool isbell)
+{
+    duerapp_alert_node *alert = NULL;
 
-    g_main_loop_unref (s_loop);
-    s_loop = NULL;
+    duer_mutex_lock(s_alert_mutex);
+    alert = duer_find_target_alert(token);
+    if (alert) {
+        alert->isbell = isbell;
+    }
+    duer_mutex_unlock(s_alert_mutex);
+}
 
-    alert_info->isbell = false;
-    s_is_bell = false;
-    duer_mutex_unlock(s_bell_mutex);
+static void duer_bell_ring(const duer_bell_job_t *job)
+{
+    char uri[PATH_MAX + 16];
+    bool played = false;
+
+    // play url, the prefetched copy when there is one
+    for(int i = 0; i < job->ring_count; i++) {
+        if (job->ring_tab[i]) {
+            if (duer_alert_prefetch_lookup(job->ring_tab[i], uri, sizeof(uri)) == 0) {
+                played |= duer_alert_play_url(uri);
+            } else {
+                DUER_LOGW("alert asset not prefetched: %s", job->ring_tab[i]);
+                played |= duer_alert_play_url(job->ring_tab[i]);
+            }
+        }
+        if(duer_bell_stopping()) {
+            break;
+        }
+    }
+    // play loacl, also when no asset could be played
+    if (!duer_bell_stopping() && !played) {
+        duer_alert_play_local(s_ring_path);
+    }
 }
 
-static void duer_alert_start(duerapp_alert_node *alert_info)
+/*
+ * The only thread that rings. Alerts that fired together are taken as one
+ * batch: the first one rings, every one of them is reported stopped.
+ */
+static void duer_bell_thread()
 {
-    if (!s_ring_path) {
-        DUER_LOGE("not found mp3 path!");
+    duer_bell_job_t *jobs = NULL;
+    GMainContext *ctx = g_main_context_new();
+
+    // bus watches of the bell pipelines attach here
+    g_main_context_push_thread_default(ctx);
+    s_loop = g_main_loop_new(ctx, FALSE);
+    if (!s_loop) {
+        DUER_LOGE("create alert loop failed!");
         return;
     }
-    if (s_is_bell) {
-        duer_alert_stop();
+
+    while (1) {
+        pthread_mutex_lock(&s_bell_job_lock);
+        while (!s_bell_jobs) {
+            pthread_cond_wait(&s_bell_job_cond, &s_bell_job_lock);
+        }
+        jobs = s_bell_jobs;
+        s_bell_jobs = NULL;
+        s_bell_stop = false;
+        s_is_bell = true;
+        pthread_mutex_unlock(&s_bell_job_lock);
+
+        // music keeps playing, ducked by the mixer while the bell rings
+        duer_media_speak_stop();
+        duer_media_sync();
+        duer_bell_ring(jobs);
+        pthread_mutex_lock(&s_bell_job_lock);
+        s_is_bell = false;
+        pthread_mutex_unlock(&s_bell_job_lock);
+
+        while (jobs) {
+            duer_bell_job_t *next = jobs->next;
+            duer_alert_report(jobs->token, ALERT_STOP);
+            duer_alert_set_isbell(jobs->token, false);
+            duer_bell_job_free(jobs);
+            jobs = next;
+        }
     }
-    pthread_t bell_threadid;
-    int ret = pthread_create(&bell_threadid, NULL, (void *)duer_bell_thread, (void *)alert_info);
-    if(ret != 0)
-    {
-        DUER_LOGE("Create alert pthread failed!");
-    } else {
-        pthread_setname_np(bell_threadid, "alert_bell");
+}
+
+/*
+ * Runs inside the bell loop, so a quit asked for just before
+ * g_main_loop_run() is not lost.
+ */
+static gboolean duer_bell_quit(gpointer data)
+{
+    pthread_mutex_lock(&s_bell_job_lock);
+    if (s_bell_stop) {
+        g_main_loop_quit(s_loop);
     }
+    pthread_mutex_unlock(&s_bell_job_lock);
+    return G_SOURCE_REMOVE;
+}
+
+// with s_bell_job_lock held
+static void duer_bell_request_stop(void)
+{
+    GSource *source = NULL;
+
+    s_bell_stop = true;
+    source = g_idle_source_new();
+    g_source_set_callback(source, duer_bell_quit, NULL, NULL);
+    g_source_attach(source, g_main_loop_get_context(s_loop));
+    g_source_unref(source);
 }
 
 void duer_alert_stop()
 {
-    if (s_is_bell) {
-        s_is_bell = false;
-        g_main_loop_quit(s_loop);
+    pthread_mutex_lock(&s_bell_job_lock);
+    if (s_is_bell && !s_bell_stop) {
+        duer_bell_request_stop();
     } else {
         DUER_LOGI("Now the alert is not ringing.");
     }
+    pthread_mutex_unlock(&s_bell_job_lock);
 }
 
+/*
+ * Scheduler tick hook: everything that fired in the tick goes to the bell
+ * thread as one batch. Only a batch from an earlier tick is cut off.
+ */
+static void duer_bell_flush(void *param)
+{
+    duer_bell_job_t **tail = NULL;
+
+    if (!s_bell_pending) {
+        return;
+    }
+    pthread_mutex_lock(&s_bell_job_lock);
+    tail = &s_bell_jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = s_bell_pending;
+    s_bell_pending = NULL;
+    // the newest alerts take over from the ones ringing
+    if (s_is_bell && !s_bell_stop) {
+        duer_bell_request_stop();
+    }
+    pthread_cond_signal(&s_bell_job_cond);
+    pthread_mutex_unlock(&s_bell_job_lock);
+}
+
+/*
+ * Runs on the scheduler thread, so it only hands the alert to the bell.
+ */
 static void duer_alert_callback(void *param)
 {
     duerapp_alert_node *alert = (duerapp_alert_node *)param;
+    duer_bell_job_t *job = NULL;
+    duer_bell_job_t **tail = NULL;
 
     DUER_LOGI("alert started: token: %s", alert->token);
 
-    duer_dcs_report_alert_event(alert->token, ALERT_START);
-    // play url
-    duer_alert_start(alert);
+    duer_alert_report(alert->token, ALERT_START);
+    duer_mutex_lock(s_alert_mutex);
+    alert->fired = true;
+    if (s_journal_open) {
+        duer_alert_journal_delete(alert->token);
+    }
+    duer_mutex_unlock(s_alert_mutex);
+
+    // benchmarks run without a bell
+    if (!s_bell_started) {
+        return;
+    }
+    if (!s_ring_path) {
+        DUER_LOGE("not found mp3 path!");
+        return;
+    }
+    job = duer_bell_job_new(alert);
+    if (!job) {
+        return;
+    }
+    duer_mutex_lock(s_alert_mutex);
+    alert->isbell = true;
+    duer_mutex_unlock(s_alert_mutex);
+
+    // handed to the bell with the rest of the tick by duer_bell_flush()
+    tail = &s_bell_pending;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
 }
 
 static time_t duer_dcs_get_time_stamp(const char *time)
@@ -457,67 +815,185 @@ static time_t duer_dcs_get_time_stamp(const char *time)
     return time_stamp + (8 * 60 * 60);
 }
 
-static void duer_alert_set_thread(duerapp_alert_node *alert)
+/*
+ * Queue the alert for its deadline, a deadline already passed fires now.
+ */
+static int duer_alert_arm(duerapp_alert_node *alert)
 {
-    pthread_detach(pthread_self());
-    int ret = 0;
-    DuerTime cur_time;
-    size_t delay = 0;
-    int rs = DUER_OK;
-    time_t time_stamp = 0;
+    int64_t deadline = duer_clock_mono_us(alert->entry.deadline);
+    int64_t now = duer_sched_now_us();
 
-    if(!alert) {
-        DUER_LOGE("alert is null.");
-        return;
+    duer_sched_timer_init(&alert->timer, duer_alert_callback, alert);
+    return duer_sched_add(&alert->timer, deadline > now ? deadline : now);
+}
+
+/*
+ * Runs on the clock thread after each sync: moves the alerts whose
+ * deadline the new estimate puts somewhere else.
+ */
+static void duer_alert_clock_sync(void)
+{
+    int moved = 0;
+
+    duer_mutex_lock(s_alert_mutex);
+    for (duer_alert_entry_t *entry = duer_alert_store_first(&s_alert_store); entry;
+         entry = duer_alert_store_next(entry)) {
+        duerapp_alert_node *alert = entry->data;
+        int64_t deadline = duer_clock_mono_us(alert->entry.deadline);
+        int64_t diff = deadline - alert->timer.deadline_us;
+        if (alert->fired || (diff < ALERT_REARM_MIN_MS * 1000 && diff > -ALERT_REARM_MIN_MS * 1000)) {
+            continue;
+        }
+        if (duer_sched_move(&alert->timer, deadline)) {
+            moved++;
+        }
+    }
+    duer_mutex_unlock(s_alert_mutex);
+    if (moved) {
+        DUER_LOGI("clock sync moved %d alerts", moved);
     }
+    // the prefetch deadline moved with them
+    duer_sched_add(&s_fetch_timer, duer_sched_now_us());
+}
+
+/*
+ * False while an asset is not in the cache yet; those are queued, again
+ * after a failed download.
+ */
+static bool duer_alert_prefetch_node(duerapp_alert_node *alert)
+{
+    bool cached = true;
+
+    if (!s_prefetch_on || alert->fired || alert->prefetched) {
+        return true;
+    }
+    for (int k = 0; k < alert->ring_count; k++) {
+        if (duer_alert_prefetch_add(alert->ring_tab[k]) != 0) {
+            cached = false;
+        }
+    }
+    alert->prefetched = cached;
+    return cached;
+}
+
+/*
+ * Queues the assets of every alert due within the lead, then sleeps until
+ * the next one comes into range. Runs again whenever an alert is set, and
+ * every ALERT_PREFETCH_RETRY_S while an alert in range misses an asset.
+ */
+static void duer_alert_fetch_job(void *param)
+{
+    int64_t now = duer_clock_now_ms();
+    int64_t horizon = now + ALERT_PREFETCH_LEAD_S * 1000LL;
+    int64_t next = -1;
+    int64_t wake = -1;
+    bool retry = false;
+
+    duer_mutex_lock(s_alert_mutex);
+    // only the part of the index that came into range since the last walk,
+    // unless an earlier one is still missing something
+    for (duer_alert_entry_t *entry = duer_alert_store_after(&s_alert_store,
+                                     s_fetch_retry ? now : s_fetch_horizon);
+         entry; entry = duer_alert_store_next(entry)) {
+        duerapp_alert_node *alert = entry->data;
+        if (alert->entry.deadline > horizon) {
+            next = alert->entry.deadline;
+            break;
+        }
+        if (!duer_alert_prefetch_node(alert)) {
+            retry = true;
+        }
+    }
+    if (horizon > s_fetch_horizon) {
+        s_fetch_horizon = horizon;
+    }
+    s_fetch_retry = retry;
+    duer_mutex_unlock(s_alert_mutex);
+
+    if (next >= 0) {
+        wake = duer_clock_mono_us(next - ALERT_PREFETCH_LEAD_S * 1000LL);
+    }
+    if (retry) {
+        int64_t again = duer_sched_now_us() + ALERT_PREFETCH_RETRY_S * 1000000LL;
+        if (wake < 0 || again < wake) {
+            wake = again;
+        }
+    }
+    if (wake >= 0) {
+        duer_sched_add(&s_fetch_timer, wake);
+    }
+}
+
+/*
+ * Scheduler job queued by the SetAlert handler: works out the deadline and
+ * re-queues the same timer for it.
+ */
+static void duer_alert_set_job(void *param)
+{
+    duerapp_alert_node *alert = (duerapp_alert_node *)param;
+    duerapp_alert_node *old = NULL;
+    duer_errcode_t rs = DUER_OK;
+    time_t time_stamp = 0;
+    duer_alert_record_t record;
 
     DUER_LOGI("set alert: scheduled_time: %s, token: %s\n", alert->time, alert->token);
     time_stamp = duer_dcs_get_time_stamp(alert->time);
     if (time_stamp < 0) {
-        duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
+        duer_alert_report(alert->token, SET_ALERT_FAIL);
         duer_free_alert_node(alert);
         return;
     }
 
     DUER_LOGI("time_stamp: %d\n", time_stamp);
 
-    ret = duer_ntp_client(NULL, 0, &cur_time, NULL);
-    if (ret < 0) {
-        DUER_LOGE("Failed to get NTP time.ret = %d", ret);
-        duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
-        duer_free_alert_node(alert);
-        return;
+    if (!duer_clock_synced()) {
+        DUER_LOGW("No NTP time yet, the alert follows the system clock");
     }
 
-    if (time_stamp <= cur_time.sec) {
+    // the clock thread keeps the estimate, no network round trip here
+    if (time_stamp * 1000LL <= duer_clock_now_ms()) {
         DUER_LOGE("The alert is expired\n");
-        duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
+        duer_alert_report(alert->token, SET_ALERT_FAIL);
         duer_free_alert_node(alert);
         return;
     }
 
-    delay = (time_stamp - cur_time.sec) * 1000 - cur_time.usec / 1000;
-
-    alert->handle = duer_timer_acquire(duer_alert_callback, alert, DUER_TIMER_ONCE);
-    if (!alert->handle) {
-        DUER_LOGE("Failed to set alert: failed to create timer\n");
-        duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
+    alert->entry.deadline = time_stamp * 1000LL;
+    if (duer_alert_arm(alert) != 0) {
+        DUER_LOGE("Failed to set alert: failed to start timer\n");
+        duer_alert_report(alert->token, SET_ALERT_FAIL);
         duer_free_alert_node(alert);
         return;
     }
 
-    rs = duer_timer_start(alert->handle, delay);
+    duer_mutex_lock(s_alert_mutex);
+    // the same token again updates the alert
+    old = duer_find_target_alert(alert->token);
+    if (old) {
+        duer_alert_list_remove(old);
+    }
+    rs = duer_alert_list_push(alert);
+    if (rs == DUER_OK && alert->entry.deadline <= s_fetch_horizon
+            && !duer_alert_prefetch_node(alert)) {
+        s_fetch_retry = true;
+    }
+    if (rs == DUER_OK && s_journal_open) {
+        duer_alert_record_fill(alert, &record);
+        if (duer_alert_journal_set(&record) != 0) {
+            DUER_LOGW("alert %s is not journaled, it is lost on restart", alert->token);
+        }
+    }
+    duer_mutex_unlock(s_alert_mutex);
+    if (old) {
+        duer_free_alert_node(old);
+    }
     if (rs != DUER_OK) {
-        DUER_LOGE("Failed to set alert: failed to start timer\n");
-        duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
+        duer_alert_report(alert->token, SET_ALERT_FAIL);
         duer_free_alert_node(alert);
         return;
     }
-
-    duer_mutex_lock(s_alert_mutex);
-    duer_alert_list_push(alert);
-    duer_mutex_unlock(s_alert_mutex);
-    duer_dcs_report_alert_event(alert->token, SET_ALERT_SUCCESS);
+    duer_alert_report(alert->token, SET_ALERT_SUCCESS);
+    duer_sched_add(&s_fetch_timer, duer_sched_now_us());
 }
 
 duer_status_t duer_dcs_tone_alert_set_handler(const baidu_json *directive)
@@ -525,15 +1001,12 @@ duer_status_t duer_dcs_tone_alert_set_handler(const baidu_json *directive)
     duerapp_alert_node *alert = NULL;
     alert = duer_create_alert_node(directive);
     if(alert && alert->token && alert->type && alert->time) {
-        pthread_t set_alert_threadid;
-        int ret = pthread_create(&set_alert_threadid, NULL,
-                                 (void *)duer_alert_set_thread,
-                                 (void *)alert);
-        if(ret != 0) {
-            DUER_LOGE("Create alert pthread failed!");
-            duer_dcs_report_alert_event(alert->token, SET_ALERT_FAIL);
-        } else {
-            pthread_setname_np(set_alert_threadid, "alert_set");
+        // handled in order on the scheduler thread, no thread per alert
+        duer_sched_timer_init(&alert->timer, duer_alert_set_job, alert);
+        if (duer_sched_add(&alert->timer, duer_sched_now_us()) != 0) {
+            DUER_LOGE("Queue SetAlert failed!");
+            duer_alert_report(alert->token, SET_ALERT_FAIL);
+            duer_free_alert_node(alert);
         }
         return DUER_OK;
     } else {
@@ -544,18 +1017,9 @@ duer_status_t duer_dcs_tone_alert_set_handler(const baidu_json *directive)
 
 static duerapp_alert_node *duer_find_target_alert(const char *token)
 {
-    duer_alert_list_t *node = s_alert_head.next;
-    while (node) {
-        if (node->data) {
-            if (strcmp(token, node->data->token) == 0) {
-                return node->data;
-            }
-        }
-
-        node = node->next;
-    }
+    duer_alert_entry_t *entry = duer_alert_store_find(&s_alert_store, token);
 
-    return NULL;
+    return entry ? (duerapp_alert_node *)entry->data : NULL;
 }
 
 void duer_dcs_alert_delete_handler(const char *token)
@@ -570,40 +1034,263 @@ void duer_dcs_alert_delete_handler(const char *token)
     if (!target_alert) {
         DUER_LOGE("Cannot find the target alert\n");
         duer_mutex_unlock(s_alert_mutex);
-        duer_dcs_report_alert_event(token, DELETE_ALERT_FAIL);
+        duer_alert_report(token, DELETE_ALERT_FAIL);
         return;
     }
 
     duer_alert_list_remove(target_alert);
+    if (s_journal_open) {
+        duer_alert_journal_delete(token);
+    }
+
+    duer_mutex_unlock(s_alert_mutex);
+
+    // unlocked: a firing callback of this alert takes s_alert_mutex
     duer_free_alert_node(target_alert);
+    duer_alert_report(token, DELETE_ALERT_SUCCESS);
+}
 
+/*
+ * One allocation holds the snapshot array and the strings behind it.
+ */
+static duer_alert_snapshot_t *duer_alert_snapshot(int *count)
+{
+    duer_alert_snapshot_t *snap = NULL;
+    size_t size = 0;
+    int num = 0;
+
+    duer_mutex_lock(s_alert_mutex);
+    num = duer_alert_store_count(&s_alert_store);
+    size = num * sizeof(duer_alert_snapshot_t);
+    for (duer_alert_entry_t *entry = duer_alert_store_first(&s_alert_store); entry;
+         entry = duer_alert_store_next(entry)) {
+        duerapp_alert_node *alert = entry->data;
+        size += strlen(alert->token) + strlen(alert->type) + strlen(alert->time) + 3;
+    }
+    snap = num ? (duer_alert_snapshot_t *)DUER_MALLOC(size) : NULL;
+    if (snap) {
+        char *str = (char *)(snap + num);
+        duer_alert_entry_t *entry = duer_alert_store_first(&s_alert_store);
+        for (int i = 0; i < num; i++, entry = duer_alert_store_next(entry)) {
+            duerapp_alert_node *alert = entry->data;
+            snap[i].token = str;
+            str = stpcpy(str, alert->token) + 1;
+            snap[i].type = str;
+            str = stpcpy(str, alert->type) + 1;
+            snap[i].time = str;
+            str = stpcpy(str, alert->time) + 1;
+            snap[i].isbell = alert->isbell;
+        }
+    }
     duer_mutex_unlock(s_alert_mutex);
 
-    duer_dcs_report_alert_event(token, DELETE_ALERT_SUCCESS);
+    *count = snap ? num : 0;
+    return snap;
 }
 
 void duer_dcs_get_all_alert(baidu_json *alert_array)
 {
-    duer_alert_list_t *alert_node = s_alert_head.next;
     duer_dcs_alert_info_type alert_info;
-    bool is_active = false;
+    int count = 0;
+    duer_alert_snapshot_t *snap = duer_alert_snapshot(&count);
+
+    // deadline order, the lock is not held while the JSON is built
+    for (int i = 0; i < count; i++) {
+        alert_info.token = (char *)snap[i].token;
+        alert_info.type = (char *)snap[i].type;
+        alert_info.time = (char *)snap[i].time;
+        duer_insert_alert_list(alert_array, &alert_info, snap[i].isbell);
+    }
+    if (snap) {
+        DUER_FREE(snap);
+    }
+}
 
-    while (alert_node) {
-        alert_info.token = alert_node->data->token;
-        alert_info.type = alert_node->data->type;
-        alert_info.time = alert_node->data->time;
-        duer_insert_alert_list(alert_array, &alert_info, alert_node->data->isbell);
-        alert_node = alert_node->next;
+/*
+ * Rewrite the journal from the store once it is mostly dead records. Fired
+ * alerts stay in the store until the cloud deletes them but not in the
+ * journal.
+ */
+static void duer_alert_compact(void)
+{
+    duer_alert_record_t *records = NULL;
+    int num = 0;
+    int live = 0;
+
+    duer_mutex_lock(s_alert_mutex);
+    num = duer_alert_store_count(&s_alert_store);
+    if (s_journal_open && duer_alert_journal_needs_compact(num)) {
+        records = (duer_alert_record_t *)DUER_MALLOC((num ? num : 1) * sizeof(*records));
+        if (records) {
+            for (duer_alert_entry_t *entry = duer_alert_store_first(&s_alert_store); entry;
+                 entry = duer_alert_store_next(entry)) {
+                duerapp_alert_node *alert = entry->data;
+                if (!alert->fired) {
+                    duer_alert_record_fill(alert, &records[live++]);
+                }
+            }
+            if (duer_alert_journal_compact(records, live) != 0) {
+                DUER_LOGW("alert journal compaction failed");
+            }
+            DUER_FREE(records);
+        }
     }
+    duer_mutex_unlock(s_alert_mutex);
 }
 
-void duer_alert_init()
+static void duer_alert_compact_job(void *param)
+{
+    duer_alert_compact();
+    duer_sched_add(&s_compact_timer, duer_sched_now_us() + ALERT_COMPACT_INTERVAL_MS * 1000LL);
+}
+
+/*
+ * Runs once connected. The restored alerts go up with the synced state, the
+ * cloud then sends SetAlert and DeleteAlert for whatever changed while the
+ * device was away, and those land in the journal like any other.
+ */
+static void duer_alert_reconcile_job(void *param)
+{
+    duer_alert_journal_stats_t stats;
+
+    duer_alert_event_flush();
+    duer_alert_compact();
+    duer_alert_journal_get_stats(&stats);
+    DUER_LOGI("alert journal: %u records, %u/%u bytes, %u compactions",
+              stats.records, stats.used_bytes, stats.file_bytes, stats.compactions);
+}
+
+static void duer_alert_replay(const char *token, const duer_alert_record_t *record, void *ctx)
+{
+    duer_alert_entry_t *entry = duer_alert_store_find(&s_alert_store, token);
+    duerapp_alert_node *alert = NULL;
+
+    if (entry) {
+        duer_alert_list_remove(entry->data);
+        duer_free_alert_node(entry->data);
+    }
+    if (record) {
+        alert = duer_alert_node_from_record(record);
+        if (alert && duer_alert_list_push(alert) != DUER_OK) {
+            duer_free_alert_node(alert);
+        }
+    }
+}
+
+static int duer_alert_store_open(void)
 {
     if (!s_alert_mutex) {
         s_alert_mutex = duer_mutex_create();
     }
-    if (!s_bell_mutex) {
-        s_bell_mutex = duer_mutex_create();
+    if (!s_alert_store.slots && duer_alert_store_init(&s_alert_store) != 0) {
+        DUER_LOGE("Alert store init failed!");
+        return -1;
+    }
+    return 0;
+}
+
+int duer_alert_init_local(duer_alert_report_cb report)
+{
+    if (s_loaded || duer_alert_store_open() != 0) {
+        return -1;
+    }
+    s_loaded = true;
+    s_report = report;
+    duer_sched_timer_init(&s_fetch_timer, duer_alert_fetch_job, NULL);
+
+    return 0;
+}
+
+void duer_alert_load()
+{
+    int64_t start = 0;
+    int64_t now_ms = 0;
+    int num = 0;
+    int armed = 0;
+
+    if (duer_alert_store_open() != 0) {
+        return;
+    }
+    if (duer_sched_init() != 0) {
+        DUER_LOGE("Alert scheduler init failed!");
+        return;
+    }
+    if (!s_bell_started) {
+        if (pthread_create(&s_bell_tid, NULL, (void *)duer_bell_thread, NULL) != 0) {
+            DUER_LOGE("Create alert pthread failed!");
+            return;
+        }
+        pthread_detach(s_bell_tid);
+        pthread_setname_np(s_bell_tid, "alert_bell");
+        s_bell_started = true;
+        duer_sched_set_tick_cb(duer_bell_flush, NULL);
+    }
+    if (s_loaded) {
+        return;
+    }
+    s_loaded = true;
+    s_prefetch_on = duer_alert_prefetch_init() == 0;
+    if (!s_prefetch_on) {
+        DUER_LOGW("Alert assets are not prefetched, they stream when ringing");
+    }
+    duer_sched_timer_init(&s_fetch_timer, duer_alert_fetch_job, NULL);
+    if (duer_clock_init(duer_alert_clock_sync) != 0) {
+        DUER_LOGW("No NTP sync, alerts follow the system clock");
+    }
+
+    start = duer_sched_now_us();
+    duer_mutex_lock(s_alert_mutex);
+    s_journal_open = duer_alert_journal_open(ALERT_JOURNAL_PATH, duer_alert_replay, NULL) == 0;
+    if (!s_journal_open) {
+        DUER_LOGW("alert journal unavailable, alerts are kept in memory only");
     }
+
+    // the system clock until the first NTP answer, then the timers move
+    now_ms = duer_clock_now_ms();
+    for (duer_alert_entry_t *entry = duer_alert_store_first(&s_alert_store); entry;) {
+        duerapp_alert_node *alert = entry->data;
+        // removal unlinks it, step first
+        entry = duer_alert_store_next(entry);
+        if (alert->entry.deadline + ALERT_REPLAY_GRACE_MS < now_ms) {
+            DUER_LOGI("alert %s expired while stopped", alert->token);
+            duer_alert_list_remove(alert);
+            if (s_journal_open) {
+                duer_alert_journal_delete(alert->token);
+            }
+            duer_free_alert_node(alert);
+            continue;
+        }
+        if (duer_alert_arm(alert) == 0) {
+            armed++;
+        }
+    }
+    num = duer_alert_store_count(&s_alert_store);
+    duer_mutex_unlock(s_alert_mutex);
+    DUER_LOGI("alert journal: restored %d alerts, %d armed, in %lld us",
+              num, armed, duer_sched_now_us() - start);
+    duer_sched_add(&s_fetch_timer, duer_sched_now_us());
+
+    if (s_journal_open) {
+        duer_sched_timer_init(&s_compact_timer, duer_alert_compact_job, NULL);
+        duer_sched_timer_init(&s_reconcile_timer, duer_alert_reconcile_job, NULL);
+        duer_sched_add(&s_compact_timer,
+                       duer_sched_now_us() + ALERT_COMPACT_INTERVAL_MS * 1000LL);
+    }
+}
+
+void duer_alert_init()
+{
+    // normally done before connecting, so restored alerts ring offline too
+    duer_alert_load();
     duer_dcs_alert_init();
+    // what rang while offline is reported now
+    pthread_mutex_lock(&s_event_lock);
+    s_dcs_ready = true;
+    pthread_mutex_unlock(&s_event_lock);
+    duer_alert_event_flush();
+    // the network is up now, no need to wait out the NTP backoff
+    duer_clock_sync_now();
+    if (s_journal_open) {
+        duer_sched_add(&s_reconcile_timer, duer_sched_now_us());
+    }
 }
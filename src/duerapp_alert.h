@@ -22,7 +22,22 @@
 #ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_H
 #define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_H
 
+#include "lightduer_dcs_alert.h"
+
+typedef void (*duer_alert_report_cb)(const char *token, duer_dcs_alert_event_type type);
+
+/*
+ * Restore journaled alerts and start their timers, no network needed.
+ */
+void duer_alert_load();
 void duer_alert_init();
+
+/*
+ * For benchmarks: alerts without cloud, bell, journal or NTP. Events go to
+ * report, timers to whichever scheduler the caller started. Instead of
+ * duer_alert_load() and duer_alert_init().
+ */
+int duer_alert_init_local(duer_alert_report_cb report);
 void duer_set_alert_ring(char *ring);
 char *duer_get_alert_ring();
 void duer_alert_stop();
@@ -0,0 +1,384 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_bench.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Alert benchmarks. Tokens look like the cloud's: 36 character uuids.
+ *       The stress run drives the real alert module on the virtual
+ *       scheduler, so a day passes in well under a second and the fire
+ *       times it checks come from the scheduling logic alone, not from
+ *       how busy the machine is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "duerapp_alert_bench.h"
+#include "duerapp_alert_store.h"
+#include "duerapp_alert.h"
+#include "duerapp_sched.h"
+#include "duerapp_clock.h"
+#include "duerapp_histogram.h"
+
+#define ALERT_BENCH_TOKEN_LEN   (37)
+#define ALERT_STRESS_LEAD_S     (60)            // the first alert is this far ahead
+#define ALERT_STRESS_START_US   (1000000LL)     // virtual monotonic time at start
+
+typedef struct{
+    duer_alert_entry_t entry;
+    char token[ALERT_BENCH_TOKEN_LEN];
+}bench_alert_t;
+
+static int64_t bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_token(char *token, int i)
+{
+    snprintf(token, ALERT_BENCH_TOKEN_LEN, "%08x-%04x-4%03x-a%03x-%012x",
+             (unsigned int)rand(), i & 0xffff, (unsigned int)rand() & 0xfff,
+             (unsigned int)rand() & 0xfff, (unsigned int)i);
+}
+
+typedef struct{
+    int64_t deadline;       // ms since the epoch, as the alert module parses it
+    char token[ALERT_BENCH_TOKEN_LEN];
+    bool deleted;
+    int fired;
+}stress_alert_t;
+
+static stress_alert_t *s_stress = NULL;
+static int s_stress_num = 0;
+static int s_events[ALERT_STOP + 1];
+static int s_bad_fires = 0;
+static int s_early = 0;
+static duer_histogram_t s_jitter;
+
+static void bench_log(const char *what, int count, int64_t ns)
+{
+    DUER_LOGI("alert %s: %d in %lld us, %lld ns each", what, count,
+              (long long)(ns / 1000), (long long)(count ? ns / count : 0));
+}
+
+int duer_alert_bench_store(int count)
+{
+    duer_alert_store_t store;
+    bench_alert_t *alerts = NULL;
+    int64_t start = 0;
+    int ret = 0;
+
+    if (count <= 0) {
+        count = ALERT_BENCH_COUNT_DEFAULT;
+    }
+    alerts = (bench_alert_t *)calloc(count, sizeof(bench_alert_t));
+    if (!alerts || duer_alert_store_init(&store) != 0) {
+        free(alerts);
+        return -1;
+    }
+    srand((unsigned int)time(NULL));
+    for (int i = 0; i < count; i++) {
+        bench_token(alerts[i].token, i);
+        alerts[i].entry.token = alerts[i].token;
+        // a year of alerts, in ms since the epoch
+        alerts[i].entry.deadline = 1500000000000LL + (int64_t)(rand() % 31536000) * 1000;
+        alerts[i].entry.data = &alerts[i];
+    }
+
+    start = bench_now_ns();
+    for (int i = 0; i < count; i++) {
+        if (duer_alert_store_put(&store, &alerts[i].entry) != 0) {
+            DUER_LOGE("alert store put %d failed", i);
+            ret = -1;
+        }
+    }
+    bench_log("store put", count, bench_now_ns() - start);
+    // the tree links live in the entry, only the hash table is extra
+    DUER_LOGI("alert store index: %u slots, %d bytes per alert",
+              store.slot_num, (int)(store.slot_num * sizeof(duer_alert_entry_t *) / count
+                                    + 3 * sizeof(duer_alert_entry_t *) + sizeof(uint32_t)));
+
+    start = bench_now_ns();
+    for (int i = count - 1; i >= 0; i--) {
+        if (duer_alert_store_find(&store, alerts[i].token) != &alerts[i].entry) {
+            ret = -1;
+        }
+    }
+    bench_log("store find", count, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    int walked = 0;
+    for (duer_alert_entry_t *entry = duer_alert_store_first(&store); entry;
+         entry = duer_alert_store_next(entry)) {
+        duer_alert_entry_t *next = duer_alert_store_next(entry);
+        if (next && entry->deadline > next->deadline) {
+            ret = -1;
+        }
+        walked++;
+    }
+    if (walked != count) {
+        ret = -1;
+    }
+    bench_log("store deadline walk", count, bench_now_ns() - start);
+
+    // random order, like DeleteAlert directives
+    start = bench_now_ns();
+    for (int i = 0; i < count; i++) {
+        int k = rand() % count;
+        if (alerts[k].entry.stored) {
+            duer_alert_store_remove(&store, &alerts[k].entry);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (alerts[i].entry.stored) {
+            duer_alert_store_remove(&store, &alerts[i].entry);
+        }
+    }
+    bench_log("store remove", count, bench_now_ns() - start);
+    if (duer_alert_store_count(&store) != 0) {
+        ret = -1;
+    }
+
+    duer_alert_store_destroy(&store);
+    free(alerts);
+    if (ret != 0) {
+        DUER_LOGE("alert store returned a wrong answer");
+    }
+    return ret;
+}
+
+/*
+ * Fields read from /proc/self/status, e.g. "Threads:" or "VmRSS:".
+ */
+static long proc_status(const char *field)
+{
+    char line[128];
+    long value = -1;
+    size_t len = strlen(field);
+    FILE *file = fopen("/proc/self/status", "r");
+
+    if (!file) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, len) == 0) {
+            value = atol(line + len);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+static void stress_report(const char *token, duer_dcs_alert_event_type type)
+{
+    const char *index = strrchr(token, '-');
+    int i = index ? (int)strtol(index + 1, NULL, 16) : -1;
+
+    if (type <= ALERT_STOP) {
+        s_events[type]++;
+    }
+    if (type != ALERT_START) {
+        return;
+    }
+    if (i < 0 || i >= s_stress_num || strcmp(s_stress[i].token, token) != 0
+            || s_stress[i].deleted || s_stress[i].fired) {
+        s_bad_fires++;
+        return;
+    }
+    s_stress[i].fired++;
+
+    int64_t late = duer_sched_now_us() - duer_clock_mono_us(s_stress[i].deadline);
+    if (late < 0) {
+        s_early++;
+        late = -late;
+    }
+    duer_histogram_add(&s_jitter, (uint32_t)late);
+}
+
+/*
+ * scheduledTime as the cloud sends it. The deadline is worked out the way
+ * the alert module parses the string, whatever the local time zone.
+ */
+static baidu_json *stress_directive(stress_alert_t *alert, time_t deadline)
+{
+    char json[512];
+    char time_str[32];
+    struct tm tm;
+    time_t local = deadline - 8 * 60 * 60;
+
+    localtime_r(&local, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S+08:00", &tm);
+    tm.tm_isdst = 0;
+    alert->deadline = (mktime(&tm) + 8 * 60 * 60) * 1000LL;
+    snprintf(json, sizeof(json),
+             "{\"header\":{\"namespace\":\"ai.dueros.device_interface.alerts\","
+             "\"name\":\"SetAlert\"},\"payload\":{\"token\":\"%s\","
+             "\"type\":\"ALARM\",\"scheduledTime\":\"%s\",\"assetPlayOrder\":[\"a\"],"
+             "\"assets\":[{\"assetId\":\"a\",\"url\":\"http://example.com/ring/%s.mp3\"}]}}",
+             alert->token, time_str, alert->token + 28);
+    return baidu_json_Parse(json);
+}
+
+static int stress_feed(baidu_json **directives, int count)
+{
+    int failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!directives[i] || duer_dcs_tone_alert_set_handler(directives[i]) != DUER_OK) {
+            failed++;
+        }
+    }
+    // the handlers only queue, the set jobs run now
+    duer_sched_advance(duer_sched_now_us());
+    return failed;
+}
+
+int duer_alert_bench_stress(int count)
+{
+    baidu_json **directives = NULL;
+    int updates = 0;
+    int deletes = 0;
+    int alive = 0;
+    int ret = 0;
+    int64_t start = 0;
+    long rss = 0;
+    long threads = proc_status("Threads:");
+    time_t base = time(NULL) + ALERT_STRESS_LEAD_S;
+    duer_sched_stats_t stats;
+
+    if (count <= 0) {
+        count = ALERT_BENCH_COUNT_DEFAULT;
+    }
+    s_stress = (stress_alert_t *)calloc(count, sizeof(stress_alert_t));
+    directives = (baidu_json **)calloc(count, sizeof(baidu_json *));
+    if (!s_stress || !directives || duer_sched_init_virtual(ALERT_STRESS_START_US) != 0) {
+        free(s_stress);
+        free(directives);
+        return -1;
+    }
+    s_stress_num = count;
+    memset(s_events, 0, sizeof(s_events));
+    duer_histogram_init(&s_jitter, "alert fire error", "us");
+    duer_clock_set(time(NULL) * 1000LL);
+    if (duer_alert_init_local(stress_report) != 0) {
+        duer_sched_destroy();
+        free(s_stress);
+        free(directives);
+        return -1;
+    }
+
+    srand((unsigned int)time(NULL));
+    for (int i = 0; i < count; i++) {
+        bench_token(s_stress[i].token, i);
+        directives[i] = stress_directive(&s_stress[i], base + rand() % ALERT_STRESS_SPAN_S);
+    }
+
+    // the directives are parsed already, only the alerts count
+    rss = proc_status("VmRSS:");
+    start = bench_now_ns();
+    if (stress_feed(directives, count)) {
+        ret = -1;
+    }
+    bench_log("stress set", count, bench_now_ns() - start);
+    DUER_LOGI("alert stress memory: %ld bytes per alert",
+              (proc_status("VmRSS:") - rss) * 1024 / count);
+
+    // the same token again moves the alert
+    for (int i = 0; i < count; i += 10) {
+        baidu_json_Delete(directives[i]);
+        directives[i] = stress_directive(&s_stress[i], base + rand() % ALERT_STRESS_SPAN_S);
+        updates++;
+    }
+    start = bench_now_ns();
+    for (int i = 0; i < count; i += 10) {
+        if (directives[i] && duer_dcs_tone_alert_set_handler(directives[i]) != DUER_OK) {
+            ret = -1;
+        }
+    }
+    duer_sched_advance(duer_sched_now_us());
+    bench_log("stress update", updates, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (int i = 0; i < count / 4; i++) {
+        int k = rand() % count;
+        if (!s_stress[k].deleted) {
+            duer_dcs_alert_delete_handler(s_stress[k].token);
+            s_stress[k].deleted = true;
+            deletes++;
+        }
+    }
+    bench_log("stress delete", deletes, bench_now_ns() - start);
+    if (s_events[SET_ALERT_SUCCESS] != count + updates || s_events[SET_ALERT_FAIL]
+            || s_events[DELETE_ALERT_SUCCESS] != deletes) {
+        DUER_LOGE("alert stress: %d set, %d set failed, %d deleted",
+                  s_events[SET_ALERT_SUCCESS], s_events[SET_ALERT_FAIL],
+                  s_events[DELETE_ALERT_SUCCESS]);
+        ret = -1;
+    }
+
+    // a day and a bit, in one go
+    start = bench_now_ns();
+    duer_sched_advance(duer_sched_now_us()
+                       + (ALERT_STRESS_LEAD_S + ALERT_STRESS_SPAN_S + 60) * 1000000LL);
+    DUER_LOGI("alert stress: %d s of virtual time in %lld ms",
+              ALERT_STRESS_LEAD_S + ALERT_STRESS_SPAN_S + 60,
+              (long long)((bench_now_ns() - start) / 1000000));
+
+    for (int i = 0; i < count; i++) {
+        if (!s_stress[i].deleted) {
+            alive++;
+            if (s_stress[i].fired != 1) {
+                ret = -1;
+            }
+        }
+    }
+    DUER_LOGI("alert stress: %d of %d alerts fired, %d misfired, %d early",
+              s_events[ALERT_START], alive, s_bad_fires, s_early);
+    duer_histogram_log(&s_jitter);
+    DUER_LOGI("alert stress threads: %ld before, %ld after", threads, proc_status("Threads:"));
+    if (s_bad_fires) {
+        ret = -1;
+    }
+
+    // fired alerts stay until the cloud deletes them
+    for (int i = 0; i < count; i++) {
+        if (!s_stress[i].deleted) {
+            duer_dcs_alert_delete_handler(s_stress[i].token);
+        }
+        if (directives[i]) {
+            baidu_json_Delete(directives[i]);
+        }
+    }
+    duer_sched_get_stats(&stats);
+    DUER_LOGI("alert stress sched: %u fired in %u wakeups, %u pending",
+              stats.fired, stats.wakeups, stats.pending);
+    duer_sched_destroy();
+    free(directives);
+    free(s_stress);
+    s_stress = NULL;
+    s_stress_num = 0;
+    if (ret != 0) {
+        DUER_LOGE("alert stress found a lost or misfired alert");
+    }
+    return ret;
+}
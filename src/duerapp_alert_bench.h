@@ -0,0 +1,46 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_bench.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Alert benchmarks, without the cloud connection.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_BENCH_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_BENCH_H
+
+#include "duerapp_config.h"
+
+#define ALERT_BENCH_COUNT_DEFAULT   (10000)
+#define ALERT_STRESS_SPAN_S         (24 * 60 * 60)  // alerts spread over a virtual day
+
+/*
+ * Put, find, walk in deadline order and remove count alerts in a private
+ * store and log the cost of each. Returns -1 when the store gave a wrong
+ * answer.
+ */
+int duer_alert_bench_store(int count);
+
+/*
+ * Feed count SetAlert directives to the alert module, update a tenth of them,
+ * delete a quarter, then let a virtual day pass. Logs set/delete cost,
+ * memory per alert, how far from its deadline each alert fired, and the
+ * thread count. Nothing is rung or sent. Returns -1 when an alert is lost,
+ * fires twice or fires after its delete.
+ */
+int duer_alert_bench_stress(int count);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_BENCH_H
@@ -0,0 +1,418 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_journal.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: The journal file is mapped shared. A record is a small header with
+ *       a CRC-32 of its payload, written after the payload and synced with
+ *       msync(), so a torn append is detected and dropped on replay. A
+ *       compaction writes the live alerts to a new file and renames it over
+ *       the old one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "duerapp_alert_journal.h"
+
+#define JOURNAL_MAGIC       (0x4a4c4144)    // "DALJ"
+#define JOURNAL_VERSION     (1)
+#define RECORD_MAGIC        (0x44524c41)    // "ALRD"
+#define RECORD_SET          (1)
+#define RECORD_DELETE       (2)
+#define RECORD_ALIGN        (8)
+#define COMPACT_RECORDS_MIN (64)            // not worth a rewrite below this
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t reserved[2];
+}journal_head_t;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t len;           // payload bytes
+    uint32_t crc;           // CRC-32 of the payload
+    uint32_t op;
+}record_head_t;
+
+static char s_path[PATH_MAX];
+static int s_fd = -1;
+static uint8_t *s_map = NULL;
+static size_t s_size = 0;   // mapped bytes, the file size
+static size_t s_end = 0;    // where the next record goes
+static duer_alert_journal_stats_t s_stats;
+static uint32_t s_crc_table[256];
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+
+    if (!s_crc_table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            s_crc_table[i] = c;
+        }
+    }
+    for (size_t i = 0; i < size; i++) {
+        crc = s_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+static size_t record_size(size_t len)
+{
+    return (sizeof(record_head_t) + len + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+static size_t set_payload_len(const duer_alert_record_t *record)
+{
+    size_t len = sizeof(int64_t) + sizeof(uint32_t)
+                 + strlen(record->token) + strlen(record->type) + strlen(record->time) + 3;
+
+    for (int i = 0; i < record->ring_count; i++) {
+        len += (record->ring_tab[i] ? strlen(record->ring_tab[i]) : 0) + 1;
+    }
+    return len;
+}
+
+static uint8_t *put_str(uint8_t *p, const char *str)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    memcpy(p, str ? str : "", len + 1);
+    return p + len + 1;
+}
+
+/*
+ * Payload first, header last: until the header is in place the bytes are
+ * not a record.
+ */
+static void put_record(uint8_t *map, size_t offset, uint32_t op,
+                       const char *token, const duer_alert_record_t *record)
+{
+    record_head_t *head = (record_head_t *)(map + offset);
+    uint8_t *payload = map + offset + sizeof(record_head_t);
+    uint8_t *p = payload;
+
+    if (RECORD_SET == op) {
+        uint32_t ring_count = (uint32_t)record->ring_count;
+        memcpy(p, &record->deadline, sizeof(int64_t));
+        p += sizeof(int64_t);
+        memcpy(p, &ring_count, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        p = put_str(p, record->token);
+        p = put_str(p, record->type);
+        p = put_str(p, record->time);
+        for (int i = 0; i < record->ring_count; i++) {
+            p = put_str(p, record->ring_tab[i]);
+        }
+    } else {
+        p = put_str(p, token);
+    }
+    head->len = (uint32_t)(p - payload);
+    head->crc = crc32(payload, head->len);
+    head->op = op;
+    head->magic = RECORD_MAGIC;
+}
+
+static const char *get_str(const uint8_t **p, const uint8_t *end)
+{
+    const uint8_t *nul = memchr(*p, '\0', end - *p);
+    const char *str = (const char *)*p;
+
+    if (!nul) {
+        return NULL;
+    }
+    *p = nul + 1;
+    return str;
+}
+
+static bool replay_record(const record_head_t *head, duer_alert_replay_cb cb, void *ctx)
+{
+    const uint8_t *p = (const uint8_t *)(head + 1);
+    const uint8_t *end = p + head->len;
+    duer_alert_record_t record;
+    uint32_t ring_count = 0;
+
+    if (RECORD_DELETE == head->op) {
+        const char *token = get_str(&p, end);
+        if (!token) {
+            return false;
+        }
+        cb(token, NULL, ctx);
+        return true;
+    }
+    if (RECORD_SET != head->op || head->len < sizeof(int64_t) + sizeof(uint32_t)) {
+        return false;
+    }
+    memset(&record, 0, sizeof(record));
+    memcpy(&record.deadline, p, sizeof(int64_t));
+    p += sizeof(int64_t);
+    memcpy(&ring_count, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    record.token = get_str(&p, end);
+    record.type = get_str(&p, end);
+    record.time = get_str(&p, end);
+    if (!record.token || !record.type || !record.time || ring_count > ALERT_JOURNAL_RINGS_MAX) {
+        return false;
+    }
+    record.ring_count = (int)ring_count;
+    for (uint32_t i = 0; i < ring_count; i++) {
+        record.ring_tab[i] = get_str(&p, end);
+        if (!record.ring_tab[i]) {
+            return false;
+        }
+        if (!record.ring_tab[i][0]) {
+            // an asset whose url was missing
+            record.ring_tab[i] = NULL;
+        }
+    }
+    cb(record.token, &record, ctx);
+    return true;
+}
+
+static int journal_map(int fd, size_t size, uint8_t **map)
+{
+    if (ftruncate(fd, size) != 0) {
+        return -1;
+    }
+    *map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == *map) {
+        *map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void journal_sync(size_t offset, size_t len)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+
+    msync(s_map + start, offset + len - start, MS_SYNC);
+}
+
+int duer_alert_journal_open(const char *path, duer_alert_replay_cb cb, void *ctx)
+{
+    struct stat st;
+    journal_head_t *head = NULL;
+
+    if (s_map) {
+        return 0;
+    }
+    snprintf(s_path, sizeof(s_path), "%s", path);
+    s_fd = open(s_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s_fd < 0 || fstat(s_fd, &st) != 0) {
+        DUER_LOGE("open alert journal %s: %s", s_path, strerror(errno));
+        goto error;
+    }
+    s_size = st.st_size < ALERT_JOURNAL_SIZE ? ALERT_JOURNAL_SIZE : (size_t)st.st_size;
+    if (journal_map(s_fd, s_size, &s_map) != 0) {
+        DUER_LOGE("map alert journal %s: %s", s_path, strerror(errno));
+        goto error;
+    }
+
+    head = (journal_head_t *)s_map;
+    if (head->magic != JOURNAL_MAGIC || head->version != JOURNAL_VERSION) {
+        if (st.st_size) {
+            DUER_LOGW("alert journal %s unreadable, starting a new one", s_path);
+        }
+        memset(s_map, 0, s_size);
+        head->magic = JOURNAL_MAGIC;
+        head->version = JOURNAL_VERSION;
+        journal_sync(0, sizeof(journal_head_t));
+    }
+
+    s_end = sizeof(journal_head_t);
+    while (s_end + sizeof(record_head_t) <= s_size) {
+        const record_head_t *rec = (const record_head_t *)(s_map + s_end);
+        if (rec->magic != RECORD_MAGIC
+                || rec->len > s_size - s_end - sizeof(record_head_t)
+                || rec->crc != crc32((const uint8_t *)(rec + 1), rec->len)
+                || !replay_record(rec, cb, ctx)) {
+            break;
+        }
+        s_end += record_size(rec->len);
+        s_stats.records++;
+    }
+    if (s_end < s_size && s_map[s_end]) {
+        // a torn append: clear it, a shorter record must not end inside it
+        DUER_LOGW("alert journal: dropped a partial record at %u", (unsigned int)s_end);
+        memset(s_map + s_end, 0, s_size - s_end);
+        journal_sync(s_end, s_size - s_end);
+    }
+    s_stats.used_bytes = s_end;
+    s_stats.file_bytes = s_size;
+
+    return 0;
+
+error:
+    if (s_fd >= 0) {
+        close(s_fd);
+        s_fd = -1;
+    }
+    return -1;
+}
+
+void duer_alert_journal_close(void)
+{
+    if (s_map) {
+        munmap(s_map, s_size);
+        s_map = NULL;
+    }
+    if (s_fd >= 0) {
+        close(s_fd);
+        s_fd = -1;
+    }
+}
+
+/*
+ * Make room for len more bytes, doubling the file.
+ */
+static int journal_reserve(size_t len)
+{
+    size_t size = s_size;
+    uint8_t *map = NULL;
+
+    while (s_end + len > size) {
+        size *= 2;
+    }
+    if (size == s_size) {
+        return 0;
+    }
+    munmap(s_map, s_size);
+    s_map = NULL;
+    if (journal_map(s_fd, size, &map) != 0) {
+        DUER_LOGE("grow alert journal to %u: %s", (unsigned int)size, strerror(errno));
+        // keep appending into what fits, at the old size
+        journal_map(s_fd, s_size, &s_map);
+        return -1;
+    }
+    s_map = map;
+    s_size = size;
+    s_stats.file_bytes = s_size;
+
+    return 0;
+}
+
+static int journal_append(uint32_t op, const char *token, const duer_alert_record_t *record)
+{
+    size_t len = RECORD_SET == op ? set_payload_len(record) : strlen(token) + 1;
+    size_t size = record_size(len);
+
+    if (!s_map || journal_reserve(size) != 0) {
+        return -1;
+    }
+    put_record(s_map, s_end, op, token, record);
+    journal_sync(s_end, size);
+    s_end += size;
+    s_stats.records++;
+    s_stats.used_bytes = s_end;
+
+    return 0;
+}
+
+int duer_alert_journal_set(const duer_alert_record_t *record)
+{
+    return journal_append(RECORD_SET, record->token, record);
+}
+
+int duer_alert_journal_delete(const char *token)
+{
+    return journal_append(RECORD_DELETE, token, NULL);
+}
+
+bool duer_alert_journal_needs_compact(int live)
+{
+    return s_map && s_stats.records > COMPACT_RECORDS_MIN
+           && s_stats.records > 2 * (uint32_t)live;
+}
+
+int duer_alert_journal_compact(const duer_alert_record_t *records, int count)
+{
+    char tmp[PATH_MAX + 8];
+    size_t need = sizeof(journal_head_t);
+    size_t size = ALERT_JOURNAL_SIZE;
+    size_t end = sizeof(journal_head_t);
+    uint8_t *map = NULL;
+    int fd = -1;
+
+    if (!s_map) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        need += record_size(set_payload_len(&records[i]));
+    }
+    // leave as much again for the appends that follow
+    while (size < need * 2) {
+        size *= 2;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s_path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || journal_map(fd, size, &map) != 0) {
+        DUER_LOGE("compact alert journal: %s", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+    ((journal_head_t *)map)->magic = JOURNAL_MAGIC;
+    ((journal_head_t *)map)->version = JOURNAL_VERSION;
+    for (int i = 0; i < count; i++) {
+        put_record(map, end, RECORD_SET, NULL, &records[i]);
+        end += record_size(set_payload_len(&records[i]));
+    }
+    msync(map, end, MS_SYNC);
+    if (rename(tmp, s_path) != 0) {
+        DUER_LOGE("compact alert journal: %s", strerror(errno));
+        munmap(map, size);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    munmap(s_map, s_size);
+    close(s_fd);
+    s_map = map;
+    s_fd = fd;
+    s_size = size;
+    s_end = end;
+    s_stats.records = count;
+    s_stats.used_bytes = end;
+    s_stats.file_bytes = size;
+    s_stats.compactions++;
+    DUER_LOGI("alert journal compacted: %d alerts, %u bytes", count, (unsigned int)end);
+
+    return 0;
+}
+
+void duer_alert_journal_get_stats(duer_alert_journal_stats_t *stats)
+{
+    if (stats) {
+        *stats = s_stats;
+    }
+}
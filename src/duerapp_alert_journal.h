@@ -0,0 +1,87 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_journal.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Append-only alert journal, replayed at start.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_JOURNAL_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_JOURNAL_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define ALERT_JOURNAL_PATH      "./alerts.journal"
+#define ALERT_JOURNAL_SIZE      (256 * 1024)    // initial file size, doubles when full
+#define ALERT_JOURNAL_RINGS_MAX (16)            // assets kept per alert
+
+/*
+ * One alert as journaled. Strings are not copied: on replay they point into
+ * the mapping and are only valid during the callback.
+ */
+typedef struct{
+    int64_t deadline;       // ms since the epoch
+    const char *token;
+    const char *type;
+    const char *time;
+    int ring_count;
+    const char *ring_tab[ALERT_JOURNAL_RINGS_MAX];
+}duer_alert_record_t;
+
+/*
+ * record is NULL for a delete, which only carries the token.
+ */
+typedef void (*duer_alert_replay_cb)(const char *token, const duer_alert_record_t *record,
+                                     void *ctx);
+
+typedef struct{
+    uint32_t records;       // valid records in the file
+    uint32_t used_bytes;
+    uint32_t file_bytes;
+    uint32_t compactions;
+}duer_alert_journal_stats_t;
+
+/*
+ * Map the journal, creating it when missing, and call cb for every record
+ * in order. Replay stops at the first record whose checksum does not match,
+ * which is where a crash cut the last append.
+ */
+int duer_alert_journal_open(const char *path, duer_alert_replay_cb cb, void *ctx);
+void duer_alert_journal_close(void);
+
+/*
+ * Append and sync one record. Not thread safe, the alert lock covers it.
+ */
+int duer_alert_journal_set(const duer_alert_record_t *record);
+int duer_alert_journal_delete(const char *token);
+
+/*
+ * True once most records are superseded or deleted, live being the number
+ * of alerts a compacted journal would hold.
+ */
+bool duer_alert_journal_needs_compact(int live);
+
+/*
+ * Rewrite the journal with only the given alerts, then switch to it with an
+ * atomic rename.
+ */
+int duer_alert_journal_compact(const duer_alert_record_t *records, int count);
+
+void duer_alert_journal_get_stats(duer_alert_journal_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_JOURNAL_H
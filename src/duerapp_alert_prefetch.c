@@ -0,0 +1,179 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_prefetch.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: One thread downloads queued urls into the media cache as pinned
+ *       entries, so LRU eviction of played media cannot drop a ring before
+ *       its alert. The cache writes to a .part file and only indexes it when
+ *       complete, so a hit is always whole. Whether a fetch worked is only
+ *       learned by asking again: the alert module re-adds missing assets
+ *       until the deadline.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "duerapp_alert_prefetch.h"
+#include "duerapp_cache.h"
+
+typedef struct _prefetch_job {
+    struct _prefetch_job *next;
+    char url[0];
+} prefetch_job_t;
+
+static bool s_started = false;
+static pthread_t s_fetch_tid;
+static prefetch_job_t *s_jobs = NULL;
+static char *s_fetching = NULL;     // url of the download in flight
+static pthread_mutex_t s_fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_fetch_cond = PTHREAD_COND_INITIALIZER;
+// guarded by s_fetch_lock
+static duer_alert_prefetch_stats_t s_stats;
+
+static bool prefetch_pending(const char *url)
+{
+    if (s_fetching && strcmp(s_fetching, url) == 0) {
+        return true;
+    }
+    for (prefetch_job_t *job = s_jobs; job; job = job->next) {
+        if (strcmp(job->url, url) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void prefetch_thread()
+{
+    prefetch_job_t *job = NULL;
+
+    while (1) {
+        pthread_mutex_lock(&s_fetch_lock);
+        while (!s_jobs) {
+            pthread_cond_wait(&s_fetch_cond, &s_fetch_lock);
+        }
+        job = s_jobs;
+        s_jobs = job->next;
+        s_fetching = job->url;
+        pthread_mutex_unlock(&s_fetch_lock);
+
+        // rung or played from the network since it was queued
+        if (duer_cache_pin(job->url) != 0) {
+            time_t start = time(NULL);
+            int ret = duer_cache_fetch(job->url, CACHE_CLASS_ALERT, ALERT_PREFETCH_TIMEOUT_S);
+            pthread_mutex_lock(&s_fetch_lock);
+            if (ret == 0) {
+                s_stats.fetched++;
+            } else {
+                s_stats.failed++;
+            }
+            pthread_mutex_unlock(&s_fetch_lock);
+            DUER_LOGI("alert asset %s %s in %lld s", job->url,
+                      ret == 0 ? "fetched" : "not fetched", (long long)(time(NULL) - start));
+        }
+
+        pthread_mutex_lock(&s_fetch_lock);
+        s_fetching = NULL;
+        pthread_mutex_unlock(&s_fetch_lock);
+        free(job);
+    }
+}
+
+int duer_alert_prefetch_init(void)
+{
+    if (s_started) {
+        return 0;
+    }
+    if (!duer_cache_enabled()) {
+        DUER_LOGW("media cache disabled, nowhere to keep alert assets");
+        return -1;
+    }
+    if (pthread_create(&s_fetch_tid, NULL, (void *)prefetch_thread, NULL) != 0) {
+        DUER_LOGE("Create alert fetch pthread failed!");
+        return -1;
+    }
+    pthread_detach(s_fetch_tid);
+    pthread_setname_np(s_fetch_tid, "alert_fetch");
+    s_started = true;
+
+    return 0;
+}
+
+int duer_alert_prefetch_add(const char *url)
+{
+    prefetch_job_t *job = NULL;
+    prefetch_job_t **tail = NULL;
+
+    if (!s_started || !url) {
+        return -1;
+    }
+    if (duer_cache_pin(url) == 0) {
+        return 0;
+    }
+    job = (prefetch_job_t *)malloc(sizeof(prefetch_job_t) + strlen(url) + 1);
+    if (!job) {
+        return -1;
+    }
+    job->next = NULL;
+    strcpy(job->url, url);
+
+    pthread_mutex_lock(&s_fetch_lock);
+    if (prefetch_pending(url)) {
+        pthread_mutex_unlock(&s_fetch_lock);
+        free(job);
+        return -1;
+    }
+    tail = &s_jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+    s_stats.queued++;
+    pthread_cond_signal(&s_fetch_cond);
+    pthread_mutex_unlock(&s_fetch_lock);
+
+    return -1;
+}
+
+int duer_alert_prefetch_lookup(const char *url, char *uri, size_t size)
+{
+    int ret = -1;
+
+    if (!s_started || !url) {
+        return -1;
+    }
+    ret = duer_cache_lookup(url, uri, size);
+    pthread_mutex_lock(&s_fetch_lock);
+    if (ret == 0) {
+        s_stats.hits++;
+    } else {
+        s_stats.misses++;
+    }
+    pthread_mutex_unlock(&s_fetch_lock);
+
+    return ret;
+}
+
+void duer_alert_prefetch_get_stats(duer_alert_prefetch_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_fetch_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_fetch_lock);
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_prefetch.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Downloads alert ring assets into the media cache ahead of the alert.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_PREFETCH_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_PREFETCH_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define ALERT_PREFETCH_LEAD_S       (5 * 60)        // how long before the deadline to fetch
+#define ALERT_PREFETCH_RETRY_S      (30)            // until the deadline, while an asset is missing
+#define ALERT_PREFETCH_TIMEOUT_S    (60)            // per asset
+
+typedef struct{
+    uint32_t queued;
+    uint32_t fetched;
+    uint32_t failed;
+    uint32_t hits;          // rings played from disk
+    uint32_t misses;
+}duer_alert_prefetch_stats_t;
+
+/*
+ * Start the download thread. Fails when the media cache is disabled.
+ */
+int duer_alert_prefetch_init(void);
+
+/*
+ * 0 when the asset is in the cache, pinned there from now on. Otherwise it
+ * is queued, url is copied, unless it already waits; call again later to
+ * learn whether it arrived. Never blocks on the network.
+ */
+int duer_alert_prefetch_add(const char *url);
+
+/*
+ * On a hit, fill uri with a file:// uri of the local copy and return 0.
+ * Safe from any thread.
+ */
+int duer_alert_prefetch_lookup(const char *url, char *uri, size_t size);
+
+void duer_alert_prefetch_get_stats(duer_alert_prefetch_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_PREFETCH_H
@@ -0,0 +1,269 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_store.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Token index is an open-addressing table with linear probing and
+ *       backward-shift deletion, so there are no tombstones to clean up.
+ *       The deadline index is a treap over the same entries, linked through
+ *       them: a search tree on deadline, a heap on a priority taken from the
+ *       token hash, which keeps it balanced in expectation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "duerapp_alert_store.h"
+#include "lightduer_hashcode.h"
+
+static uint32_t token_hash(const char *token)
+{
+    return duer_hashcode(token, strlen(token), 0);
+}
+
+static uint32_t probe(const duer_alert_store_t *store, const char *token)
+{
+    uint32_t mask = store->slot_num - 1;
+    uint32_t i = token_hash(token) & mask;
+
+    while (store->slots[i] && strcmp(store->slots[i]->token, token) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int grow(duer_alert_store_t *store)
+{
+    duer_alert_entry_t **old = store->slots;
+    uint32_t old_num = store->slot_num;
+    duer_alert_entry_t **slots = (duer_alert_entry_t **)calloc(old_num * 2,
+                                 sizeof(duer_alert_entry_t *));
+
+    if (!slots) {
+        return -1;
+    }
+    store->slots = slots;
+    store->slot_num = old_num * 2;
+    for (uint32_t i = 0; i < old_num; i++) {
+        if (old[i]) {
+            store->slots[probe(store, old[i]->token)] = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+/*
+ * Put node where its parent had child.
+ */
+static void replace_child(duer_alert_store_t *store, duer_alert_entry_t *child,
+                          duer_alert_entry_t *node)
+{
+    duer_alert_entry_t *parent = child->parent;
+
+    if (node) {
+        node->parent = parent;
+    }
+    if (!parent) {
+        store->root = node;
+    } else if (parent->left == child) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+}
+
+/*
+ * Rotate node above its parent, the deadline order does not change.
+ */
+static void rotate_up(duer_alert_store_t *store, duer_alert_entry_t *node)
+{
+    duer_alert_entry_t *parent = node->parent;
+
+    replace_child(store, parent, node);
+    if (parent->left == node) {
+        parent->left = node->right;
+        if (node->right) {
+            node->right->parent = parent;
+        }
+        node->right = parent;
+    } else {
+        parent->right = node->left;
+        if (node->left) {
+            node->left->parent = parent;
+        }
+        node->left = parent;
+    }
+    parent->parent = node;
+}
+
+static void tree_insert(duer_alert_store_t *store, duer_alert_entry_t *entry)
+{
+    duer_alert_entry_t **link = &store->root;
+    duer_alert_entry_t *parent = NULL;
+
+    // after all entries with the same deadline
+    while (*link) {
+        parent = *link;
+        link = entry->deadline < parent->deadline ? &parent->left : &parent->right;
+    }
+    entry->left = NULL;
+    entry->right = NULL;
+    entry->parent = parent;
+    entry->priority = token_hash(entry->token);
+    *link = entry;
+    while (entry->parent && entry->parent->priority < entry->priority) {
+        rotate_up(store, entry);
+    }
+}
+
+static void tree_remove(duer_alert_store_t *store, duer_alert_entry_t *entry)
+{
+    // sink it below the higher priority child until one side is empty
+    while (entry->left && entry->right) {
+        rotate_up(store, entry->left->priority > entry->right->priority
+                  ? entry->left : entry->right);
+    }
+    replace_child(store, entry, entry->left ? entry->left : entry->right);
+    entry->left = NULL;
+    entry->right = NULL;
+    entry->parent = NULL;
+}
+
+int duer_alert_store_init(duer_alert_store_t *store)
+{
+    memset(store, 0, sizeof(*store));
+    store->slots = (duer_alert_entry_t **)calloc(ALERT_STORE_INIT, sizeof(duer_alert_entry_t *));
+    if (!store->slots) {
+        return -1;
+    }
+    store->slot_num = ALERT_STORE_INIT;
+
+    return 0;
+}
+
+void duer_alert_store_destroy(duer_alert_store_t *store)
+{
+    for (uint32_t i = 0; i < store->slot_num; i++) {
+        if (store->slots[i]) {
+            store->slots[i]->stored = false;
+        }
+    }
+    free(store->slots);
+    memset(store, 0, sizeof(*store));
+}
+
+int duer_alert_store_put(duer_alert_store_t *store, duer_alert_entry_t *entry)
+{
+    // keep the load at or below one half, probes stay short
+    if ((store->num + 1) * 2 > (int)store->slot_num && grow(store) != 0) {
+        return -1;
+    }
+    uint32_t i = probe(store, entry->token);
+    if (store->slots[i]) {
+        return -1;
+    }
+    store->slots[i] = entry;
+    tree_insert(store, entry);
+    entry->stored = true;
+    store->num++;
+
+    return 0;
+}
+
+duer_alert_entry_t *duer_alert_store_find(const duer_alert_store_t *store, const char *token)
+{
+    if (!token || !store->slots) {
+        return NULL;
+    }
+    return store->slots[probe(store, token)];
+}
+
+void duer_alert_store_remove(duer_alert_store_t *store, duer_alert_entry_t *entry)
+{
+    uint32_t mask = store->slot_num - 1;
+    uint32_t i = probe(store, entry->token);
+
+    if (store->slots[i] != entry) {
+        return;
+    }
+    // backward shift: pull later entries of the run into the hole when their
+    // home slot is not between the hole and where they are now
+    uint32_t hole = i;
+    store->slots[hole] = NULL;
+    for (uint32_t j = (hole + 1) & mask; store->slots[j]; j = (j + 1) & mask) {
+        uint32_t home = token_hash(store->slots[j]->token) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            store->slots[hole] = store->slots[j];
+            store->slots[j] = NULL;
+            hole = j;
+        }
+    }
+
+    tree_remove(store, entry);
+    entry->stored = false;
+    store->num--;
+}
+
+int duer_alert_store_count(const duer_alert_store_t *store)
+{
+    return store->num;
+}
+
+duer_alert_entry_t *duer_alert_store_first(const duer_alert_store_t *store)
+{
+    duer_alert_entry_t *node = store->root;
+
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+duer_alert_entry_t *duer_alert_store_next(const duer_alert_entry_t *entry)
+{
+    const duer_alert_entry_t *node = entry;
+
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (duer_alert_entry_t *)node;
+    }
+    // up until we come from a left subtree
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+duer_alert_entry_t *duer_alert_store_after(const duer_alert_store_t *store, int64_t deadline)
+{
+    duer_alert_entry_t *node = store->root;
+    duer_alert_entry_t *after = NULL;
+
+    while (node) {
+        if (node->deadline > deadline) {
+            after = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return after;
+}
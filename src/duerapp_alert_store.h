@@ -0,0 +1,79 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_alert_store.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Alert store: hash index on token, ordered index on deadline.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_STORE_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_STORE_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define ALERT_STORE_INIT    (16)    // slots, grows by doubling at half load
+
+/*
+ * Embedded in the alert, the store only keeps pointers to it. Not thread
+ * safe: the owner serializes access.
+ */
+typedef struct _duer_alert_entry{
+    const char *token;      // owned by the alert, must not change while stored
+    int64_t deadline;       // ordering key, e.g. ms since the epoch
+    bool stored;
+    void *data;
+    // deadline index links, only the store touches them
+    struct _duer_alert_entry *left;
+    struct _duer_alert_entry *right;
+    struct _duer_alert_entry *parent;
+    uint32_t priority;
+}duer_alert_entry_t;
+
+typedef struct{
+    duer_alert_entry_t **slots;     // open addressing, linear probing
+    uint32_t slot_num;              // power of two
+    duer_alert_entry_t *root;       // treap by deadline, then insertion
+    int num;
+}duer_alert_store_t;
+
+int duer_alert_store_init(duer_alert_store_t *store);
+void duer_alert_store_destroy(duer_alert_store_t *store);
+
+/*
+ * O(1) expected on the hash, O(log n) expected on the deadline index. Fails
+ * when the token is already stored.
+ */
+int duer_alert_store_put(duer_alert_store_t *store, duer_alert_entry_t *entry);
+duer_alert_entry_t *duer_alert_store_find(const duer_alert_store_t *store, const char *token);
+void duer_alert_store_remove(duer_alert_store_t *store, duer_alert_entry_t *entry);
+
+int duer_alert_store_count(const duer_alert_store_t *store);
+
+/*
+ * In deadline order: the earliest entry, and the one after entry. NULL at
+ * the end. Get the next entry before removing the current one.
+ */
+duer_alert_entry_t *duer_alert_store_first(const duer_alert_store_t *store);
+duer_alert_entry_t *duer_alert_store_next(const duer_alert_entry_t *entry);
+
+/*
+ * The first entry due after deadline, NULL when there is none. O(log n).
+ */
+duer_alert_entry_t *duer_alert_store_after(const duer_alert_store_t *store, int64_t deadline);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_ALERT_STORE_H
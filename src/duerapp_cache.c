@@ -0,0 +1,570 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_cache.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Read-through media cache. A miss plays from the network as before
+ *       while a pad probe on playbin's source copies the raw bytes to disk;
+ *       a complete copy is stored under its content hash, so the same
+ *       prompt behind different URLs is kept once. A hit plays file://.
+ *       Alert rings are fetched into the same store from the alert thread
+ *       and pinned, so the index is under s_cache_lock; the probe only
+ *       touches its own writer.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "duerapp_cache.h"
+
+#define CACHE_INDEX     "index"
+#define FNV_OFFSET      (0xcbf29ce484222325ULL)
+#define FNV_PRIME       (0x100000001b3ULL)
+
+typedef struct{
+    uint64_t url_hash;
+    uint64_t content_hash;
+    uint32_t size;
+    time_t last_used;
+    duer_cache_class_t cls;
+}cache_entry_t;
+
+struct _duer_cache_writer{
+    uint64_t url_hash;
+    uint32_t seq;           // keeps two writers of one url off each other's part file
+    duer_cache_class_t cls;
+    uint64_t content_hash;
+    uint64_t offset;        // bytes written, must match the next buffer offset
+    FILE *file;
+    bool broken;            // seek, gap or write error: will not be stored
+    GstPad *pad;
+    gulong probe_id;
+};
+
+static cache_entry_t s_entries[CACHE_ENTRIES_MAX];
+static int s_entry_num = 0;
+static char s_dir[PATH_MAX];
+static uint64_t s_limit = (uint64_t)CACHE_MB_DEFAULT << 20;
+static bool s_enabled = false;
+static duer_cache_stats_t s_stats;
+static pthread_mutex_t s_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t s_writer_seq = 0;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void content_path(uint64_t content_hash, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.bin", s_dir, (unsigned long long)content_hash);
+}
+
+static void part_path(const duer_cache_writer_t *writer, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.%u.part", s_dir,
+             (unsigned long long)writer->url_hash, writer->seq);
+}
+
+/*
+ * Part files left behind by a run that did not close its writers.
+ */
+static void part_sweep()
+{
+    char path[PATH_MAX + 32];
+    struct dirent *ent = NULL;
+    DIR *dir = opendir(s_dir);
+
+    if (!dir) {
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > 5 && strcmp(ent->d_name + len - 5, ".part") == 0) {
+            snprintf(path, sizeof(path), "%s/%s", s_dir, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+static int entry_find(uint64_t url_hash)
+{
+    for (int i = 0; i < s_entry_num; i++) {
+        if (s_entries[i].url_hash == url_hash) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int content_refs(uint64_t content_hash)
+{
+    int refs = 0;
+    for (int i = 0; i < s_entry_num; i++) {
+        if (s_entries[i].content_hash == content_hash) {
+            refs++;
+        }
+    }
+    return refs;
+}
+
+static void index_save()
+{
+    char path[PATH_MAX + 16];
+    char tmp[PATH_MAX + 16];
+
+    snprintf(path, sizeof(path), "%s/%s", s_dir, CACHE_INDEX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "w");
+    if (!file) {
+        DUER_LOGE("save cache index: %s", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < s_entry_num; i++) {
+        fprintf(file, "%016llx %016llx %u %ld %d\n",
+                (unsigned long long)s_entries[i].url_hash,
+                (unsigned long long)s_entries[i].content_hash,
+                s_entries[i].size, (long)s_entries[i].last_used, (int)s_entries[i].cls);
+    }
+    fclose(file);
+    rename(tmp, path);
+}
+
+static void index_load()
+{
+    char path[PATH_MAX + 16];
+    char bin[PATH_MAX + 32];
+    char line[128];
+    unsigned long long url_hash = 0;
+    unsigned long long content_hash = 0;
+    unsigned int size = 0;
+    long last_used = 0;
+    int cls = CACHE_CLASS_MEDIA;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", s_dir, CACHE_INDEX);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    while (s_entry_num < CACHE_ENTRIES_MAX && fgets(line, sizeof(line), file)) {
+        // an index written before the class column holds media entries
+        cls = CACHE_CLASS_MEDIA;
+        if (sscanf(line, "%llx %llx %u %ld %d", &url_hash, &content_hash, &size,
+                   &last_used, &cls) < 4) {
+            continue;
+        }
+        content_path(content_hash, bin, sizeof(bin));
+        // drop entries whose file went missing or was cut short
+        if (stat(bin, &st) != 0 || st.st_size != (off_t)size) {
+            continue;
+        }
+        cache_entry_t *entry = &s_entries[s_entry_num];
+        entry->url_hash = url_hash;
+        entry->content_hash = content_hash;
+        entry->size = size;
+        entry->last_used = last_used;
+        entry->cls = CACHE_CLASS_ALERT == cls ? CACHE_CLASS_ALERT : CACHE_CLASS_MEDIA;
+        if (!content_refs(content_hash)) {
+            s_stats.used_bytes += size;
+        }
+        s_entry_num++;
+    }
+    fclose(file);
+}
+
+static void entry_remove(int index)
+{
+    char path[PATH_MAX + 32];
+    cache_entry_t entry = s_entries[index];
+
+    s_entries[index] = s_entries[--s_entry_num];
+    if (!content_refs(entry.content_hash)) {
+        content_path(entry.content_hash, path, sizeof(path));
+        unlink(path);
+        s_stats.used_bytes -= entry.size;
+    }
+    s_stats.evictions++;
+}
+
+static bool entry_pinned(const cache_entry_t *entry, time_t now)
+{
+    return CACHE_CLASS_ALERT == entry->cls && now - entry->last_used < CACHE_PIN_S;
+}
+
+/*
+ * Evict least recently used entries until need more bytes and one more entry
+ * fit. Pinned entries stay; -1 when they leave no room.
+ */
+static int evict(uint64_t need)
+{
+    time_t now = time(NULL);
+
+    while (s_entry_num >= CACHE_ENTRIES_MAX || s_stats.used_bytes + need > s_limit) {
+        int oldest = -1;
+        for (int i = 0; i < s_entry_num; i++) {
+            if (!entry_pinned(&s_entries[i], now)
+                    && (oldest < 0 || s_entries[i].last_used < s_entries[oldest].last_used)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            return -1;
+        }
+        entry_remove(oldest);
+    }
+    return 0;
+}
+
+void duer_cache_set_limit(int mb)
+{
+    s_limit = mb > 0 ? (uint64_t)mb << 20 : 0;
+}
+
+int duer_cache_init(const char *dir)
+{
+    if (!s_limit) {
+        DUER_LOGI("media cache disabled");
+        return 0;
+    }
+    mkdir(dir, 0755);
+    // playbin needs an absolute file:// uri
+    if (!realpath(dir, s_dir)) {
+        DUER_LOGE("media cache dir %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&s_cache_lock);
+    part_sweep();
+    index_load();
+    evict(0);
+    s_enabled = true;
+    DUER_LOGI("media cache %s: %d entries, %llu of %llu KB",
+              s_dir, s_entry_num, (unsigned long long)(s_stats.used_bytes >> 10),
+              (unsigned long long)(s_limit >> 10));
+    pthread_mutex_unlock(&s_cache_lock);
+
+    return 0;
+}
+
+void duer_cache_destroy(void)
+{
+    pthread_mutex_lock(&s_cache_lock);
+    if (s_enabled) {
+        index_save();
+        DUER_LOGI("media cache: %u/%u hits, %llu KB saved, %u evictions",
+                  s_stats.hits, s_stats.lookups,
+                  (unsigned long long)(s_stats.bytes_saved >> 10), s_stats.evictions);
+    }
+    s_enabled = false;
+    pthread_mutex_unlock(&s_cache_lock);
+}
+
+bool duer_cache_enabled(void)
+{
+    return s_enabled;
+}
+
+/*
+ * Called with the lock held. The entry of url if its file is still there.
+ */
+static cache_entry_t *entry_get(const char *url, char *path, size_t size)
+{
+    int i = entry_find(fnv1a(FNV_OFFSET, url, strlen(url)));
+
+    if (i < 0) {
+        return NULL;
+    }
+    content_path(s_entries[i].content_hash, path, size);
+    if (access(path, R_OK) != 0) {
+        entry_remove(i);
+        return NULL;
+    }
+    return &s_entries[i];
+}
+
+int duer_cache_lookup(const char *url, char *uri, size_t size)
+{
+    char path[PATH_MAX + 32];
+    cache_entry_t *entry = NULL;
+
+    if (!s_enabled || !url || strncmp(url, "http", 4) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&s_cache_lock);
+    s_stats.lookups++;
+    entry = s_enabled ? entry_get(url, path, sizeof(path)) : NULL;
+    if (entry) {
+        entry->last_used = time(NULL);
+        s_stats.hits++;
+        s_stats.bytes_saved += entry->size;
+        snprintf(uri, size, "file://%s", path);
+        DUER_LOGI("media cache hit: %u/%u, %llu KB saved",
+                  s_stats.hits, s_stats.lookups,
+                  (unsigned long long)(s_stats.bytes_saved >> 10));
+    }
+    pthread_mutex_unlock(&s_cache_lock);
+
+    return entry ? 0 : -1;
+}
+
+int duer_cache_pin(const char *url)
+{
+    char path[PATH_MAX + 32];
+    cache_entry_t *entry = NULL;
+
+    if (!s_enabled || !url || strncmp(url, "http", 4) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&s_cache_lock);
+    entry = s_enabled ? entry_get(url, path, sizeof(path)) : NULL;
+    if (entry) {
+        entry->cls = CACHE_CLASS_ALERT;
+        entry->last_used = time(NULL);
+    }
+    pthread_mutex_unlock(&s_cache_lock);
+
+    return entry ? 0 : -1;
+}
+
+duer_cache_writer_t *duer_cache_writer_new(const char *url, duer_cache_class_t cls)
+{
+    duer_cache_writer_t *writer = NULL;
+
+    if (!s_enabled || !url || strncmp(url, "http", 4) != 0) {
+        return NULL;
+    }
+    writer = (duer_cache_writer_t *)calloc(1, sizeof(duer_cache_writer_t));
+    if (writer) {
+        writer->url_hash = fnv1a(FNV_OFFSET, url, strlen(url));
+        writer->content_hash = FNV_OFFSET;
+        writer->seq = __atomic_add_fetch(&s_writer_seq, 1, __ATOMIC_RELAXED);
+        writer->cls = cls;
+    }
+    return writer;
+}
+
+static GstPadProbeReturn on_source_buffer(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    duer_cache_writer_t *writer = (duer_cache_writer_t *)data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+
+    if (writer->broken || !buffer) {
+        return GST_PAD_PROBE_OK;
+    }
+    // a seek makes the source jump, the copy would have a hole
+    if (GST_BUFFER_OFFSET(buffer) != GST_BUFFER_OFFSET_NONE
+            && GST_BUFFER_OFFSET(buffer) != writer->offset) {
+        writer->broken = true;
+        return GST_PAD_PROBE_OK;
+    }
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        if (writer->offset + map.size > s_limit
+                || fwrite(map.data, 1, map.size, writer->file) != map.size) {
+            writer->broken = true;
+        } else {
+            writer->content_hash = fnv1a(writer->content_hash, map.data, map.size);
+            writer->offset += map.size;
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+void duer_cache_on_source_setup(GstElement *playbin, GstElement *source, gpointer data)
+{
+    duer_cache_writer_t *writer = (duer_cache_writer_t *)data;
+    char path[PATH_MAX + 32];
+
+    // only the first source of an item is copied
+    if (writer->pad || writer->broken) {
+        return;
+    }
+    part_path(writer, path, sizeof(path));
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        writer->broken = true;
+        return;
+    }
+    writer->pad = gst_element_get_static_pad(source, "src");
+    if (!writer->pad) {
+        writer->broken = true;
+        return;
+    }
+    writer->probe_id = gst_pad_add_probe(writer->pad, GST_PAD_PROBE_TYPE_BUFFER,
+                                         on_source_buffer, writer, NULL);
+}
+
+/*
+ * Called with the lock held: move a complete part file into place and index
+ * it. -1 when there is no room left or the rename failed.
+ */
+static int writer_store(duer_cache_writer_t *writer, const char *part)
+{
+    char path[PATH_MAX + 32];
+    int i = entry_find(writer->url_hash);
+
+    if (i >= 0) {
+        // another writer stored the same url meanwhile
+        unlink(part);
+        if (CACHE_CLASS_ALERT == writer->cls) {
+            s_entries[i].cls = CACHE_CLASS_ALERT;
+        }
+        s_entries[i].last_used = time(NULL);
+        return 0;
+    }
+    // evict first, it may drop the entry this content is shared with
+    if (!s_enabled || evict(writer->offset) != 0) {
+        unlink(part);
+        return -1;
+    }
+    content_path(writer->content_hash, path, sizeof(path));
+    bool shared = content_refs(writer->content_hash) > 0;
+    if (shared) {
+        // same bytes already stored for another url
+        unlink(part);
+    } else if (rename(part, path) != 0) {
+        unlink(part);
+        return -1;
+    }
+    cache_entry_t *entry = &s_entries[s_entry_num++];
+    entry->url_hash = writer->url_hash;
+    entry->content_hash = writer->content_hash;
+    entry->size = (uint32_t)writer->offset;
+    entry->last_used = time(NULL);
+    entry->cls = writer->cls;
+    if (!shared) {
+        s_stats.used_bytes += writer->offset;
+    }
+    s_stats.bytes_stored += writer->offset;
+    index_save();
+
+    return 0;
+}
+
+int duer_cache_writer_close(duer_cache_writer_t *writer, bool complete)
+{
+    char part[PATH_MAX + 32];
+    bool stored = false;
+
+    if (!writer) {
+        return -1;
+    }
+    if (writer->pad) {
+        gst_pad_remove_probe(writer->pad, writer->probe_id);
+        gst_object_unref(writer->pad);
+    }
+    part_path(writer, part, sizeof(part));
+    if (writer->file) {
+        if (fclose(writer->file) != 0) {
+            writer->broken = true;
+        }
+        writer->file = NULL;
+
+        if (complete && !writer->broken && writer->offset) {
+            pthread_mutex_lock(&s_cache_lock);
+            stored = writer_store(writer, part) == 0;
+            pthread_mutex_unlock(&s_cache_lock);
+            writer->broken = !stored;
+        } else {
+            unlink(part);
+            writer->broken = true;
+        }
+    }
+    if (!complete || writer->broken) {
+        pthread_mutex_lock(&s_cache_lock);
+        s_stats.aborted++;
+        pthread_mutex_unlock(&s_cache_lock);
+    }
+    free(writer);
+
+    return stored ? 0 : -1;
+}
+
+int duer_cache_fetch(const char *url, duer_cache_class_t cls, int timeout_s)
+{
+    GstMessage *msg = NULL;
+    bool complete = false;
+    duer_cache_writer_t *writer = duer_cache_writer_new(url, cls);
+    GstElement *pipeline = NULL;
+    GstElement *source = NULL;
+    GstElement *sink = NULL;
+
+    if (!writer) {
+        return -1;
+    }
+    pipeline = gst_pipeline_new("cache-fetch");
+    source = gst_element_make_from_uri(GST_URI_SRC, url, "fetch-source", NULL);
+    sink = gst_element_factory_make("fakesink", "fetch-sink");
+    if (!(pipeline && source && sink)) {
+        DUER_LOGE("create cache fetch element failed!");
+        if (pipeline) {
+            gst_object_unref(GST_OBJECT(pipeline));
+        }
+        if (source) {
+            gst_object_unref(GST_OBJECT(source));
+        }
+        if (sink) {
+            gst_object_unref(GST_OBJECT(sink));
+        }
+        duer_cache_writer_close(writer, false);
+        return -1;
+    }
+    gst_bin_add_many(GST_BIN(pipeline), source, sink, NULL);
+    gst_element_link_many(source, sink, NULL);
+    // the same probe that copies a miss while playbin plays it
+    duer_cache_on_source_setup(NULL, source, writer);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    msg = gst_bus_timed_pop_filtered(bus, (GstClockTime)timeout_s * GST_SECOND,
+                                     GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    complete = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    // the writer holds the source pad, let it go before the pipeline
+    int ret = duer_cache_writer_close(writer, complete);
+    gst_object_unref(GST_OBJECT(pipeline));
+
+    return ret;
+}
+
+void duer_cache_get_stats(duer_cache_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_cache_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_cache_lock);
+    }
+}
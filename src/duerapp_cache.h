@@ -0,0 +1,95 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_cache.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: On-disk LRU cache of played media URLs.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_H
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+#include "duerapp_config.h"
+
+#define CACHE_DIR_DEFAULT   "./cache"
+#define CACHE_MB_DEFAULT    (32)
+#define CACHE_ENTRIES_MAX   (256)
+#define CACHE_PIN_S         (24 * 60 * 60)  // a pinned entry is kept this long after its last use
+
+typedef enum{
+    CACHE_CLASS_MEDIA,      // least recently used goes first
+    CACHE_CLASS_ALERT,      // pinned: an alert ring must be there when it fires
+}duer_cache_class_t;
+
+typedef struct{
+    uint32_t lookups;
+    uint32_t hits;
+    uint64_t bytes_saved;       // bytes played from disk instead of the network
+    uint64_t bytes_stored;
+    uint32_t evictions;
+    uint32_t aborted;           // downloads not stored: stopped, seeked or failed
+    uint64_t used_bytes;
+}duer_cache_stats_t;
+
+typedef struct _duer_cache_writer duer_cache_writer_t;
+
+/*
+ * Size cap in MB, 0 disables the cache. Call before duer_cache_init().
+ */
+void duer_cache_set_limit(int mb);
+
+int duer_cache_init(const char *dir);
+void duer_cache_destroy(void);
+bool duer_cache_enabled(void);
+
+/*
+ * On a hit, fill uri with a file:// uri of the cached copy and return 0.
+ */
+int duer_cache_lookup(const char *url, char *uri, size_t size);
+
+/*
+ * Pin a cached url as CACHE_CLASS_ALERT and refresh it. -1 when it is not
+ * cached.
+ */
+int duer_cache_pin(const char *url);
+
+/*
+ * On a miss, copy what playbin downloads for url into the cache. Connect the
+ * returned writer to playbin's "source-setup" signal with duer_cache_on_source_setup.
+ * A partial copy is never played: the item streams from the network while it
+ * is copied, and only a complete copy is served to later lookups.
+ */
+duer_cache_writer_t *duer_cache_writer_new(const char *url, duer_cache_class_t cls);
+void duer_cache_on_source_setup(GstElement *playbin, GstElement *source, gpointer writer);
+
+/*
+ * The pipeline must have left PLAYING. A complete download is stored, anything
+ * else is thrown away. 0 when it was stored.
+ */
+int duer_cache_writer_close(duer_cache_writer_t *writer, bool complete);
+
+/*
+ * Download url into the cache without playing it. Blocks for up to
+ * timeout_s, keep it off the media thread. 0 when it was stored.
+ */
+int duer_cache_fetch(const char *url, duer_cache_class_t cls, int timeout_s);
+
+void duer_cache_get_stats(duer_cache_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_H
@@ -0,0 +1,316 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_cache_bench.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: The stand-in is one thread speaking just enough HTTP/1.0 for a GET,
+ *       one connection at a time. Bodies are computed from the url number,
+ *       so the run needs no files and can check every byte read back. The
+ *       cache itself is the real one, fetching through GStreamer.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <gst/gst.h>
+
+#include "duerapp_cache_bench.h"
+#include "duerapp_cache.h"
+
+typedef struct{
+    char url[64];
+    int ret;
+}bench_fetch_t;
+
+static int s_listen_fd = -1;
+static int s_url_num = 0;
+static volatile bool s_serving = false;
+static uint32_t s_requests = 0;     // written by the server thread
+
+static int64_t bench_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// every fourth url repeats the previous body, the cache stores it once
+static int bench_content(int url)
+{
+    return url % 4 == 3 ? url - 1 : url;
+}
+
+static uint32_t bench_size(int content)
+{
+    return (16 + (content * 37) % (CACHE_BENCH_SIZE_KB_MAX - 15)) * 1024 + content;
+}
+
+static uint8_t bench_byte(int content, uint32_t i)
+{
+    return (uint8_t)(i * 31 + content * 7 + (i >> 10));
+}
+
+static void bench_serve(int fd)
+{
+    char req[1024];
+    char buf[4096];
+    int len = 0;
+    int url = -1;
+    ssize_t n = 0;
+
+    // the request line is all it needs, wait for the end of the header
+    while (len < (int)sizeof(req) - 1 && (n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) > 0) {
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n")) {
+            break;
+        }
+    }
+    req[len] = '\0';
+    if (sscanf(req, "GET /%d ", &url) != 1 || url < 0 || url >= s_url_num) {
+        len = snprintf(buf, sizeof(buf), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        send(fd, buf, len, MSG_NOSIGNAL);
+        return;
+    }
+    __atomic_fetch_add(&s_requests, 1, __ATOMIC_RELAXED);
+
+    int content = bench_content(url);
+    uint32_t size = bench_size(content);
+    len = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                   "Content-Length: %u\r\nConnection: close\r\n\r\n", size);
+    if (send(fd, buf, len, MSG_NOSIGNAL) != len) {
+        return;
+    }
+    for (uint32_t done = 0; done < size;) {
+        uint32_t chunk = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        for (uint32_t i = 0; i < chunk; i++) {
+            buf[i] = (char)bench_byte(content, done + i);
+        }
+        if (send(fd, buf, chunk, MSG_NOSIGNAL) != (ssize_t)chunk) {
+            return;
+        }
+        done += chunk;
+    }
+}
+
+static void bench_server_thread()
+{
+    while (s_serving) {
+        int fd = accept(s_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        bench_serve(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Listen on an ephemeral port of 127.0.0.1, 0 on failure.
+ */
+static int bench_listen()
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    s_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s_listen_fd < 0) {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(s_listen_fd, 8) != 0
+            || getsockname(s_listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        close(s_listen_fd);
+        s_listen_fd = -1;
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+static void bench_clear_dir(const char *dir_path)
+{
+    char path[PATH_MAX];
+    struct dirent *ent = NULL;
+    DIR *dir = opendir(dir_path);
+
+    if (!dir) {
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+static void *bench_fetch_thread(void *param)
+{
+    bench_fetch_t *fetch = (bench_fetch_t *)param;
+
+    fetch->ret = duer_cache_fetch(fetch->url, CACHE_CLASS_MEDIA, CACHE_BENCH_TIMEOUT_S);
+    return NULL;
+}
+
+/*
+ * True when the file behind a file:// uri holds exactly the body of url.
+ */
+static bool bench_verify(const char *uri, int url)
+{
+    int content = bench_content(url);
+    uint32_t size = bench_size(content);
+    uint32_t i = 0;
+    int c = 0;
+    FILE *file = strncmp(uri, "file://", 7) == 0 ? fopen(uri + 7, "rb") : NULL;
+
+    if (!file) {
+        return false;
+    }
+    while ((c = fgetc(file)) != EOF && i < size && (uint8_t)c == bench_byte(content, i)) {
+        i++;
+    }
+    // one read past the body must hit the end of the file
+    bool same = i == size && c == EOF;
+    fclose(file);
+    return same;
+}
+
+int duer_cache_bench_run(int urls)
+{
+    char uri[PATH_MAX + 16];
+    bench_fetch_t fetch[2];
+    pthread_t tids[2];
+    bool started[2];
+    pthread_t server;
+    duer_cache_stats_t before;
+    duer_cache_stats_t after;
+    uint64_t served = 0;
+    uint64_t unique = 0;
+    uint32_t requests = 0;
+    int failed = 0;
+    int wrong = 0;
+    int hits = 0;
+    int ret = 0;
+
+    s_url_num = urls < CACHE_BENCH_URLS_MAX ? urls : CACHE_BENCH_URLS_MAX;
+    gst_init(NULL, NULL);
+    int port = bench_listen();
+    if (!port) {
+        DUER_LOGE("cache run: no local port: %s", strerror(errno));
+        return -1;
+    }
+    s_serving = true;
+    if (pthread_create(&server, NULL, (void *)bench_server_thread, NULL) != 0) {
+        close(s_listen_fd);
+        return -1;
+    }
+    mkdir(CACHE_BENCH_DIR, 0755);
+    bench_clear_dir(CACHE_BENCH_DIR);
+    duer_cache_set_limit(CACHE_MB_DEFAULT);
+    if (duer_cache_init(CACHE_BENCH_DIR) != 0) {
+        ret = -1;
+        goto exit;
+    }
+
+    // cold: both writers of a url race, one of them is stored
+    int64_t start = bench_now_ms();
+    for (int i = 0; i < s_url_num; i++) {
+        for (int k = 0; k < 2; k++) {
+            snprintf(fetch[k].url, sizeof(fetch[k].url), "http://127.0.0.1:%d/%d", port, i);
+            fetch[k].ret = -1;
+        }
+        if (duer_cache_lookup(fetch[0].url, uri, sizeof(uri)) == 0) {
+            wrong++;
+        }
+        for (int k = 0; k < 2; k++) {
+            started[k] = pthread_create(&tids[k], NULL, bench_fetch_thread, &fetch[k]) == 0;
+        }
+        for (int k = 0; k < 2; k++) {
+            if (started[k]) {
+                pthread_join(tids[k], NULL);
+            }
+            if (fetch[k].ret != 0) {
+                failed++;
+            }
+        }
+        if (bench_content(i) == i) {
+            unique += bench_size(i);
+        }
+    }
+    int64_t cold_ms = bench_now_ms() - start;
+    requests = __atomic_load_n(&s_requests, __ATOMIC_RELAXED);
+
+    // warm: every url from disk, none from the server
+    duer_cache_get_stats(&before);
+    start = bench_now_ms();
+    for (int i = 0; i < s_url_num; i++) {
+        snprintf(fetch[0].url, sizeof(fetch[0].url), "http://127.0.0.1:%d/%d", port, i);
+        if (duer_cache_lookup(fetch[0].url, uri, sizeof(uri)) != 0) {
+            continue;
+        }
+        hits++;
+        served += bench_size(bench_content(i));
+        if (!bench_verify(uri, i)) {
+            wrong++;
+        }
+    }
+    int64_t warm_ms = bench_now_ms() - start;
+    duer_cache_get_stats(&after);
+
+    DUER_LOGI("cache run: %d urls, cold %lld ms with %u requests, %d fetches failed",
+              s_url_num, (long long)cold_ms, requests, failed);
+    DUER_LOGI("cache run: warm %lld ms, %u/%u hits, %llu KB saved, %llu KB stored for %llu KB unique",
+              (long long)warm_ms, after.hits - before.hits, after.lookups - before.lookups,
+              (unsigned long long)((after.bytes_saved - before.bytes_saved) >> 10),
+              (unsigned long long)(after.used_bytes >> 10), (unsigned long long)(unique >> 10));
+    if (failed || wrong || hits != s_url_num
+            || __atomic_load_n(&s_requests, __ATOMIC_RELAXED) != requests
+            || after.bytes_saved - before.bytes_saved != served
+            || after.used_bytes != unique) {
+        DUER_LOGE("cache run: %d failed fetches, %d wrong answers, %d of %d hits, %u warm requests",
+                  failed, wrong, hits, s_url_num,
+                  __atomic_load_n(&s_requests, __ATOMIC_RELAXED) - requests);
+        ret = -1;
+    }
+    duer_cache_destroy();
+
+exit:
+    s_serving = false;
+    // wakes the accept
+    shutdown(s_listen_fd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(s_listen_fd);
+    s_listen_fd = -1;
+
+    return ret;
+}
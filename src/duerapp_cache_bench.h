@@ -0,0 +1,42 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_cache_bench.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Media cache run against a local HTTP stand-in, without the cloud.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_BENCH_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_BENCH_H
+
+#include "duerapp_config.h"
+
+#define CACHE_BENCH_DIR         "./cache_bench"     // emptied at start
+#define CACHE_BENCH_URLS_MAX    (128)               // all of them fit CACHE_MB_DEFAULT
+#define CACHE_BENCH_SIZE_KB_MAX (256)
+#define CACHE_BENCH_TIMEOUT_S   (30)                // per fetch
+
+/*
+ * Serve urls generated bodies from 127.0.0.1, every fourth one the same
+ * bytes as the one before. Fetch each url cold with two writers at once,
+ * then look all of them up again. Logs the hit ratio, bytes saved and bytes
+ * stored. Returns -1 when a fetch failed, the warm pass missed, went to the
+ * server or read back other bytes than were served, or the saved and
+ * stored counts are off.
+ */
+int duer_cache_bench_run(int urls);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CACHE_BENCH_H
@@ -0,0 +1,264 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_clock.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: The estimate is a line through the last NTP sample:
+ *       wall = base_wall + (mono - base_mono) * (1 + drift). Drift comes
+ *       from two samples at least CLOCK_DRIFT_MIN_S apart, averaged with
+ *       the previous value.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "duerapp_clock.h"
+#include "duerapp_sched.h"
+#include "lightduer_net_ntp.h"
+
+static pthread_mutex_t s_clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_clock_cond;
+static pthread_t s_clock_tid;
+static volatile bool s_running = false;
+static duer_clock_sync_cb s_sync_cb = NULL;
+// the estimate, guarded by s_clock_lock
+static int64_t s_base_mono = 0;
+static int64_t s_base_wall = 0;
+static double s_drift = 0;
+static bool s_synced = false;
+static bool s_sync_now = false;
+// last raw sample, drift is measured between samples
+static int64_t s_sample_mono = 0;
+static int64_t s_sample_wall = 0;
+static duer_clock_stats_t s_stats;
+
+static int64_t clock_wall_us(int64_t mono)
+{
+    return s_base_wall + (int64_t)((mono - s_base_mono) * (1 + s_drift));
+}
+
+static int64_t clock_realtime_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * The wall clock at mono. Before the first sample that is the system clock
+ * read now, so a step the OS makes meanwhile is followed.
+ */
+static int64_t clock_estimate_us(int64_t mono)
+{
+    if (s_synced) {
+        return clock_wall_us(mono);
+    }
+    return clock_realtime_us() - (duer_sched_now_us() - mono);
+}
+
+/*
+ * One NTP round trip, timed on the monotonic clock. The answer is taken to
+ * describe the middle of the round trip.
+ */
+static int clock_sync(void)
+{
+    DuerTime ntp;
+    int64_t start = duer_sched_now_us();
+    int ret = duer_ntp_client(NULL, 0, &ntp, NULL);
+    int64_t end = duer_sched_now_us();
+    int64_t mono = (start + end) / 2;
+    int64_t wall = ntp.sec * 1000000LL + ntp.usec;
+
+    pthread_mutex_lock(&s_clock_lock);
+    if (ret < 0 || end - start > CLOCK_RTT_MAX_MS * 1000LL) {
+        s_stats.failures++;
+        pthread_mutex_unlock(&s_clock_lock);
+        DUER_LOGW("NTP sync failed: %d, took %lld ms", ret, (end - start) / 1000);
+        return -1;
+    }
+    s_stats.last_error_us = wall - clock_estimate_us(mono);
+    s_stats.last_rtt_us = (uint32_t)(end - start);
+    if (s_synced && mono - s_sample_mono >= CLOCK_DRIFT_MIN_S * 1000000LL) {
+        double drift = (double)(wall - s_sample_wall) / (mono - s_sample_mono) - 1;
+        if (drift * 1e6 > CLOCK_DRIFT_MAX_PPM || drift * 1e6 < -CLOCK_DRIFT_MAX_PPM) {
+            // the server or the system clock jumped, start over
+            drift = 0;
+        }
+        s_drift = s_drift != 0 ? (s_drift + drift) / 2 : drift;
+    }
+    if (!s_synced || mono - s_sample_mono >= CLOCK_DRIFT_MIN_S * 1000000LL) {
+        s_sample_mono = mono;
+        s_sample_wall = wall;
+    }
+    s_base_mono = mono;
+    s_base_wall = wall;
+    s_synced = true;
+    s_stats.syncs++;
+    s_stats.drift_ppm = s_drift * 1e6;
+    pthread_mutex_unlock(&s_clock_lock);
+
+    DUER_LOGI("clock: corrected by %lld us, rtt %u us, drift %.2f ppm",
+              s_stats.last_error_us, s_stats.last_rtt_us, s_stats.drift_ppm);
+    return 0;
+}
+
+static void clock_thread()
+{
+    int wait_s = 0;
+    int retry_s = CLOCK_RETRY_MIN_S;
+    bool forced = false;
+    struct timespec ts;
+
+    pthread_mutex_lock(&s_clock_lock);
+    while (s_running) {
+        pthread_mutex_unlock(&s_clock_lock);
+        if (clock_sync() == 0) {
+            if (s_sync_cb) {
+                s_sync_cb();
+            }
+            wait_s = CLOCK_SYNC_INTERVAL_S;
+            retry_s = CLOCK_RETRY_MIN_S;
+        } else {
+            if (forced) {
+                retry_s = CLOCK_RETRY_MIN_S;
+            }
+            wait_s = retry_s;
+            retry_s = retry_s * 2 < CLOCK_SYNC_INTERVAL_S ? retry_s * 2 : CLOCK_SYNC_INTERVAL_S;
+        }
+        pthread_mutex_lock(&s_clock_lock);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += wait_s;
+        while (s_running && !s_sync_now
+                && pthread_cond_timedwait(&s_clock_cond, &s_clock_lock, &ts) != ETIMEDOUT) {
+        }
+        forced = s_sync_now;
+        s_sync_now = false;
+    }
+    pthread_mutex_unlock(&s_clock_lock);
+}
+
+int duer_clock_init(duer_clock_sync_cb cb)
+{
+    pthread_condattr_t attr;
+
+    if (s_running) {
+        return 0;
+    }
+    s_base_mono = 0;
+    s_base_wall = 0;
+    s_drift = 0;
+    s_synced = false;
+    s_sync_cb = cb;
+    memset(&s_stats, 0, sizeof(s_stats));
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s_clock_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    s_running = true;
+    int ret = pthread_create(&s_clock_tid, NULL, (void *)clock_thread, NULL);
+    if (ret) {
+        DUER_LOGE("Create clock pthread error!");
+        s_running = false;
+        pthread_cond_destroy(&s_clock_cond);
+        return -1;
+    }
+    pthread_setname_np(s_clock_tid, "dcs3_demo_clock");
+
+    return 0;
+}
+
+void duer_clock_destroy(void)
+{
+    if (!s_running) {
+        return;
+    }
+    pthread_mutex_lock(&s_clock_lock);
+    s_running = false;
+    pthread_cond_signal(&s_clock_cond);
+    pthread_mutex_unlock(&s_clock_lock);
+
+    // an NTP request in flight ends by its own timeout
+    pthread_join(s_clock_tid, NULL);
+    pthread_cond_destroy(&s_clock_cond);
+    DUER_LOGI("clock: %u syncs, %u failures, drift %.2f ppm",
+              s_stats.syncs, s_stats.failures, s_stats.drift_ppm);
+}
+
+void duer_clock_sync_now(void)
+{
+    pthread_mutex_lock(&s_clock_lock);
+    if (s_running) {
+        s_sync_now = true;
+        pthread_cond_signal(&s_clock_cond);
+    }
+    pthread_mutex_unlock(&s_clock_lock);
+}
+
+void duer_clock_set(int64_t wall_ms)
+{
+    pthread_mutex_lock(&s_clock_lock);
+    s_base_mono = duer_sched_now_us();
+    s_base_wall = wall_ms * 1000;
+    s_drift = 0;
+    s_synced = true;
+    pthread_mutex_unlock(&s_clock_lock);
+}
+
+int64_t duer_clock_now_ms(void)
+{
+    int64_t mono = duer_sched_now_us();
+    int64_t wall = 0;
+
+    pthread_mutex_lock(&s_clock_lock);
+    wall = clock_estimate_us(mono);
+    pthread_mutex_unlock(&s_clock_lock);
+
+    return wall / 1000;
+}
+
+bool duer_clock_synced(void)
+{
+    return s_synced;
+}
+
+int64_t duer_clock_mono_us(int64_t wall_ms)
+{
+    int64_t mono = 0;
+
+    pthread_mutex_lock(&s_clock_lock);
+    if (s_synced) {
+        mono = s_base_mono + (int64_t)((wall_ms * 1000 - s_base_wall) / (1 + s_drift));
+    } else {
+        mono = duer_sched_now_us() + (wall_ms * 1000 - clock_realtime_us());
+    }
+    pthread_mutex_unlock(&s_clock_lock);
+
+    return mono;
+}
+
+void duer_clock_get_stats(duer_clock_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_clock_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_clock_lock);
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_clock.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Wall clock kept from NTP samples against CLOCK_MONOTONIC.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CLOCK_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CLOCK_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define CLOCK_SYNC_INTERVAL_S   (60 * 60)
+#define CLOCK_RETRY_MIN_S       (5)     // doubles after each failure up to the interval
+#define CLOCK_RTT_MAX_MS        (1000)  // slower answers are too uncertain to use
+#define CLOCK_DRIFT_MIN_S       (10 * 60)
+#define CLOCK_DRIFT_MAX_PPM     (500)
+
+/*
+ * Called on the clock thread after each successful sync, the owner moves
+ * whatever it scheduled from the old estimate.
+ */
+typedef void (*duer_clock_sync_cb)(void);
+
+typedef struct{
+    uint32_t syncs;
+    uint32_t failures;
+    int64_t last_error_us;  // sample minus the estimate it replaced
+    uint32_t last_rtt_us;
+    double drift_ppm;       // how fast the wall clock runs against the monotonic one
+}duer_clock_stats_t;
+
+/*
+ * Start the background sync. Until the first sample arrives the estimate is
+ * the system clock, read live.
+ */
+int duer_clock_init(duer_clock_sync_cb cb);
+void duer_clock_destroy(void);
+
+/*
+ * Sync at once instead of waiting out the retry, e.g. on connect.
+ */
+void duer_clock_sync_now(void);
+
+/*
+ * Without the sync thread, e.g. on a virtual scheduler: the wall clock
+ * reads wall_ms now and runs at the scheduler's rate.
+ */
+void duer_clock_set(int64_t wall_ms);
+
+/*
+ * Never blocks: both only read the current estimate.
+ */
+int64_t duer_clock_now_ms(void);
+bool duer_clock_synced(void);
+
+/*
+ * CLOCK_MONOTONIC time, in the scheduler's unit, at which the wall clock
+ * reads wall_ms.
+ */
+int64_t duer_clock_mono_us(int64_t wall_ms);
+
+void duer_clock_get_stats(duer_clock_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_CLOCK_H
@@ -0,0 +1,73 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_histogram.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Log2-bucketed latency histogram.
+ */
+
+#include <string.h>
+
+#include "duerapp_histogram.h"
+
+void duer_histogram_init(duer_histogram_t *hist, const char *name, const char *unit)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->name = name;
+    hist->unit = unit;
+}
+
+void duer_histogram_add(duer_histogram_t *hist, uint32_t value)
+{
+    int index = 0;
+
+    while (index < HISTOGRAM_BUCKETS - 1 && value >> index) {
+        index++;
+    }
+    hist->bucket[index]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+uint32_t duer_histogram_percentile(const duer_histogram_t *hist, int percent)
+{
+    uint64_t target = ((uint64_t)hist->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (!hist->count) {
+        return 0;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= target) {
+            uint32_t bound = i ? (1u << i) - 1 : 0;
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void duer_histogram_log(const duer_histogram_t *hist)
+{
+    DUER_LOGI("%s: n=%u avg=%u p50<=%u p90<=%u p99<=%u max=%u %s",
+              hist->name, hist->count,
+              hist->count ? (uint32_t)(hist->sum / hist->count) : 0,
+              duer_histogram_percentile(hist, 50), duer_histogram_percentile(hist, 90),
+              duer_histogram_percentile(hist, 99), hist->max, hist->unit);
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_histogram.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Log2-bucketed latency histogram.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_HISTOGRAM_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define HISTOGRAM_BUCKETS (24) // bucket i holds values in [2^(i-1), 2^i)
+
+/*
+ * Not thread safe, each histogram is updated by one owner.
+ */
+typedef struct{
+    const char *name;
+    const char *unit;
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t bucket[HISTOGRAM_BUCKETS];
+}duer_histogram_t;
+
+void duer_histogram_init(duer_histogram_t *hist, const char *name, const char *unit);
+void duer_histogram_add(duer_histogram_t *hist, uint32_t value);
+
+/*
+ * Upper bound of the bucket holding the given percentile, 0 when empty.
+ */
+uint32_t duer_histogram_percentile(const duer_histogram_t *hist, int percent);
+
+/*
+ * One line: count, avg, p50, p90, p99 and max.
+ */
+void duer_histogram_log(const duer_histogram_t *hist);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_HISTOGRAM_H
@@ -0,0 +1,204 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_load.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Media engine load run. Meant for machines without a sound card:
+ *       start with -o null (real time) or -o null:fast (unthrottled) and
+ *       serve the urls from a local http server. There is no DCS connection:
+ *       the events the engine raises are counted here instead.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include "duerapp_load.h"
+#include "duerapp_media.h"
+#include "duerapp_histogram.h"
+
+typedef struct{
+    gint64 start;
+    gint64 stream_us;       // time something was playing
+    long rss_start_kb;
+    uint32_t ops;
+}load_state_t;
+
+static char *s_urls[LOAD_URLS_MAX];
+static int s_url_num = 0;
+static duer_histogram_t s_position_latency;
+// written by the media thread
+static uint32_t s_events[MEDIA_EVENT_NUM];
+
+static void load_event(duer_media_event_t event)
+{
+    __atomic_fetch_add(&s_events[event], 1, __ATOMIC_RELAXED);
+}
+
+static int load_urls(const char *url_file)
+{
+    char line[1024];
+    FILE *file = fopen(url_file, "r");
+
+    if (!file) {
+        DUER_LOGE("open load url file %s failed", url_file);
+        return -1;
+    }
+    while (s_url_num < LOAD_URLS_MAX && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] && line[0] != '#') {
+            s_urls[s_url_num++] = strdup(line);
+        }
+    }
+    fclose(file);
+
+    return s_url_num ? 0 : -1;
+}
+
+static long rss_kb()
+{
+    long pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file) {
+        if (fscanf(file, "%*d %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void load_report(const load_state_t *state)
+{
+    duer_media_stats_t stats;
+    double stream_h = state->stream_us / 3600e6;
+
+    duer_media_get_stats(&stats);
+    DUER_LOGI("load %llds: %u calls, %d items, %d watches, cmd p50<=%u p99<=%u us,"
+              " rss %+ld KB, cpu %.1f s per stream-hour",
+              (long long)((g_get_monotonic_time() - state->start) / 1000000), state->ops,
+              stats.items, stats.watches, stats.cmd_p50_us, stats.cmd_p99_us,
+              rss_kb() - state->rss_start_kb, stream_h > 0 ? cpu_seconds() / stream_h : 0.0);
+    duer_histogram_log(&s_position_latency);
+    DUER_LOGI("load events: %u speech finished, %u audio finished, %u failed, %u stutters",
+              __atomic_load_n(&s_events[MEDIA_EVENT_SPEECH_FINISHED], __ATOMIC_RELAXED),
+              __atomic_load_n(&s_events[MEDIA_EVENT_AUDIO_FINISHED], __ATOMIC_RELAXED),
+              __atomic_load_n(&s_events[MEDIA_EVENT_AUDIO_FAILED], __ATOMIC_RELAXED),
+              __atomic_load_n(&s_events[MEDIA_EVENT_AUDIO_STUTTER_START], __ATOMIC_RELAXED));
+}
+
+void duer_load_init(void)
+{
+    duer_media_set_report(load_event);
+}
+
+static void load_step()
+{
+    const char *url = s_urls[rand() % s_url_num];
+    int op = rand() % 100;
+
+    if (op < 20) {
+        duer_media_speak_play(url);
+    } else if (op < 35) {
+        duer_media_audio_start(url);
+    } else if (op < 45) {
+        duer_media_audio_pause();
+    } else if (op < 60) {
+        // a resume at an offset is a seek
+        duer_media_audio_resume(url, rand() % 30000);
+    } else if (op < 68) {
+        duer_media_audio_stop();
+    } else if (op < 73) {
+        duer_media_speak_stop();
+    } else if (op < 81) {
+        duer_media_volume_change(rand() % 21 - 10);
+    } else if (op < 85) {
+        duer_media_set_mute(!duer_media_get_mute());
+    } else {
+        // the only call that waits for the media thread
+        gint64 start = g_get_monotonic_time();
+        duer_media_audio_get_position();
+        duer_histogram_add(&s_position_latency, (uint32_t)(g_get_monotonic_time() - start));
+    }
+}
+
+int duer_load_run(const char *url_file, int seconds)
+{
+    load_state_t state;
+    duer_media_stats_t stats;
+    gint64 last = 0;
+    gint64 next_report = 0;
+    int ret = 0;
+
+    if (load_urls(url_file) != 0) {
+        return -1;
+    }
+    srand((unsigned int)time(NULL));
+    duer_histogram_init(&s_position_latency, "load position call", "us");
+    memset(&state, 0, sizeof(state));
+    state.start = g_get_monotonic_time();
+    state.rss_start_kb = rss_kb();
+    last = state.start;
+    next_report = state.start + LOAD_REPORT_SEC * 1000000LL;
+    DUER_LOGI("load run: %d urls, %d s", s_url_num, seconds);
+
+    while (g_get_monotonic_time() - state.start < seconds * 1000000LL) {
+        bool playing = duer_media_is_playing();
+        load_step();
+        state.ops++;
+        usleep((rand() % (LOAD_STEP_MS_MAX + 1)) * 1000);
+
+        gint64 now = g_get_monotonic_time();
+        if (playing) {
+            state.stream_us += now - last;
+        }
+        last = now;
+        if (now >= next_report) {
+            load_report(&state);
+            next_report += LOAD_REPORT_SEC * 1000000LL;
+        }
+    }
+
+    duer_media_speak_stop();
+    duer_media_audio_stop();
+    duer_media_sync();
+    load_report(&state);
+    duer_media_get_stats(&stats);
+    if (stats.items || stats.watches) {
+        DUER_LOGE("load run leaked %d items, %d bus watches", stats.items, stats.watches);
+        ret = -1;
+    }
+    for (int i = 0; i < s_url_num; i++) {
+        free(s_urls[i]);
+        s_urls[i] = NULL;
+    }
+    s_url_num = 0;
+
+    return ret;
+}
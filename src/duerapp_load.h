@@ -0,0 +1,45 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_load.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Media engine load run, without the cloud connection.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_LOAD_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_LOAD_H
+
+#include "duerapp_config.h"
+
+#define LOAD_URLS_MAX       (64)
+#define LOAD_REPORT_SEC     (30)
+#define LOAD_STEP_MS_MAX    (300)   // pause between two random calls
+
+/*
+ * Keep the media engine's events away from DCS, which is not started in a
+ * load run. Call before duer_media_init().
+ */
+void duer_load_init(void);
+
+/*
+ * Drive the media API with random speak/audio/pause/resume/stop/volume calls
+ * on the urls listed in url_file, one per line, for the given time. The media
+ * engine must be initialized. Returns 0, or -1 when items or bus watches are
+ * left over after everything was stopped.
+ */
+int duer_load_run(const char *url_file, int seconds);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_LOAD_H
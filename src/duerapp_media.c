@@ -19,211 +19,1638 @@
  * Desc: Media module function implementation.
  */
 
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
 #include <gst/gst.h>
 
 #include "duerapp_media.h"
 #include "duerapp_config.h"
+#include "duerapp_recorder.h"
+#include "duerapp_tone.h"
+#include "duerapp_mixer.h"
+#include "duerapp_histogram.h"
+#include "duerapp_cache.h"
+#include "duerapp_volume.h"
 #include "lightduer_dcs.h"
+#include "lightduer_dcs_local.h"
+#include "lightduer_ds_log_audio.h"
 
 #define VOLUME_MAX (1.0)
 #define VOLUME_MIX (0.000001)
 #define VOLUME_INIT (0.5)
+#define MEDIA_POOL_MAX  (3) // pre-built playbins kept per channel, see s_pool_size
+#define MEDIA_PREBUFFER_MS_DEFAULT (2000)
+#define MEDIA_PREBUFFER_KB_DEFAULT (512)   // network queue of one item
+#define MEDIA_PREBUFFER_KB_MIN (32)
+#define MEDIA_READY_MEM_KB_DEFAULT (1536)  // all items buffered ahead together
+#define MEDIA_CMD_LOG_EVERY (64)           // log the command latency histogram
+#define MEDIA_SPEAK_PREBUFFER_MS (200)     // speech starts on a short network queue
+#define MEDIA_SPEAK_PREBUFFER_KB (32)
+#define MEDIA_TTFA_LOG_EVERY (16)          // log the time-to-first-audio histogram
+#define MEDIA_PLAYBIN_BUFFER_KB (2048)     // playbin's own queue when not set
+#define MEDIA_CROSSFADE_MS_MAX (10000)
+#define MEDIA_CROSSFADE_POLL_MS (100)      // how often the end of a track is checked
+// PlaybackFinished to the next Play directive; the next track's prebuffer
+// and the crossfade come on top
+#define MEDIA_FINISH_LEAD_MS (3000)
 
-typedef void (*play_handler)(void);
+typedef enum {
+    MEDIA_CHANNEL_SPEAK,
+    MEDIA_CHANNEL_AUDIO,
+    MEDIA_CHANNEL_NUM,
+} media_channel_t;
+
+// milestones of a speech item, from the request to the first decoded sample
+typedef enum {
+    SPEAK_MARK_REQUEST,
+    SPEAK_MARK_SOURCE,          // source element created, connecting
+    SPEAK_MARK_FIRST_BYTE,
+    SPEAK_MARK_STREAM_START,    // type found, decoder linked
+    SPEAK_MARK_PREROLL,         // first sample reached the mixer sink
+    SPEAK_MARK_NUM,
+} speak_mark_t;
+
+typedef enum {
+    RESUME_NONE,
+    RESUME_PREROLL,     // held in PAUSED until the first preroll
+    RESUME_SEEKING,     // flushing seek sent, waiting for the new preroll
+} resume_state_t;
+
+// playback quality of one item, reported to ds_log when it is deleted
+typedef struct _play_stats {
+    bool started;           // has been PLAYING, later buffering is a stutter
+    gint64 play_time;       // when it last went PLAYING, 0 while held
+    gint64 played_us;
+    gint64 stutter_start;   // 0 when not stuttering
+    uint32_t stutters;
+    gint64 stutter_us;
+    uint32_t qos;           // QoS messages: late or dropped buffers
+    uint32_t bitrate_min;   // kbps
+    uint32_t bitrate_max;
+    uint64_t bitrate_sum;
+    uint32_t bitrate_num;
+} play_stats_t;
+
+// what the stream says about itself, collected from its tags
+typedef struct _track_meta {
+    char title[128];
+    char artist[128];
+    char album[128];
+    char codec[64];
+    guint bitrate;          // bps, latest seen
+    bool reported;
+} track_meta_t;
 
 typedef struct _play_info {
     GstElement *pip;
-    play_handler func;
+    char *url;
+    media_channel_t channel;
+    duer_mixer_stream_t stream;     // set when it starts playing
+    guint bus_watch_id;
+    int buffer_kb;
+    duer_cache_writer_t *cache;
+    gulong source_setup_id;
+    bool eos;
+    gint64 mark[SPEAK_MARK_NUM];
+    resume_state_t resume;
+    int resume_ms;
+    gint64 resume_time;     // when the resume was requested
+    play_stats_t stats;
+    track_meta_t meta;
 } play_info_t;
 
-//1: now playing, 2: ready play, 3: audio paused
-static play_info_t *s_pinfo[3] = {NULL, NULL, NULL};
+typedef struct _setup_stat {
+    guint count;
+    gint64 total_us;
+} setup_stat_t;
+
+typedef enum {
+    MEDIA_CMD_SPEAK_PLAY,
+    MEDIA_CMD_SPEAK_STOP,
+    MEDIA_CMD_AUDIO_START,
+    MEDIA_CMD_AUDIO_RESUME,
+    MEDIA_CMD_AUDIO_STOP,
+    MEDIA_CMD_AUDIO_PAUSE,
+    MEDIA_CMD_AUDIO_POSITION,
+    MEDIA_CMD_VOLUME_SET,
+    MEDIA_CMD_VOLUME_CHANGE,
+    MEDIA_CMD_MUTE,
+    MEDIA_CMD_DRAINED,      // posted by the mixer, arg from drain_start()
+    MEDIA_CMD_SYNC,
+} media_cmd_type_t;
+
+typedef struct _media_future {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+} media_future_t;
+
+typedef struct _media_cmd {
+    struct _media_cmd *next;
+    media_cmd_type_t type;
+    char *url;
+    int arg;
+    gint64 submit_time;
+    media_future_t *future; // NULL: fire and forget
+} media_cmd_t;
+
+/*
+ * Everything below is owned by the media thread. Other threads only read the
+ * state enums and volume, and submit commands.
+ */
+//1: now playing, 2: audio paused
+static play_info_t *s_pinfo[2] = {NULL, NULL};
+// items waiting to play, oldest first; they are prerolled while queued
+// DCS names one next item per channel, a newer one replaces it
+static play_info_t *s_ready[MEDIA_CHANNEL_NUM];
+static int s_ready_num = 0;
+static int s_prebuffer_ms = MEDIA_PREBUFFER_MS_DEFAULT;
+static int s_ready_mem_kb = MEDIA_READY_MEM_KB_DEFAULT;
+// set once the end of the current track was reported, see audio_finishing()
+static bool s_audio_finishing = false;
+static gint64 s_audio_eos_time = 0;
 static int s_seek = 0;
-static bool s_mute = false;
-static pthread_cond_t s_cond;
-static pthread_mutex_t s_loack;
+static volatile bool s_mute = false;
 static pthread_t s_media_tid;
-static bool s_isblock = false;
-static bool s_start_up = false;
-static GMainLoop *s_loop = NULL;
-static double s_vol = VOLUME_INIT;
-static duer_speak_state_t s_speak_state = MEDIA_SPEAK_STOP;
-static duer_audio_state_t s_audio_state = MEDIA_AUDIO_STOP;
+static volatile bool s_start_up = false;
+static GMainContext *s_ctx = NULL;
+static volatile double s_vol = VOLUME_INIT;
+static volatile duer_speak_state_t s_speak_state = MEDIA_SPEAK_STOP;
+static volatile duer_audio_state_t s_audio_state = MEDIA_AUDIO_STOP;
 static duer_tone_state_t  s_tone_state = MEDIA_TONE_STOP;
+// idle playbins parked in READY: elements built, mixer sink already linked
+static GstElement *s_pool[MEDIA_CHANNEL_NUM][MEDIA_POOL_MAX];
+// as many as a channel has items at once, so none is built while playing
+static const int s_pool_size[MEDIA_CHANNEL_NUM] = {
+    2,  // speech: the playing item and the prefetched next one
+    3,  // music: the same plus the outgoing track of a crossfade
+};
+// [channel][0]: built from scratch, [channel][1]: taken from the pool
+static setup_stat_t s_setup_stat[MEDIA_CHANNEL_NUM][2];
+// MPSC command queue: producers swap s_cmd_tail, the media thread owns s_cmd_head
+static media_cmd_t *s_cmd_head = NULL;
+static media_cmd_t *s_cmd_tail = NULL;
+// set by duer_media_destroy(), which then waits out the producers in cmd_push()
+static bool s_cmd_closed = false;
+static int s_cmd_pushing = 0;
+static duer_histogram_t s_cmd_latency;
+static duer_histogram_t s_ttfa;
+static duer_histogram_t s_resume_latency;
+static duer_histogram_t s_stutter;
+// leak accounting, written by the media thread only
+static volatile int s_live_items = 0;
+static volatile int s_live_watches = 0;
+// crossfade between content tracks, 0: gapless hand-off at EOS
+static int s_crossfade_ms = 0;
+static duer_mixer_stream_t s_content_stream = MIXER_STREAM_CONTENT;
+static play_info_t *s_fading = NULL;        // outgoing track of a crossfade
+static GSource *s_fade_source = NULL;       // lets s_fading go when the fade is over
+static GSource *s_poll_source = NULL;       // watches the end of the current track
+static duer_histogram_t s_track_gap;
+// an item that ended on its own while its tail is still in the mixer ring
+static bool s_draining[MEDIA_CHANNEL_NUM];
+static duer_mixer_stream_t s_drain_stream[MEDIA_CHANNEL_NUM];
+static int s_drain_seq = 0;     // tells a stale completion from the current one
+// speech or music audible, kept by the media thread, read by any
+static volatile bool s_audible = false;
+// events go to DCS unless a run without the cloud takes them
+static duer_media_report_cb s_report = NULL;
+
+/*
+ * data: the error message of MEDIA_EVENT_AUDIO_FAILED, the JSON object of
+ * MEDIA_EVENT_AUDIO_METADATA, otherwise NULL.
+ */
+static void media_report(duer_media_event_t event, const void *data)
+{
+    if (s_report) {
+        s_report(event);
+        return;
+    }
+    switch (event) {
+        case MEDIA_EVENT_SPEECH_FINISHED:
+            duer_dcs_speech_on_finished();
+            if (duer_is_multiple_round_dialogue()) {
+                duer_recorder_follow_up_start();
+            }
+            break;
+        case MEDIA_EVENT_AUDIO_FINISHED:
+            duer_dcs_audio_on_finished();
+            break;
+        case MEDIA_EVENT_AUDIO_FAILED:
+            duer_dcs_audio_play_failed(DCS_MEDIA_ERROR_INTERNAL_DEVICE_ERROR, (const char *)data);
+            break;
+        case MEDIA_EVENT_AUDIO_STUTTER_START:
+        case MEDIA_EVENT_AUDIO_STUTTER_END:
+            duer_dcs_audio_on_stuttered(MEDIA_EVENT_AUDIO_STUTTER_START == event
+                                        ? DUER_TRUE : DUER_FALSE);
+            break;
+        case MEDIA_EVENT_AUDIO_METADATA:
+            duer_dcs_audio_report_metadata((baidu_json *)data);
+            break;
+        case MEDIA_EVENT_VOLUME_CHANGED:
+            if (DUER_OK == duer_dcs_on_volume_changed()) {
+                DUER_LOGI("volume change OK");
+            }
+            break;
+        case MEDIA_EVENT_MUTE_CHANGED:
+            duer_dcs_on_mute();
+            break;
+        default:
+            break;
+    }
+}
+
+static duer_mixer_stream_t channel_stream(media_channel_t channel)
+{
+    return MEDIA_CHANNEL_SPEAK == channel ? MIXER_STREAM_DIALOG : MIXER_STREAM_CONTENT;
+}
+
+static void post_speak_mark(GstElement *element, const char *name)
+{
+    GstStructure *mark = gst_structure_new(name, "time", G_TYPE_INT64,
+                                           g_get_monotonic_time(), NULL);
+    gst_element_post_message(element, gst_message_new_application(GST_OBJECT(element), mark));
+}
+
+static GstPadProbeReturn on_speak_first_byte(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    post_speak_mark(GST_ELEMENT(data), "speak-first-byte");
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/*
+ * Runs for every new source of a speech playbin. The bus watch may not be
+ * attached yet, so the time travels inside the message.
+ */
+static void on_speak_source_setup(GstElement *pip, GstElement *source, gpointer data)
+{
+    GstPad *pad = gst_element_get_static_pad(source, "src");
+
+    post_speak_mark(source, "speak-source");
+    if (pad) {
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_speak_first_byte, source, NULL);
+        gst_object_unref(pad);
+    }
+}
+
+static GstElement *make_playbin(media_channel_t channel)
+{
+    GstElement *pip = gst_element_factory_make("playbin", NULL);
+    GstElement *sink = duer_mixer_make_sink(channel_stream(channel));
+
+    if (pip && sink) {
+        // an explicit sink survives URI changes, so it is built only once
+        g_object_set(G_OBJECT(pip), "audio-sink", sink, NULL);
+        if (MEDIA_CHANNEL_SPEAK == channel) {
+            // low latency: decode as soon as a little data is in, not after
+            // playbin's default 2 s / 2 MB queue
+            g_object_set(G_OBJECT(pip),
+                         "buffer-duration", (gint64)MEDIA_SPEAK_PREBUFFER_MS * GST_MSECOND,
+                         "buffer-size", MEDIA_SPEAK_PREBUFFER_KB * 1024, NULL);
+            g_signal_connect(pip, "source-setup", G_CALLBACK(on_speak_source_setup), NULL);
+        }
+    } else if (sink) {
+        gst_object_unref(GST_OBJECT(sink));
+    }
+    return pip;
+}
+
+static GstElement *pool_get(media_channel_t channel)
+{
+    GstElement *pip = NULL;
+
+    for (int i = 0; i < s_pool_size[channel]; i++) {
+        if (s_pool[channel][i]) {
+            pip = s_pool[channel][i];
+            s_pool[channel][i] = NULL;
+            break;
+        }
+    }
+
+    return pip;
+}
+
+static void pool_put(media_channel_t channel, GstElement *pip)
+{
+    GstBus *bus = NULL;
+    bool parked = false;
+
+    // READY drops the stream but keeps the elements and the opened sink
+    if (GST_STATE_CHANGE_FAILURE == gst_element_set_state(pip, GST_STATE_READY)) {
+        gst_element_set_state(pip, GST_STATE_NULL);
+        gst_object_unref(GST_OBJECT(pip));
+        return;
+    }
+    bus = gst_pipeline_get_bus(GST_PIPELINE(pip));
+    gst_bus_set_flushing(bus, TRUE);
+    gst_bus_set_flushing(bus, FALSE);
+    gst_object_unref(bus);
+
+    for (int i = 0; i < s_pool_size[channel]; i++) {
+        if (!s_pool[channel][i]) {
+            s_pool[channel][i] = pip;
+            parked = true;
+            break;
+        }
+    }
+
+    if (!parked) {
+        gst_element_set_state(pip, GST_STATE_NULL);
+        gst_object_unref(GST_OBJECT(pip));
+    }
+}
+
+static void pool_init()
+{
+    GstElement *pip = NULL;
+
+    for (int ch = 0; ch < MEDIA_CHANNEL_NUM; ch++) {
+        for (int i = 0; i < s_pool_size[ch]; i++) {
+            pip = make_playbin(ch);
+            if (!pip) {
+                DUER_LOGE("Create pooled playbin failed!");
+                return;
+            }
+            pool_put(ch, pip);
+        }
+    }
+}
+
+static void pool_destroy()
+{
+    for (int ch = 0; ch < MEDIA_CHANNEL_NUM; ch++) {
+        for (int i = 0; i < s_pool_size[ch]; i++) {
+            if (s_pool[ch][i]) {
+                gst_element_set_state(s_pool[ch][i], GST_STATE_NULL);
+                gst_object_unref(GST_OBJECT(s_pool[ch][i]));
+                s_pool[ch][i] = NULL;
+            }
+        }
+    }
+}
+
+static play_info_t *create_play_info(const char *url, media_channel_t channel)
+{
+    play_info_t *info = NULL;
+    gint64 start = g_get_monotonic_time();
+    int pooled = 1;
+    char uri[PATH_MAX + 16];
+    info = (play_info_t *)malloc(sizeof(play_info_t));
+
+    if (info) {
+        info->channel = channel;
+        info->stream = channel_stream(channel);
+        info->bus_watch_id = 0;
+        info->buffer_kb = 0;
+        info->cache = NULL;
+        info->source_setup_id = 0;
+        info->eos = false;
+        memset(info->mark, 0, sizeof(info->mark));
+        info->resume = RESUME_NONE;
+        info->resume_ms = 0;
+        info->resume_time = 0;
+        memset(&info->stats, 0, sizeof(info->stats));
+        memset(&info->meta, 0, sizeof(info->meta));
+        info->url = g_strdup(url);
+        info->pip = pool_get(channel);
+        if (!info->pip) {
+            pooled = 0;
+            info->pip = make_playbin(channel);
+        }
+
+        if (!info->pip) {
+            g_free(info->url);
+            free(info);
+            info = NULL;
+        } else {
+            s_live_items++;
+            if (duer_cache_lookup(url, uri, sizeof(uri)) == 0) {
+                url = uri;
+            } else {
+                info->cache = duer_cache_writer_new(url, CACHE_CLASS_MEDIA);
+                if (info->cache) {
+                    info->source_setup_id = g_signal_connect(info->pip, "source-setup",
+                            G_CALLBACK(duer_cache_on_source_setup), info->cache);
+                }
+            }
+            g_object_set(G_OBJECT(info->pip), "uri", url, NULL);
+            // pooled pipelines are already READY, fresh ones pay for it here
+            gst_element_set_state(info->pip, GST_STATE_READY);
+
+            setup_stat_t *stat = &s_setup_stat[channel][pooled];
+            gint64 cost = g_get_monotonic_time() - start;
+            stat->count++;
+            stat->total_us += cost;
+            DUER_LOGI("setup %s pipeline: %lld us (%s), avg %lld us over %u",
+                      MEDIA_CHANNEL_SPEAK == channel ? "speak" : "audio",
+                      (long long)cost, pooled ? "pooled" : "built",
+                      (long long)(stat->total_us / stat->count), stat->count);
+        }
+    }
+    return info;
+}
+
+static void stats_stutter(play_info_t *info, bool stuttered)
+{
+    play_stats_t *stats = &info->stats;
+    gint64 now = g_get_monotonic_time();
+
+    if (stuttered == (stats->stutter_start != 0)) {
+        return;
+    }
+    if (stuttered) {
+        stats->stutter_start = now;
+        stats->stutters++;
+    } else {
+        gint64 cost = now - stats->stutter_start;
+        stats->stutter_us += cost;
+        stats->stutter_start = 0;
+        duer_histogram_add(&s_stutter, (uint32_t)(cost / 1000));
+        DUER_LOGI("%s stutter %u: %lld ms", MEDIA_CHANNEL_SPEAK == info->channel ? "speak" : "audio",
+                  stats->stutters, (long long)(cost / 1000));
+    }
+    // the cloud only tracks the audio player
+    if (MEDIA_CHANNEL_AUDIO == info->channel) {
+        media_report(stuttered ? MEDIA_EVENT_AUDIO_STUTTER_START : MEDIA_EVENT_AUDIO_STUTTER_END,
+                     NULL);
+    }
+}
+
+static void stats_play(play_info_t *info)
+{
+    play_stats_t *stats = &info->stats;
+    gint size = 0;
+    gint64 duration = 0;
+
+    if (!stats->started) {
+        stats->started = true;
+        g_object_get(G_OBJECT(info->pip), "buffer-size", &size,
+                     "buffer-duration", &duration, NULL);
+        DUER_LOGI("%s buffer: %d KB, %lld ms", MEDIA_CHANNEL_SPEAK == info->channel ? "speak" : "audio",
+                  size / 1024, (long long)(duration / GST_MSECOND));
+        duer_ds_log_audio_buffer_info(size > 0 ? (duer_u32_t)size : MEDIA_PLAYBIN_BUFFER_KB * 1024, 0);
+    }
+    stats->play_time = g_get_monotonic_time();
+}
+
+static void stats_hold(play_info_t *info)
+{
+    play_stats_t *stats = &info->stats;
+
+    stats_stutter(info, false);
+    if (stats->play_time) {
+        stats->played_us += g_get_monotonic_time() - stats->play_time;
+        stats->play_time = 0;
+    }
+}
+
+static void stats_bitrate(play_info_t *info, guint bitrate)
+{
+    play_stats_t *stats = &info->stats;
+
+    bitrate /= 1000;
+    if (!stats->bitrate_num || bitrate < stats->bitrate_min) {
+        stats->bitrate_min = bitrate;
+    }
+    if (bitrate > stats->bitrate_max) {
+        stats->bitrate_max = bitrate;
+    }
+    stats->bitrate_sum += bitrate;
+    stats->bitrate_num++;
+}
+
+static void tag_string(const GstTagList *tags, const char *tag, char *dst, size_t size)
+{
+    gchar *value = NULL;
+
+    if (gst_tag_list_get_string(tags, tag, &value)) {
+        snprintf(dst, size, "%s", value);
+        g_free(value);
+    }
+}
+
+/*
+ * Tags come in pieces from the demuxer, parser and decoder; keep the latest
+ * of each.
+ */
+static void track_tags(play_info_t *info, GstMessage *msg)
+{
+    track_meta_t *meta = &info->meta;
+    GstTagList *tags = NULL;
+    guint bitrate = 0;
+
+    gst_message_parse_tag(msg, &tags);
+    tag_string(tags, GST_TAG_TITLE, meta->title, sizeof(meta->title));
+    tag_string(tags, GST_TAG_ARTIST, meta->artist, sizeof(meta->artist));
+    tag_string(tags, GST_TAG_ALBUM, meta->album, sizeof(meta->album));
+    tag_string(tags, GST_TAG_AUDIO_CODEC, meta->codec, sizeof(meta->codec));
+    if (gst_tag_list_get_uint(tags, GST_TAG_BITRATE, &bitrate)
+            || gst_tag_list_get_uint(tags, GST_TAG_NOMINAL_BITRATE, &bitrate)) {
+        meta->bitrate = bitrate;
+        stats_bitrate(info, bitrate);
+    }
+    gst_tag_list_unref(tags);
+}
+
+/*
+ * Decoded format, as negotiated on the mixer sink's input.
+ */
+static void track_format(play_info_t *info, gint *rate, gint *channels, gint *bits)
+{
+    GstElement *sink = NULL;
+    GstPad *pad = NULL;
+    GstCaps *caps = NULL;
+
+    g_object_get(G_OBJECT(info->pip), "audio-sink", &sink, NULL);
+    if (sink) {
+        pad = gst_element_get_static_pad(sink, "sink");
+        gst_object_unref(sink);
+    }
+    if (pad) {
+        caps = gst_pad_get_current_caps(pad);
+        gst_object_unref(pad);
+    }
+    if (caps) {
+        GstStructure *st = gst_caps_get_structure(caps, 0);
+        const gchar *format = gst_structure_get_string(st, "format");
+        gst_structure_get_int(st, "rate", rate);
+        gst_structure_get_int(st, "channels", channels);
+        // S16LE, F32LE, U8...: the width follows the first letter
+        if (format && format[0]) {
+            *bits = atoi(format + 1);
+        }
+        gst_caps_unref(caps);
+    }
+}
+
+/*
+ * Once per track, when it first prerolled: the container tags are in by then.
+ */
+static void track_report(play_info_t *info)
+{
+    track_meta_t *meta = &info->meta;
+    gint64 duration = 0;
+    gint rate = 0;
+    gint channels = 0;
+    gint bits = 16;
+    char value[32];
+
+    if (MEDIA_CHANNEL_AUDIO != info->channel || meta->reported) {
+        return;
+    }
+    meta->reported = true;
+    if (!gst_element_query_duration(info->pip, GST_FORMAT_TIME, &duration)) {
+        duration = 0;
+    }
+    track_format(info, &rate, &channels, &bits);
+    duer_ds_log_audio_info(meta->bitrate, rate, bits, channels);
+
+    baidu_json *metadata = baidu_json_CreateObject();
+    if (!metadata) {
+        return;
+    }
+    if (meta->title[0]) {
+        baidu_json_AddStringToObject(metadata, "title", meta->title);
+    }
+    if (meta->artist[0]) {
+        baidu_json_AddStringToObject(metadata, "artist", meta->artist);
+    }
+    if (meta->album[0]) {
+        baidu_json_AddStringToObject(metadata, "album", meta->album);
+    }
+    if (meta->codec[0]) {
+        baidu_json_AddStringToObject(metadata, "codec", meta->codec);
+    }
+    if (duration > 0) {
+        snprintf(value, sizeof(value), "%lld", (long long)(duration / GST_MSECOND));
+        baidu_json_AddStringToObject(metadata, "duration", value);
+    }
+    if (meta->bitrate) {
+        snprintf(value, sizeof(value), "%u", meta->bitrate);
+        baidu_json_AddStringToObject(metadata, "bitrate", value);
+    }
+    DUER_LOGI("audio metadata: %s - %s, %s, %u bps, %d Hz x %d",
+              meta->artist, meta->title, meta->codec, meta->bitrate, rate, channels);
+    media_report(MEDIA_EVENT_AUDIO_METADATA, metadata);
+    // the event takes a copy
+    baidu_json_Delete(metadata);
+}
+
+static void stats_report(play_info_t *info)
+{
+    play_stats_t *stats = &info->stats;
+    uint32_t avg = 0;
+
+    if (!stats->started) {
+        return;
+    }
+    stats_hold(info);
+    avg = stats->bitrate_num ? (uint32_t)(stats->bitrate_sum / stats->bitrate_num) : 0;
+    if (info->eos) {
+        duer_ds_log_audio_play_finish((duer_u32_t)(stats->played_us / 1000), stats->stutters,
+                                      stats->bitrate_max, stats->bitrate_min, avg);
+    } else {
+        duer_ds_log_audio_play_stop((duer_u32_t)(stats->played_us / 1000), stats->stutters,
+                                    stats->bitrate_max, stats->bitrate_min, avg);
+    }
+    DUER_LOGI("%s played %lld ms, %u stutters %lld ms, %u qos, %u..%u kbps",
+              MEDIA_CHANNEL_SPEAK == info->channel ? "speak" : "audio",
+              (long long)(stats->played_us / 1000), stats->stutters,
+              (long long)(stats->stutter_us / 1000), stats->qos,
+              stats->bitrate_min, stats->bitrate_max);
+}
+
+static void delete_play_info(play_info_t **info)
+{
+    if (*info) {
+        if ((*info)->bus_watch_id) {
+            // g_source_remove() only looks in the global default context
+            GSource *source = g_main_context_find_source_by_id(s_ctx, (*info)->bus_watch_id);
+            if (source) {
+                g_source_destroy(source);
+            }
+            (*info)->bus_watch_id = 0;
+            s_live_watches--;
+        }
+        if ((*info)->source_setup_id) {
+            g_signal_handler_disconnect((*info)->pip, (*info)->source_setup_id);
+            (*info)->source_setup_id = 0;
+        }
+        if ((*info)->pip) {
+            pool_put((*info)->channel, (*info)->pip);
+            (*info)->pip = NULL;
+        }
+        // the source has stopped now, only a stream that reached EOS is kept
+        stats_report(*info);
+        duer_cache_writer_close((*info)->cache, (*info)->eos);
+        (*info)->cache = NULL;
+        g_free((*info)->url);
+
+        free(*info);
+        *info = NULL;
+        s_live_items--;
+    }
+}
+
+static void remove_ready_play_info(int index)
+{
+    delete_play_info(&(s_ready[index]));
+    for (int i = index; i < s_ready_num - 1; i++) {
+        s_ready[i] = s_ready[i + 1];
+    }
+    s_ready[--s_ready_num] = NULL;
+}
+
+static int ready_mem_kb()
+{
+    int kb = 0;
+    for (int i = 0; i < s_ready_num; i++) {
+        kb += s_ready[i]->buffer_kb;
+    }
+    return kb;
+}
+
+static void prefetch_play_info(play_info_t *info, int budget_kb)
+{
+    if (MEDIA_CHANNEL_SPEAK == info->channel) {
+        // keeps the short queue make_playbin() gave it, speech starts early
+        info->buffer_kb = MEDIA_SPEAK_PREBUFFER_KB;
+    } else {
+        info->buffer_kb = budget_kb < MEDIA_PREBUFFER_KB_DEFAULT ? budget_kb
+                                                                 : MEDIA_PREBUFFER_KB_DEFAULT;
+        if (info->buffer_kb < MEDIA_PREBUFFER_KB_MIN) {
+            // 0 would mean "unbounded" to queue2
+            info->buffer_kb = MEDIA_PREBUFFER_KB_MIN;
+        }
+        g_object_set(G_OBJECT(info->pip),
+                     "buffer-duration", (gint64)s_prebuffer_ms * GST_MSECOND,
+                     "buffer-size", info->buffer_kb * 1024, NULL);
+    }
+    // PAUSED opens the source and prerolls the decoder while the previous item plays
+    gst_element_set_state(info->pip, GST_STATE_PAUSED);
+}
+
+static play_info_t *pop_ready_play_info()
+{
+    play_info_t *info = NULL;
+
+    if (s_ready_num) {
+        info = s_ready[0];
+        for (int i = 0; i < s_ready_num - 1; i++) {
+            s_ready[i] = s_ready[i + 1];
+        }
+        s_ready[--s_ready_num] = NULL;
+    }
+    return info;
+}
+
+static void push_ready_play_info(play_info_t **info)
+{
+    // a newer item replaces whatever of the same kind was still waiting
+    for (int i = s_ready_num - 1; i >= 0; i--) {
+        if (s_ready[i]->channel == (*info)->channel) {
+            remove_ready_play_info(i);
+        }
+    }
+    prefetch_play_info(*info, s_ready_mem_kb - ready_mem_kb());
+    s_ready[s_ready_num++] = *info;
+    *info = NULL;
+}
+
+static void drop_ready_play_info(media_channel_t channel)
+{
+    for (int i = s_ready_num - 1; i >= 0; i--) {
+        if (s_ready[i]->channel == channel) {
+            remove_ready_play_info(i);
+        }
+    }
+}
+
+static int cmd_submit(media_cmd_type_t type, const char *url, int arg, bool wait);
+static void item_end(bool finished);
+
+// -1 when the milestone was not seen, e.g. no source signal for a cached file
+static long long speak_mark_ms(const play_info_t *info, speak_mark_t mark)
+{
+    if (!info->mark[mark]) {
+        return -1;
+    }
+    return (long long)((info->mark[mark] - info->mark[SPEAK_MARK_REQUEST]) / 1000);
+}
+
+static void speak_mark(play_info_t *info, speak_mark_t mark, gint64 time)
+{
+    if (MEDIA_CHANNEL_SPEAK != info->channel || info->mark[mark]) {
+        return;
+    }
+    info->mark[mark] = time;
+    if (SPEAK_MARK_FIRST_BYTE == mark) {
+        duer_ds_log_audio_download_delay();
+    } else if (SPEAK_MARK_PREROLL == mark) {
+        duer_ds_log_audio_play_delay();
+        // the first sample is heard once it went through the mixer ring
+        gint64 first_audio = time + duer_mixer_output_delay_us();
+        gint64 ttfa_ms = (first_audio - info->mark[SPEAK_MARK_REQUEST]) / 1000;
+        duer_histogram_add(&s_ttfa, (uint32_t)ttfa_ms);
+        DUER_LOGI("speak first audio: %lld ms (source %lld, first byte %lld,"
+                  " stream start %lld, preroll %lld ms)", (long long)ttfa_ms,
+                  speak_mark_ms(info, SPEAK_MARK_SOURCE), speak_mark_ms(info, SPEAK_MARK_FIRST_BYTE),
+                  speak_mark_ms(info, SPEAK_MARK_STREAM_START), speak_mark_ms(info, SPEAK_MARK_PREROLL));
+        if (s_ttfa.count % MEDIA_TTFA_LOG_EVERY == 0) {
+            duer_histogram_log(&s_ttfa);
+        }
+    }
+}
+
+static void speak_mark_message(play_info_t *info, GstMessage *msg)
+{
+    const GstStructure *mark = gst_message_get_structure(msg);
+    gint64 time = 0;
+
+    if (!mark || !gst_structure_get_int64(mark, "time", &time)) {
+        return;
+    }
+    if (gst_structure_has_name(mark, "speak-source")) {
+        speak_mark(info, SPEAK_MARK_SOURCE, time);
+    } else if (gst_structure_has_name(mark, "speak-first-byte")) {
+        speak_mark(info, SPEAK_MARK_FIRST_BYTE, time);
+    }
+}
+
+static void resume_seek(play_info_t *info)
+{
+    // the http source turns this into a ranged request for the remainder
+    if (gst_element_seek_simple(info->pip, GST_FORMAT_TIME,
+                                GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+                                (gint64)info->resume_ms * GST_MSECOND)) {
+        info->resume = RESUME_SEEKING;
+    } else {
+        DUER_LOGE("resume seek to %d ms failed, play from the start", info->resume_ms);
+        info->resume = RESUME_NONE;
+        stats_play(info);
+        gst_element_set_state(info->pip, GST_STATE_PLAYING);
+    }
+}
+
+/*
+ * A prerolled resume item is seeked in PAUSED, so nothing before the offset
+ * reaches the mixer, and only starts once it prerolled again at the offset.
+ */
+static void resume_prerolled(play_info_t *info)
+{
+    if (RESUME_PREROLL == info->resume) {
+        resume_seek(info);
+    } else if (RESUME_SEEKING == info->resume) {
+        gint64 cost_ms = (g_get_monotonic_time() - info->resume_time) / 1000;
+        duer_histogram_add(&s_resume_latency, (uint32_t)cost_ms);
+        DUER_LOGI("audio resumed at %d ms after %lld ms", info->resume_ms, (long long)cost_ms);
+        info->resume = RESUME_NONE;
+        s_seek = info->resume_ms;
+        stats_play(info);
+        gst_element_set_state(info->pip, GST_STATE_PLAYING);
+    }
+}
+
+static void crossfade_end();
+
+static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    if (data && data == s_fading) {
+        if (GST_MESSAGE_EOS == GST_MESSAGE_TYPE(msg)) {
+            // the tail is still in the mixer ring, the fade timer ends it
+            s_fading->eos = true;
+        } else if (GST_MESSAGE_ERROR == GST_MESSAGE_TYPE(msg)) {
+            crossfade_end();
+        }
+        return TRUE;
+    }
+    if (data != s_pinfo[0]) {
+        // a paused item keeps its watch, it must not end the current one
+        return TRUE;
+    }
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+
+        case GST_MESSAGE_APPLICATION:
+            speak_mark_message(s_pinfo[0], msg);
+            break;
+
+        case GST_MESSAGE_STREAM_START:
+            speak_mark(s_pinfo[0], SPEAK_MARK_STREAM_START, g_get_monotonic_time());
+            break;
+
+        case GST_MESSAGE_ASYNC_DONE:
+            speak_mark(s_pinfo[0], SPEAK_MARK_PREROLL, g_get_monotonic_time());
+            track_report(s_pinfo[0]);
+            resume_prerolled(s_pinfo[0]);
+            break;
+
+        case GST_MESSAGE_BUFFERING: {
+                gint percent = 100;
+
+                gst_message_parse_buffering(msg, &percent);
+                // the initial fill and a resume seek are not stutters
+                if (s_pinfo[0]->stats.play_time && RESUME_NONE == s_pinfo[0]->resume) {
+                    stats_stutter(s_pinfo[0], percent < 100);
+                }
+            }
+            break;
+
+        case GST_MESSAGE_TAG:
+            track_tags(s_pinfo[0], msg);
+            break;
+
+        case GST_MESSAGE_QOS:
+            s_pinfo[0]->stats.qos++;
+            break;
+
+        case GST_MESSAGE_LATENCY:
+            // an element changed its latency, let the pipeline redistribute it
+            gst_bin_recalculate_latency(GST_BIN(s_pinfo[0]->pip));
+            break;
+
+        case GST_MESSAGE_EOS:
+            s_pinfo[0]->eos = true;
+            item_end(true);
+            break;
+
+        case GST_MESSAGE_ERROR: {
+                gchar  *debug = NULL;
+                GError *error = NULL;
+
+                gst_message_parse_error(msg, &error, &debug);
+                g_free(debug);
+
+                DUER_LOGE("gstreamer play : %s\n", error->message);
+                media_report(MEDIA_EVENT_AUDIO_FAILED, error->message);
+                g_error_free(error);
+
+                item_end(true);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return TRUE;
+}
+
+static void item_start();
+static bool current_is(media_channel_t channel);
+static void audio_finishing();
+
+static void poll_stop()
+{
+    if (s_poll_source) {
+        g_source_destroy(s_poll_source);
+        g_source_unref(s_poll_source);
+        s_poll_source = NULL;
+    }
+}
+
+/*
+ * The outgoing track has faded out, or the fade was cut short by a command.
+ */
+static void crossfade_end()
+{
+    if (s_fade_source) {
+        g_source_destroy(s_fade_source);
+        g_source_unref(s_fade_source);
+        s_fade_source = NULL;
+    }
+    if (s_fading) {
+        // also ends the mixer fade, the incoming track keeps its full gain
+        duer_mixer_set_active(s_fading->stream, false);
+        delete_play_info(&s_fading);
+    }
+}
+
+static gboolean on_crossfade_done(gpointer data)
+{
+    crossfade_end();
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Start the queued track on the other content stream while the current one
+ * plays its last fade_ms, and let the mixer blend the two.
+ */
+static void crossfade_start(int fade_ms)
+{
+    play_info_t *out = s_pinfo[0];
+    gint64 start = g_get_monotonic_time();
+
+    crossfade_end();
+    poll_stop();
+    s_fading = out;
+    s_pinfo[0] = NULL;
+    s_audio_finishing = false;
+    s_seek = 0;
+
+    s_content_stream = MIXER_STREAM_CONTENT == out->stream ? MIXER_STREAM_CONTENT_B
+                                                          : MIXER_STREAM_CONTENT;
+    // before the first period of the new track reaches the mixer
+    duer_mixer_crossfade(out->stream, s_content_stream, fade_ms);
+    item_start();
+
+    s_fade_source = g_timeout_source_new(fade_ms + duer_mixer_output_delay_us() / 1000);
+    g_source_set_callback(s_fade_source, on_crossfade_done, NULL, NULL);
+    g_source_attach(s_fade_source, s_ctx);
+    duer_histogram_add(&s_track_gap, 0);
+    DUER_LOGI("crossfade %d ms, next track started in %lld us",
+              fade_ms, (long long)(g_get_monotonic_time() - start));
+}
+
+/*
+ * Runs every MEDIA_CROSSFADE_POLL_MS while a content track plays. The end is
+ * reported only as early as the next track needs to be asked for and
+ * prebuffered, so the cloud's progress stays close to what was heard.
+ * Streams without a known duration report it once their tail drained.
+ */
+static gboolean on_crossfade_poll(gpointer data)
+{
+    play_info_t *info = s_pinfo[0];
+    gint64 pos = 0;
+    gint64 dur = 0;
+
+    if (!current_is(MEDIA_CHANNEL_AUDIO) || MEDIA_AUDIO_PLAY != s_audio_state
+            || RESUME_NONE != info->resume) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (!gst_element_query_position(info->pip, GST_FORMAT_TIME, &pos)
+            || !gst_element_query_duration(info->pip, GST_FORMAT_TIME, &dur) || dur <= 0) {
+        return G_SOURCE_CONTINUE;
+    }
+    // the pipeline reports what was decoded, the ring still holds the rest
+    int remaining = (int)((dur - pos) / GST_MSECOND) + duer_mixer_queued_ms(info->stream);
+    if (remaining <= s_crossfade_ms + s_prebuffer_ms + MEDIA_FINISH_LEAD_MS) {
+        audio_finishing();
+    }
+    if (s_crossfade_ms && remaining <= s_crossfade_ms && s_ready_num
+            && MEDIA_CHANNEL_AUDIO == s_ready[0]->channel && RESUME_NONE == s_ready[0]->resume) {
+        crossfade_start(remaining > 0 ? remaining : MEDIA_CROSSFADE_POLL_MS);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void poll_start()
+{
+    poll_stop();
+    s_poll_source = g_timeout_source_new(MEDIA_CROSSFADE_POLL_MS);
+    g_source_set_callback(s_poll_source, on_crossfade_poll, NULL, NULL);
+    g_source_attach(s_poll_source, s_ctx);
+}
+
+static void item_start()
+{
+    play_info_t *info = pop_ready_play_info();
+
+    if (!info) {
+        return;
+    }
+    s_pinfo[0] = info;
+    if (MEDIA_CHANNEL_AUDIO == info->channel && s_pinfo[1] && s_pinfo[1] != info) {
+        delete_play_info(&(s_pinfo[1]));
+    }
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(info->pip));
+
+    if (!info->bus_watch_id) {
+        // attaches to s_ctx, the media thread's default context
+        info->bus_watch_id = gst_bus_add_watch(bus, bus_call, info);
+        s_live_watches++;
+    }
+    gst_object_unref(bus);
+    if (MEDIA_CHANNEL_AUDIO == info->channel) {
+        // a pooled playbin may still point at the other content stream
+        GstElement *sink = NULL;
+        g_object_get(G_OBJECT(info->pip), "audio-sink", &sink, NULL);
+        if (sink) {
+            duer_mixer_sink_set_stream(sink, s_content_stream);
+            gst_object_unref(sink);
+        }
+        info->stream = s_content_stream;
+    }
+    duer_mixer_set_active(info->stream, true);
+    if (MEDIA_CHANNEL_AUDIO == info->channel) {
+        poll_start();
+    }
+    if (RESUME_PREROLL == info->resume) {
+        GstState state = GST_STATE_VOID_PENDING;
+        GstState pending = GST_STATE_VOID_PENDING;
+        gst_element_get_state(info->pip, &state, &pending, 0);
+        if (GST_STATE_PAUSED == state && GST_STATE_VOID_PENDING == pending) {
+            // already prerolled while it was waiting (paused or queued)
+            resume_seek(info);
+        } else {
+            gst_element_set_state(info->pip, GST_STATE_PAUSED);
+        }
+    } else {
+        stats_play(info);
+        gst_element_set_state(info->pip, GST_STATE_PLAYING);
+    }
+    if (MEDIA_CHANNEL_AUDIO == info->channel && s_audio_eos_time) {
+        gint64 gap_ms = (g_get_monotonic_time() - s_audio_eos_time) / 1000;
+        DUER_LOGI("audio hand-off gap: %lld ms", (long long)gap_ms);
+        duer_histogram_add(&s_track_gap, (uint32_t)gap_ms);
+        s_audio_eos_time = 0;
+    }
+}
+
+/*
+ * Runs on the mixer thread: hand the completion to the media thread.
+ */
+static void on_mixer_drained(duer_mixer_stream_t stream, void *param)
+{
+    cmd_submit(MEDIA_CMD_DRAINED, NULL, GPOINTER_TO_INT(param), false);
+}
+
+/*
+ * The item's pipeline is gone but its tail is still queued in the mixer. The
+ * end is reported from drain_done() once the last sample was heard, not when
+ * it was decoded, and the media thread keeps running meanwhile.
+ */
+static void drain_start(play_info_t *info)
+{
+    s_drain_seq = (s_drain_seq + 1) & 0xffff;
+    s_draining[info->channel] = true;
+    s_drain_stream[info->channel] = info->stream;
+    duer_mixer_drain_async(info->stream, on_mixer_drained,
+                           GINT_TO_POINTER(s_drain_seq * MEDIA_CHANNEL_NUM + info->channel));
+}
+
+/*
+ * A command cut the tail short: drop it, the end is not reported.
+ */
+static void drain_cancel(media_channel_t channel)
+{
+    if (s_draining[channel]) {
+        s_draining[channel] = false;
+        duer_mixer_set_active(s_drain_stream[channel], false);
+    }
+}
+
+static void speak_finished()
+{
+    s_speak_state = MEDIA_SPEAK_STOP;
+    media_report(MEDIA_EVENT_SPEECH_FINISHED, NULL);
+}
+
+static void drain_done(int arg)
+{
+    media_channel_t channel = (media_channel_t)(arg % MEDIA_CHANNEL_NUM);
+
+    if (arg / MEDIA_CHANNEL_NUM != s_drain_seq || !s_draining[channel]) {
+        // cancelled, or replaced by a later drain
+        return;
+    }
+    s_draining[channel] = false;
+    if (MEDIA_CHANNEL_SPEAK == channel) {
+        duer_mixer_set_active(MIXER_STREAM_DIALOG, false);
+        if (MEDIA_SPEAK_PLAY == s_speak_state) {
+            speak_finished();
+        }
+    } else {
+        media_report(MEDIA_EVENT_AUDIO_FINISHED, NULL);
+    }
+}
+
+static void speak_end(bool finished)
+{
+    if (finished && MEDIA_SPEAK_PLAY == s_speak_state) {
+        drain_start(s_pinfo[0]);
+        delete_play_info(&(s_pinfo[0]));
+        return;
+    }
+    duer_mixer_set_active(MIXER_STREAM_DIALOG, false);
+    delete_play_info(&(s_pinfo[0]));
+    if (MEDIA_SPEAK_PLAY == s_speak_state) {
+        speak_finished();
+    }
+}
+
+static void audio_end(bool finished)
+{
+    poll_stop();
+
+    if (MEDIA_AUDIO_PLAY == s_audio_state) {
+        // the ring still holds the tail, the next track queues behind it
+        if (s_audio_finishing) {
+            s_audio_eos_time = g_get_monotonic_time();
+        } else {
+            drain_start(s_pinfo[0]);
+        }
+        s_audio_finishing = false;
+        delete_play_info(&(s_pinfo[0]));
+        s_seek = 0;
+    } else if (MEDIA_AUDIO_STOP == s_audio_state) {
+        s_audio_finishing = false;
+        duer_mixer_set_active(s_pinfo[0]->stream, false);
+        delete_play_info(&(s_pinfo[0]));
+        s_seek = 0;
+    } else if (MEDIA_AUDIO_PAUSE == s_audio_state) {
+        s_audio_finishing = false;
+        stats_hold(s_pinfo[0]);
+        duer_mixer_set_active(s_pinfo[0]->stream, false);
+        gst_element_set_state(s_pinfo[0]->pip, GST_STATE_PAUSED);
+        s_pinfo[1] = s_pinfo[0];
+        s_pinfo[0] = NULL;
+    } else {
+        // do nothing
+    }
+}
+
+/*
+ * Speech or music is audible while it plays, including the tail a finished
+ * item leaves in the mixer, and no longer once both stopped, paused or
+ * drained. s_audio_state alone stays MEDIA_AUDIO_PLAY after the last track
+ * ended on its own. The recorder's VAD follows every change.
+ */
+static void audible_update()
+{
+    bool audible = MEDIA_SPEAK_PLAY == s_speak_state
+                   || (MEDIA_AUDIO_PLAY == s_audio_state && current_is(MEDIA_CHANNEL_AUDIO))
+                   || s_draining[MEDIA_CHANNEL_SPEAK] || s_draining[MEDIA_CHANNEL_AUDIO];
+
+    if (audible != s_audible) {
+        s_audible = audible;
+        duer_recorder_set_playing(audible);
+    }
+}
+
+/*
+ * The current item ended: on its own (EOS or error) when finished is true,
+ * otherwise because a command stopped or paused it. The next ready item
+ * starts right away.
+ */
+static void item_end(bool finished)
+{
+    if (!s_pinfo[0]) {
+        return;
+    }
+    if (MEDIA_CHANNEL_SPEAK == s_pinfo[0]->channel) {
+        speak_end(finished);
+    } else {
+        audio_end(finished);
+    }
+    item_start();
+    audible_update();
+}
+
+static bool current_is(media_channel_t channel)
+{
+    return s_pinfo[0] && s_pinfo[0]->channel == channel;
+}
+
+static void speak_stop()
+{
+    drain_cancel(MEDIA_CHANNEL_SPEAK);
+    if (MEDIA_SPEAK_PLAY == s_speak_state) {
+        s_speak_state = MEDIA_SPEAK_STOP;
+        if (current_is(MEDIA_CHANNEL_SPEAK)) {
+            item_end(false);
+        } else {
+            drop_ready_play_info(MEDIA_CHANNEL_SPEAK);
+        }
+    } else {
+        DUER_LOGI("Speak stop state : %d", s_speak_state);
+    }
+}
 
-static play_info_t *create_play_info(const char *url, play_handler func)
+static void speak_play(const char *url)
 {
-    play_info_t *info = NULL;
-    info = (play_info_t *)malloc(sizeof(play_info_t));
+    if (MEDIA_SPEAK_PLAY == s_speak_state) {
+        speak_stop();
+    }
 
-    if (info) {
-        info->func = func;
-        info->pip = gst_element_factory_make("playbin", NULL);
-        g_object_set(G_OBJECT(info->pip), "uri", url, NULL);
+    // a new answer is coming, the previous one no longer expects a reply
+    duer_recorder_follow_up_stop();
 
-        if (!info->pip) {
-            info->func = NULL;
-            free(info);
-            info = NULL;
-        }
+    duer_ds_log_audio_request_play();
+    duer_ds_log_audio_request_download();
+    gint64 request = g_get_monotonic_time();
+    play_info_t *speak = create_play_info(url, MEDIA_CHANNEL_SPEAK);
+    if (speak) {
+        speak->mark[SPEAK_MARK_REQUEST] = request;
+        push_ready_play_info(&speak);
+        s_speak_state = MEDIA_SPEAK_PLAY;
+    } else {
+        DUER_LOGI("Speak info create failed!");
     }
-    return info;
 }
 
-static void delete_play_info(play_info_t **info)
+static void audio_stop()
 {
-    if (*info) {
-        if ((*info)->pip) {
-            gst_element_set_state((*info)->pip, GST_STATE_NULL);
-            gst_object_unref(GST_OBJECT((*info)->pip));
-            (*info)->pip = NULL;
+    crossfade_end();
+    drain_cancel(MEDIA_CHANNEL_AUDIO);
+    if (MEDIA_AUDIO_PLAY == s_audio_state) {
+        s_audio_state = MEDIA_AUDIO_STOP;
+        drop_ready_play_info(MEDIA_CHANNEL_AUDIO);
+        if (current_is(MEDIA_CHANNEL_AUDIO)) {
+            item_end(false);
+        }
+    } else if (MEDIA_AUDIO_PAUSE == s_audio_state) {
+        if (s_pinfo[1]) {
+            delete_play_info(&(s_pinfo[1]));
         }
+        s_audio_state = MEDIA_AUDIO_STOP;
+    } else {
+        DUER_LOGI("Audio stop state : %d", s_audio_state);
+    }
+}
 
-        (*info)->func = NULL;
-        free(*info);
-        *info = NULL;
+static play_info_t *audio_start(const char *url)
+{
+    if (s_audio_finishing) {
+        // the current track only has its buffered tail left: queue behind it
+        drop_ready_play_info(MEDIA_CHANNEL_AUDIO);
+    } else if (MEDIA_AUDIO_STOP != s_audio_state) {
+        audio_stop();
+    }
+
+    play_info_t *audio = create_play_info(url, MEDIA_CHANNEL_AUDIO);
+    play_info_t *queued = audio;
+    if (audio) {
+        push_ready_play_info(&audio);
+        s_audio_state = MEDIA_AUDIO_PLAY;
+    } else {
+        DUER_LOGI("Audio info create failed!");
     }
+    return queued;
 }
 
-static play_info_t *pop_ready_play_info()
+/*
+ * Continue at offset ms. The paused pipeline is reused when it holds the same
+ * url, otherwise a new one is opened; either way it is seeked once prerolled
+ * instead of playing again from the start.
+ */
+static void audio_resume(const char *url, int offset)
 {
     play_info_t *info = NULL;
-    pthread_mutex_lock(&s_loack);
-    if (!s_pinfo[1]) {
-        s_isblock = true;
-        pthread_cond_wait(&s_cond, &s_loack);
-        s_isblock = false;
-    }
-    info = s_pinfo[1];
-    s_pinfo[1] = NULL;
-    pthread_mutex_unlock(&s_loack);
-    return info;
+
+    if (MEDIA_AUDIO_PAUSE == s_audio_state && s_pinfo[1]
+            && (!url || !s_pinfo[1]->url || strcmp(url, s_pinfo[1]->url) == 0)) {
+        info = s_pinfo[1];
+        push_ready_play_info(&(s_pinfo[1]));
+        s_audio_state = MEDIA_AUDIO_PLAY;
+        if (offset == s_seek) {
+            // the pipeline is still where it was paused
+            return;
+        }
+    } else {
+        info = audio_start(url);
+    }
+    if (info && offset > 0) {
+        info->resume = RESUME_PREROLL;
+        info->resume_ms = offset;
+        info->resume_time = g_get_monotonic_time();
+    }
 }
 
-static void push_ready_play_info(play_info_t **info)
+static void audio_pause()
 {
-    pthread_mutex_lock(&s_loack);
-    if (s_pinfo[1]) {
-        delete_play_info(&(s_pinfo[1]));
+    crossfade_end();
+    if (MEDIA_AUDIO_PLAY == s_audio_state) {
+        s_audio_state = MEDIA_AUDIO_PAUSE;
+        if (current_is(MEDIA_CHANNEL_AUDIO)) {
+            item_end(false);
+        } else {
+            // not started yet, resume will open it again from the url
+            drop_ready_play_info(MEDIA_CHANNEL_AUDIO);
+        }
+    } else {
+        DUER_LOGI("Audio pause state : %d", s_audio_state);
     }
-    s_pinfo[1] = *info;
-    *info = NULL;
-    if (s_isblock) {
-        pthread_cond_signal(&s_cond);
+}
+
+static void audio_finishing()
+{
+    if (MEDIA_AUDIO_PLAY == s_audio_state && current_is(MEDIA_CHANNEL_AUDIO)
+            && !s_audio_finishing) {
+        s_audio_finishing = true;
+        media_report(MEDIA_EVENT_AUDIO_FINISHED, NULL);
     }
-    pthread_mutex_unlock(&s_loack);
 }
 
-static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data)
+static int audio_position()
 {
-    GMainLoop *loop = (GMainLoop *)data;
+    gint64 pos = 0;
+    if (current_is(MEDIA_CHANNEL_AUDIO) && RESUME_NONE != s_pinfo[0]->resume) {
+        // not at the offset yet, the pipeline would still report 0
+        return s_pinfo[0]->resume_ms;
+    }
+    if (current_is(MEDIA_CHANNEL_AUDIO) && MEDIA_AUDIO_PLAY == s_audio_state) {
+        if (gst_element_query_position(s_pinfo[0]->pip, GST_FORMAT_TIME, &pos)) {
+            s_seek = pos / GST_MSECOND;
+        }
+    }
 
-    switch (GST_MESSAGE_TYPE(msg)) {
+    return s_seek;
+}
 
-        case GST_MESSAGE_EOS:
-            g_main_loop_quit(loop);
-            break;
+static void volume_apply(double vol)
+{
+    if (s_mute) {
+        return;
+    }
+    if (vol < VOLUME_MIX) {
+        vol = 0.0;
+    } else if (vol > VOLUME_MAX){
+        vol = VOLUME_MAX;
+    } else {
+        // do nothing
+    }
+    s_vol = vol;
 
-        case GST_MESSAGE_ERROR: {
-                gchar  *debug = NULL;
-                GError *error = NULL;
+    duer_volume_set(s_vol);
+    DUER_LOGI("volume : %.1f", s_vol);
+    media_report(MEDIA_EVENT_VOLUME_CHANGED, NULL);
+}
 
-                gst_message_parse_error(msg, &error, &debug);
-                g_free(debug);
+static void mute_apply(bool mute)
+{
+    s_mute = mute;
 
-                DUER_LOGE("gstreamer play : %s\n", error->message);
-                duer_dcs_audio_play_failed(DCS_MEDIA_ERROR_INTERNAL_DEVICE_ERROR,
-                    error->message);
-                g_error_free(error);
+    duer_volume_set_mute(mute);
+    media_report(MEDIA_EVENT_MUTE_CHANGED, NULL);
+}
 
-                g_main_loop_quit(loop);
-            }
+static int cmd_exec(media_cmd_type_t type, const char *url, int arg)
+{
+    int ret = 0;
+
+    switch (type) {
+        case MEDIA_CMD_SPEAK_PLAY:
+            speak_play(url);
+            break;
+        case MEDIA_CMD_SPEAK_STOP:
+            speak_stop();
+            break;
+        case MEDIA_CMD_AUDIO_START:
+            audio_start(url);
+            break;
+        case MEDIA_CMD_AUDIO_RESUME:
+            audio_resume(url, arg);
+            break;
+        case MEDIA_CMD_AUDIO_STOP:
+            audio_stop();
+            break;
+        case MEDIA_CMD_AUDIO_PAUSE:
+            audio_pause();
+            break;
+        case MEDIA_CMD_AUDIO_POSITION:
+            ret = audio_position();
             break;
+        case MEDIA_CMD_VOLUME_SET:
+            volume_apply(arg / 100.0);
+            break;
+        case MEDIA_CMD_VOLUME_CHANGE:
+            volume_apply(s_vol + arg / 100.0);
+            break;
+        case MEDIA_CMD_MUTE:
+            mute_apply(arg);
+            break;
+        case MEDIA_CMD_DRAINED:
+            drain_done(arg);
+            break;
+        case MEDIA_CMD_SYNC:
         default:
             break;
     }
+    if (!s_pinfo[0]) {
+        item_start();
+    }
+    audible_update();
+
+    return ret;
 }
 
-static void speak_play()
+static void cmd_complete(media_cmd_t *cmd, int result)
 {
-    if (s_mute) {
-        g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", 0.0, NULL);
-    } else {
-        //g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", s_vol, NULL);
+    free(cmd->url);
+    cmd->url = NULL;
+    if (cmd->future) {
+        pthread_mutex_lock(&cmd->future->lock);
+        cmd->future->result = result;
+        cmd->future->done = true;
+        pthread_cond_signal(&cmd->future->cond);
+        pthread_mutex_unlock(&cmd->future->lock);
+        cmd->future = NULL;
     }
-    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(s_pinfo[0]->pip));
+}
 
-    guint bus_watch_id = gst_bus_add_watch(bus, bus_call, s_loop);
-    gst_object_unref(bus);
-    gst_element_set_state(s_pinfo[0]->pip, GST_STATE_PLAYING);
-    g_main_loop_run(s_loop);
+/*
+ * Vyukov's intrusive MPSC queue. A producer publishes with one exchange on the
+ * tail; between the exchange and linking prev->next the consumer may see the
+ * queue as empty, and the producer's wakeup that follows brings it back.
+ * -1 once the queue is closed; a push that got in is linked before
+ * duer_media_destroy() stops the media thread, which fails what it finds.
+ */
+static int cmd_push(media_cmd_t *cmd)
+{
+    __atomic_add_fetch(&s_cmd_pushing, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s_cmd_closed, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&s_cmd_pushing, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    cmd->next = NULL;
+    media_cmd_t *prev = __atomic_exchange_n(&s_cmd_tail, cmd, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+    g_main_context_wakeup(s_ctx);
+    __atomic_sub_fetch(&s_cmd_pushing, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
 
-    delete_play_info(&(s_pinfo[0]));
-    if (MEDIA_SPEAK_PLAY == s_speak_state) {
-        s_speak_state = MEDIA_SPEAK_STOP;
-        duer_dcs_speech_on_finished();
+/*
+ * Consumer side. The popped node becomes the new stub, so its payload is
+ * moved out and the old stub is freed.
+ */
+static bool cmd_pop(media_cmd_t *out)
+{
+    media_cmd_t *head = s_cmd_head;
+    media_cmd_t *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (!next) {
+        return false;
     }
+    *out = *next;
+    next->url = NULL;
+    next->future = NULL;
+    s_cmd_head = next;
+    free(head);
+
+    return true;
 }
 
-static void audio_play()
+static void cmd_run(media_cmd_t *cmd)
 {
-    if (s_pinfo[2]) {
-        delete_play_info(&(s_pinfo[2]));
+    duer_histogram_add(&s_cmd_latency, (uint32_t)(g_get_monotonic_time() - cmd->submit_time));
+    if (s_cmd_latency.count % MEDIA_CMD_LOG_EVERY == 0) {
+        duer_histogram_log(&s_cmd_latency);
     }
-    if (s_mute) {
-        g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", 0.0, NULL);
-    } else {
-        //g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", s_vol, NULL);
+    cmd_complete(cmd, cmd_exec(cmd->type, cmd->url, cmd->arg));
+}
+
+/*
+ * Non-blocking unless wait is set, in which case the caller sleeps on a future
+ * until the media thread has executed the command and gets its result.
+ */
+static int cmd_submit(media_cmd_type_t type, const char *url, int arg, bool wait)
+{
+    media_future_t future;
+    media_cmd_t *cmd = NULL;
+
+    if (!s_start_up) {
+        return -1;
+    }
+    if (pthread_equal(pthread_self(), s_media_tid)) {
+        // called back from the media thread (DCS callbacks): run in place
+        return cmd_exec(type, url, arg);
     }
-    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(s_pinfo[0]->pip));
 
-    guint bus_watch_id = gst_bus_add_watch(bus, bus_call, s_loop);
-    gst_object_unref(bus);
-    gst_element_set_state(s_pinfo[0]->pip, GST_STATE_PLAYING);
-    g_main_loop_run(s_loop);
+    cmd = (media_cmd_t *)calloc(1, sizeof(media_cmd_t));
+    if (!cmd) {
+        DUER_LOGE("No memory for media command!");
+        return -1;
+    }
+    cmd->type = type;
+    cmd->url = url ? strdup(url) : NULL;
+    cmd->arg = arg;
+    cmd->submit_time = g_get_monotonic_time();
+    if (wait) {
+        pthread_mutex_init(&future.lock, NULL);
+        pthread_cond_init(&future.cond, NULL);
+        future.done = false;
+        future.result = -1;
+        cmd->future = &future;
+    }
+    if (cmd_push(cmd)) {
+        free(cmd->url);
+        free(cmd);
+        if (wait) {
+            pthread_mutex_destroy(&future.lock);
+            pthread_cond_destroy(&future.cond);
+        }
+        return -1;
+    }
+    if (!wait) {
+        return 0;
+    }
 
-    if (MEDIA_AUDIO_PLAY == s_audio_state) {
-        duer_dcs_audio_on_finished();
-        delete_play_info(&(s_pinfo[0]));
-        s_seek = 0;
-    } else if (MEDIA_AUDIO_STOP == s_audio_state) {
-        delete_play_info(&(s_pinfo[0]));
-        s_seek = 0;
-    } else if (MEDIA_AUDIO_PAUSE == s_audio_state) {
-        gst_element_set_state(s_pinfo[0]->pip, GST_STATE_PAUSED);
-        s_pinfo[2] = s_pinfo[0];
-        s_pinfo[0] = NULL;
-    } else {
-        // do nothing
+    pthread_mutex_lock(&future.lock);
+    while (!future.done) {
+        pthread_cond_wait(&future.cond, &future.lock);
     }
+    pthread_mutex_unlock(&future.lock);
+    pthread_mutex_destroy(&future.lock);
+    pthread_cond_destroy(&future.cond);
+
+    return future.result;
 }
 
 static void media_thread()
 {
+    media_cmd_t cmd;
+
+    g_main_context_push_thread_default(s_ctx);
     while (s_start_up) {
-        s_pinfo[0] = pop_ready_play_info();
-        if (!s_start_up) {
-            break;
-        }
-        if (!s_pinfo[0]) {
-            continue;
+        while (cmd_pop(&cmd)) {
+            cmd_run(&cmd);
         }
-        s_pinfo[0]->func();
+        // sleeps until a bus message or a cmd_push() wakeup
+        g_main_context_iteration(s_ctx, TRUE);
+    }
+    poll_stop();
+    crossfade_end();
+    if (s_pinfo[0]) {
+        duer_mixer_set_active(s_pinfo[0]->stream, false);
+        delete_play_info(&(s_pinfo[0]));
     }
+    delete_play_info(&(s_pinfo[1]));
+    while (s_ready_num) {
+        remove_ready_play_info(0);
+    }
+    // fail whatever is still queued so no submitter waits forever
+    while (cmd_pop(&cmd)) {
+        cmd_complete(&cmd, -1);
+    }
+    g_main_context_pop_thread_default(s_ctx);
 }
 
-void duer_media_init()
+void duer_media_set_report(duer_media_report_cb report)
 {
-    pthread_mutex_init(&s_loack, NULL);
-    pthread_cond_init(&s_cond, NULL);
+    s_report = report;
+}
 
+void duer_media_init()
+{
     gst_init(NULL, NULL);
+    if (duer_mixer_init() != 0) {
+        DUER_LOGE("Open audio output error!");
+        exit(1);
+    }
+    duer_volume_init();
+    duer_volume_set(s_vol);
+    pool_init();
+    duer_cache_init(CACHE_DIR_DEFAULT);
+    if (duer_tone_init() != 0) {
+        DUER_LOGE("No tones cached!");
+    }
 
-    s_loop = g_main_loop_new(NULL, FALSE);
-    if (!s_loop) {
+    s_ctx = g_main_context_new();
+    s_cmd_head = s_cmd_tail = (media_cmd_t *)calloc(1, sizeof(media_cmd_t));
+    s_cmd_closed = false;
+    if (!s_ctx || !s_cmd_head) {
         DUER_LOGE("Create media loop error!");
         exit(1);
     }
+    duer_histogram_init(&s_cmd_latency, "media command latency", "us");
+    duer_histogram_init(&s_ttfa, "speak first audio", "ms");
+    duer_histogram_init(&s_resume_latency, "audio resume", "ms");
+    duer_histogram_init(&s_stutter, "stutter", "ms");
+    duer_histogram_init(&s_track_gap, "audio track gap", "ms");
 
     s_start_up = true;
     int ret = pthread_create(&s_media_tid, NULL, (void *)media_thread, NULL);
@@ -237,138 +1664,80 @@ void duer_media_init()
 
 void duer_media_destroy()
 {
-    s_start_up = false;
-    if(s_isblock) {
-        pthread_cond_signal(&s_cond);
-    } else {
-        g_main_loop_quit(s_loop);
+    // no new commands; the ones being pushed get linked, the thread fails them
+    __atomic_store_n(&s_cmd_closed, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&s_cmd_pushing, __ATOMIC_SEQ_CST)) {
+        sched_yield();
     }
+    s_start_up = false;
+    g_main_context_wakeup(s_ctx);
 
     pthread_join(s_media_tid, NULL);
+    duer_histogram_log(&s_cmd_latency);
+    duer_histogram_log(&s_ttfa);
+    duer_histogram_log(&s_resume_latency);
+    duer_histogram_log(&s_stutter);
+    duer_histogram_log(&s_track_gap);
+    free(s_cmd_head);
+    s_cmd_head = s_cmd_tail = NULL;
+    g_main_context_unref(s_ctx);
+    s_ctx = NULL;
+    pool_destroy();
+    duer_cache_destroy();
+    duer_tone_destroy();
+    duer_volume_destroy();
+    duer_mixer_destroy();
 }
 
-void duer_media_speak_play(const char *url)
+void duer_media_sync()
 {
-    if (MEDIA_SPEAK_PLAY != s_speak_state) {
-        duer_media_speak_stop();
-    }
+    cmd_submit(MEDIA_CMD_SYNC, NULL, 0, true);
+}
 
-    play_info_t *speak = create_play_info(url, speak_play);
-    if (speak) {
-        push_ready_play_info(&speak);
-        s_speak_state = MEDIA_SPEAK_PLAY;
-    } else {
-        DUER_LOGI("Speak info create failed!");
-    }
+void duer_media_speak_play(const char *url)
+{
+    cmd_submit(MEDIA_CMD_SPEAK_PLAY, url, 0, false);
 }
 
-void duer_media_tone_play(const char *path,int wait_tm) {
-	
-      GstElement *decoder =NULL;
-    GstElement *pipeline = gst_pipeline_new("audio-player");
-    GstElement *source = gst_element_factory_make("filesrc", "file-source");
-    if(strstr(path,".wav")!=NULL){
-        decoder = gst_element_factory_make("wavparse", "wav-parser");
-    }else{
-        decoder = gst_element_factory_make("mad", "mad-decoder");
-    }
-    GstElement *sink = gst_element_factory_make("autoaudiosink", "audio-output");
-    if (!(pipeline && source && decoder && sink)) {
-        DUER_LOGE("create alert element failed!");
-        return;
+void duer_media_tone_play(const char *path, int wait_tm)
+{
+    s_tone_state = MEDIA_TONE_PLAY;
+    if (duer_tone_play(path) != 0) {
+        DUER_LOGE("play tone %s failed!", path);
     }
-	s_tone_state = MEDIA_TONE_PLAY;
-    g_object_set(G_OBJECT(source), "location", path, NULL);
-
-    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
-    guint bus_watch_id = gst_bus_add_watch(bus, bus_call, s_loop);
-    gst_object_unref(bus);
-
-    gst_bin_add_many(GST_BIN(pipeline), source, decoder, sink, NULL);
-    gst_element_link_many(source, decoder, sink, NULL);
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    g_main_loop_run(s_loop);
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(GST_OBJECT(pipeline));
-    g_source_remove(bus_watch_id);
-	s_tone_state = MEDIA_TONE_STOP;
-	
+    s_tone_state = MEDIA_TONE_STOP;
 }
 
 void duer_media_speak_stop()
 {
-    if (MEDIA_SPEAK_PLAY == s_speak_state) {
-        s_speak_state = MEDIA_SPEAK_STOP;
-        g_main_loop_quit(s_loop);
-    } else {
-        DUER_LOGI("Speak stop state : %d", s_speak_state);
-    }
+    cmd_submit(MEDIA_CMD_SPEAK_STOP, NULL, 0, false);
 }
 
 void duer_media_audio_start(const char *url)
 {
-    if (MEDIA_AUDIO_STOP != s_audio_state) {
-        duer_media_audio_stop();
-    }
-
-    play_info_t *audio = create_play_info(url, audio_play);
-    if (audio) {
-        push_ready_play_info(&audio);
-        s_audio_state = MEDIA_AUDIO_PLAY;
-    } else {
-        DUER_LOGI("Audio info create failed!");
-    }
+    cmd_submit(MEDIA_CMD_AUDIO_START, url, 0, false);
 }
 
 void duer_media_audio_resume(const char *url, int offset)
 {
-    if (MEDIA_AUDIO_PAUSE == s_audio_state) {
-        if ((offset == s_seek) && (s_pinfo[2])) {
-            push_ready_play_info(&(s_pinfo[2]));
-            s_audio_state = MEDIA_AUDIO_PLAY;
-        } else {
-            duer_media_audio_start(url);
-        }
-    } else {
-        duer_media_audio_start(url);
-    }
+    cmd_submit(MEDIA_CMD_AUDIO_RESUME, url, offset, false);
 }
 
 void duer_media_audio_stop()
 {
-    if (MEDIA_AUDIO_PLAY == s_audio_state) {
-        s_audio_state = MEDIA_AUDIO_STOP;
-        g_main_loop_quit(s_loop);
-    } else if (MEDIA_AUDIO_PAUSE == s_audio_state) {
-        if (s_pinfo[2]) {
-            delete_play_info(&(s_pinfo[2]));
-        }
-        s_audio_state = MEDIA_AUDIO_STOP;
-    } else {
-        DUER_LOGI("Audio stop state : %d", s_audio_state);
-    }
+    cmd_submit(MEDIA_CMD_AUDIO_STOP, NULL, 0, false);
 }
 
 void duer_media_audio_pause()
 {
-    if (MEDIA_AUDIO_PLAY == s_audio_state) {
-        s_audio_state = MEDIA_AUDIO_PAUSE;
-        g_main_loop_quit(s_loop);
-    } else {
-        DUER_LOGI("Audio pause state : %d", s_audio_state);
-    }
+    cmd_submit(MEDIA_CMD_AUDIO_PAUSE, NULL, 0, false);
 }
 
 int duer_media_audio_get_position()
 {
-    gint64 pos = 0;
-    if (s_pinfo[0] && s_pinfo[0]->pip && MEDIA_AUDIO_PLAY == s_audio_state) {
-        if (gst_element_query_position(s_pinfo[0]->pip, GST_FORMAT_TIME, &pos)) {
-            s_seek = pos / GST_MSECOND;
-        }
-    }
+    int pos = cmd_submit(MEDIA_CMD_AUDIO_POSITION, NULL, 0, true);
 
-    return s_seek;
+    return pos < 0 ? s_seek : pos;
 }
 
 duer_audio_state_t duer_media_audio_state()
@@ -376,42 +1745,44 @@ duer_audio_state_t duer_media_audio_state()
     return s_audio_state;
 }
 
-void duer_media_volume_change(int volume)
+void duer_media_set_prebuffer(int prebuffer_ms, int mem_kb)
 {
-    if (s_mute) {
-        return;
+    if (prebuffer_ms > 0) {
+        s_prebuffer_ms = prebuffer_ms;
     }
-    s_vol += volume / 100.0;
-    if (s_vol < VOLUME_MIX) {
-        s_vol = 0.0;
-    } else if (s_vol > VOLUME_MAX){
-        s_vol = VOLUME_MAX;
-    } else {
-        // do nothing
+    if (mem_kb > 0) {
+        s_ready_mem_kb = mem_kb;
     }
+    DUER_LOGI("prebuffer %d ms, ready queue cap %d KB", s_prebuffer_ms, s_ready_mem_kb);
+}
 
-    if (s_pinfo[0] && s_pinfo[0]->pip) {
-        g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", s_vol, NULL);
-    }
-    DUER_LOGI("volume : %.1f", s_vol);
-    if (DUER_OK == duer_dcs_on_volume_changed()) {
-        DUER_LOGI("volume change OK");
+void duer_media_set_crossfade(int ms)
+{
+    s_crossfade_ms = ms < 0 ? 0 : (ms > MEDIA_CROSSFADE_MS_MAX ? MEDIA_CROSSFADE_MS_MAX : ms);
+    DUER_LOGI("crossfade %d ms", s_crossfade_ms);
+}
+
+bool duer_media_is_playing()
+{
+    return s_audible || MEDIA_TONE_PLAY == s_tone_state;
+}
+
+int duer_media_get_output_level()
+{
+    if (s_mute || !duer_media_is_playing()) {
+        return 0;
     }
+    return (int)(s_vol * 100);
+}
+
+void duer_media_volume_change(int volume)
+{
+    cmd_submit(MEDIA_CMD_VOLUME_CHANGE, NULL, volume, false);
 }
 
 void duer_media_set_volume(int volume)
 {
-    if (s_mute) {
-        return;
-    }
-    s_vol = volume / 100.0;
-    if (s_pinfo[0] && s_pinfo[0]->pip) {
-        g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", s_vol, NULL);
-    }
-    DUER_LOGI("volume : %.1f", s_vol);
-    if (DUER_OK == duer_dcs_on_volume_changed()) {
-        DUER_LOGI("volume change OK");
-    }
+    cmd_submit(MEDIA_CMD_VOLUME_SET, NULL, volume, false);
 }
 
 int duer_media_get_volume()
@@ -421,19 +1792,21 @@ int duer_media_get_volume()
 
 void duer_media_set_mute(bool mute)
 {
-    s_mute = mute;
-
-    if (s_pinfo[0] && s_pinfo[0]->pip) {
-        if (mute) {
-            g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", 0.0, NULL);
-        } else {
-            g_object_set(G_OBJECT(s_pinfo[0]->pip), "volume", s_vol, NULL);
-        }
-    }
-    duer_dcs_on_mute();
+    cmd_submit(MEDIA_CMD_MUTE, NULL, mute, false);
 }
 
 bool duer_media_get_mute()
 {
     return s_mute;
 }
+
+void duer_media_get_stats(duer_media_stats_t *stats)
+{
+    if (stats) {
+        stats->items = s_live_items;
+        stats->watches = s_live_watches;
+        stats->commands = s_cmd_latency.count;
+        stats->cmd_p50_us = duer_histogram_percentile(&s_cmd_latency, 50);
+        stats->cmd_p99_us = duer_histogram_percentile(&s_cmd_latency, 99);
+    }
+}
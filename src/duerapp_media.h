@@ -22,6 +22,8 @@
 #ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MEDIA_H
 #define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MEDIA_H
 
+#include <stdint.h>
+
 #include "duerapp_config.h"
 
 typedef enum{
@@ -41,9 +43,46 @@ typedef enum{
     MEDIA_AUDIO_STOP,
 }duer_audio_state_t;
 
+typedef enum{
+    MEDIA_EVENT_SPEECH_FINISHED,
+    MEDIA_EVENT_AUDIO_FINISHED,
+    MEDIA_EVENT_AUDIO_FAILED,
+    MEDIA_EVENT_AUDIO_STUTTER_START,
+    MEDIA_EVENT_AUDIO_STUTTER_END,
+    MEDIA_EVENT_AUDIO_METADATA,
+    MEDIA_EVENT_VOLUME_CHANGED,
+    MEDIA_EVENT_MUTE_CHANGED,
+    MEDIA_EVENT_NUM,
+}duer_media_event_t;
+
+/*
+ * Called on the media thread.
+ */
+typedef void (*duer_media_report_cb)(duer_media_event_t event);
+
+typedef struct{
+    int items;              // playing, paused and queued items alive
+    int watches;            // bus watches attached
+    uint32_t commands;      // commands executed
+    uint32_t cmd_p50_us;    // queueing + execution latency of a command
+    uint32_t cmd_p99_us;
+}duer_media_stats_t;
+
 void duer_media_init();
 void duer_media_destroy();
 
+/*
+ * Hand the events below to report instead of DCS, for a run without the
+ * cloud connection. NULL goes back to DCS. Call before duer_media_init().
+ */
+void duer_media_set_report(duer_media_report_cb report);
+
+/*
+ * Media calls below only queue a command for the media thread and return.
+ * This one waits until everything queued before it has been executed.
+ */
+void duer_media_sync();
+
 void duer_media_speak_play(const char *url);
 void duer_media_speak_stop();
 
@@ -54,6 +93,29 @@ void duer_media_audio_pause();
 int duer_media_audio_get_position();
 duer_audio_state_t duer_media_audio_state();
 
+/*
+ * Amount of audio each queued item buffers ahead, and the memory all queued
+ * items may use together. Values <= 0 keep the current setting.
+ */
+void duer_media_set_prebuffer(int prebuffer_ms, int mem_kb);
+
+/*
+ * Blend the last ms of a content track into the next one, 0 (default) plays
+ * them back to back. Needs a known duration; live streams stay gapless.
+ */
+void duer_media_set_crossfade(int ms);
+
+/*
+ * True while speech, audio or a tone is audible: not once a track ended on
+ * its own, was paused or stopped, and its tail left the mixer.
+ */
+bool duer_media_is_playing();
+
+/*
+ * Effective output level 0..100, 0 when muted or idle.
+ */
+int duer_media_get_output_level();
+
 void duer_media_volume_change(int volume);
 void duer_media_set_volume(int volume);
 int duer_media_get_volume();
@@ -62,5 +124,10 @@ bool duer_media_get_mute();
 
 void duer_media_tone_play(const char *url,int wait_tm);
 
+/*
+ * Snapshot for diagnostics, read without locking.
+ */
+void duer_media_get_stats(duer_media_stats_t *stats);
+
 
 #endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MEDIA_H
@@ -0,0 +1,763 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_mixer.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Single output stage. Every source (playbin, alert bell, tones) writes
+ *       into a per-stream ring; one thread mixes a period at a time with
+ *       saturating Q15 kernels and is the only writer of the ALSA PCM.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+#include <gst/app/gstappsink.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "duerapp_mixer.h"
+#include "duerapp_histogram.h"
+
+#define MIXER_RING_FRAMES_MAX (MIXER_RATE / 1000 * MIXER_RING_MS_MAX)
+#define MIXER_DUCK_RAMP_MS  (120)   // full swing between unity and duck level
+#define MIXER_DUCK_HOLD_MS  (300)   // keep ducking across gaps between bell rings
+#define MIXER_IDLE_MS       (200)   // silence written before the device is stopped
+#define MIXER_GAIN_UNITY    (32767)
+#define MIXER_SINK_STREAM   "mixer-stream"
+
+typedef struct{
+    int16_t buf[MIXER_RING_FRAMES_MAX * MIXER_CHANNELS];
+    size_t frames;      // ring size, from the stream's ring_ms
+    size_t head;        // first queued frame
+    size_t level;       // queued frames
+    int16_t gain;       // Q15
+    bool active;
+    gint64 last_data;   // when the mixer last took audio from it
+    uint64_t written;   // frames ever queued
+    uint64_t taken;     // frames ever taken by the mixer
+    // duer_mixer_drain_async(): fires once taken reaches drain_mark and the
+    // device played it out at drain_at
+    duer_mixer_drained_cb drain_cb;
+    void *drain_param;
+    uint64_t drain_mark;
+    gint64 drain_at;
+    // duer_mixer_mark(): the frame to time, and when it was heard
+    bool mark_pending;      // not taken yet
+    bool mark_taken;        // taken, not written to the device yet
+    uint64_t mark;
+    gint64 mark_heard;
+}mixer_stream_t;
+
+typedef struct{
+    duer_mixer_stream_t from;
+    duer_mixer_stream_t to;
+    size_t frames;      // fade length, 0 when not fading
+    size_t done;
+}mixer_fade_t;
+
+static mixer_stream_t s_streams[MIXER_STREAM_NUM];
+static snd_pcm_t *s_pcm = NULL;
+// null output for headless runs: 0 off, 1 real time, 2 unthrottled
+static int s_null = 0;
+static gint64 s_null_clock = 0; // when the last period written would be heard
+static pthread_t s_mixer_tid;
+static pthread_mutex_t s_mixer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_space_cond = PTHREAD_COND_INITIALIZER;
+static volatile bool s_running = false;
+static int16_t s_duck = MIXER_GAIN_UNITY;
+static int16_t s_master = MIXER_GAIN_UNITY;   // software volume, all streams
+static bool s_mute = false;
+static mixer_fade_t s_fade;
+static duer_mixer_stats_t s_stats;
+static const char *s_device = MIXER_DEVICE_DEFAULT;
+static snd_pcm_uframes_t s_period = MIXER_PERIOD_FRAMES;
+static int s_ring_ms[MIXER_STREAM_NUM] = {
+    MIXER_RING_MS_CONTENT, MIXER_RING_MS_CONTENT, MIXER_RING_MS_DIALOG, MIXER_RING_MS_ALERT,
+    MIXER_RING_MS_TONE
+};
+// owned by the mixer thread, read after it stopped
+static duer_histogram_t s_latency[MIXER_STREAM_NUM];
+
+static inline int16_t sat16(int32_t v)
+{
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+/*
+ * dst = sat(dst + src * gain), gain in Q15. NEON rounds the product, the
+ * other two truncate; the difference is below one LSB.
+ */
+static void mix_s16(int16_t *dst, const int16_t *src, int16_t gain, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t s = vqrdmulhq_n_s16(vld1q_s16(src + i), gain);
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), s));
+    }
+#elif defined(__SSE2__)
+    __m128i g = _mm_set1_epi16(gain);
+    for (; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_mullo_epi16(s, g);
+        __m128i hi = _mm_mulhi_epi16(s, g);
+        __m128i p = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15),
+                                    _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(d, p));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = sat16(dst[i] + ((src[i] * gain) >> 15));
+    }
+}
+
+static int16_t gain_q15(double gain)
+{
+    if (gain <= 0.0) {
+        return 0;
+    }
+    return gain >= 1.0 ? MIXER_GAIN_UNITY : (int16_t)(gain * MIXER_GAIN_UNITY);
+}
+
+static int mixer_open(const char *device)
+{
+    snd_pcm_hw_params_t *hw = NULL;
+    snd_pcm_sw_params_t *sw = NULL;
+    snd_pcm_uframes_t period = s_period;
+    snd_pcm_uframes_t buffer = s_period * MIXER_PERIODS;
+    unsigned int rate = MIXER_RATE;
+    int ret = 0;
+
+    if (strncmp(device, MIXER_DEVICE_NULL, strlen(MIXER_DEVICE_NULL)) == 0) {
+        s_null = strcmp(device, MIXER_DEVICE_NULL_FAST) == 0 ? 2 : 1;
+        s_stats.period_frames = s_period;
+        DUER_LOGI("mixer device %s: no sound card, period %lu", device, (unsigned long)s_period);
+        return 0;
+    }
+    ret = snd_pcm_open(&s_pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (ret < 0) {
+        DUER_LOGE("open mixer device %s: %s", device, snd_strerror(ret));
+        s_pcm = NULL;
+        return ret;
+    }
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(s_pcm, hw);
+    snd_pcm_hw_params_set_access(s_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(s_pcm, hw, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(s_pcm, hw, MIXER_CHANNELS);
+    snd_pcm_hw_params_set_rate_near(s_pcm, hw, &rate, NULL);
+    snd_pcm_hw_params_set_period_size_near(s_pcm, hw, &period, NULL);
+    snd_pcm_hw_params_set_buffer_size_near(s_pcm, hw, &buffer);
+    ret = snd_pcm_hw_params(s_pcm, hw);
+    if (ret < 0) {
+        DUER_LOGE("mixer hw params: %s", snd_strerror(ret));
+        snd_pcm_close(s_pcm);
+        s_pcm = NULL;
+        return ret;
+    }
+    // the driver may round the period, the mix loop follows what it got
+    snd_pcm_hw_params_get_period_size(hw, &period, NULL);
+    if (period > MIXER_PERIOD_FRAMES_MAX) {
+        period = MIXER_PERIOD_FRAMES_MAX;
+    }
+    s_period = period;
+    s_stats.period_frames = period;
+
+    // start as soon as one period is queued instead of when the buffer is full
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(s_pcm, sw);
+    snd_pcm_sw_params_set_start_threshold(s_pcm, sw, period);
+    snd_pcm_sw_params_set_avail_min(s_pcm, sw, period);
+    snd_pcm_sw_params(s_pcm, sw);
+
+    snd_pcm_prepare(s_pcm);
+    DUER_LOGI("mixer device %s: %u Hz, period %lu, buffer %lu",
+              device, rate, period, buffer);
+
+    return 0;
+}
+
+static bool mixer_has_data()
+{
+    for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+        // a pending drain keeps the loop, and its clock, running
+        if (s_streams[i].level || s_streams[i].drain_cb) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Stands in for the device: a real-time null output sleeps so that at most
+ * MIXER_PERIODS periods are "in the device", like a blocking snd_pcm_writei().
+ */
+static void mixer_null_write()
+{
+    const gint64 period_us = s_period * 1000000LL / MIXER_RATE;
+    gint64 now = g_get_monotonic_time();
+
+    s_stats.periods++;
+    if (2 == s_null) {
+        return;
+    }
+    if (s_null_clock < now) {
+        if (s_null_clock) {
+            s_stats.underruns++;
+        }
+        s_null_clock = now;
+    }
+    s_null_clock += period_us;
+    if (s_null_clock - now > period_us * MIXER_PERIODS) {
+        usleep(s_null_clock - now - period_us * MIXER_PERIODS);
+        now = g_get_monotonic_time();
+    }
+    // a late wakeup can leave the clock behind, nothing is queued then
+    s_stats.output_delay_us = s_null_clock > now ? (uint32_t)(s_null_clock - now) : 0;
+}
+
+static void mixer_output(const int16_t *out)
+{
+    if (s_null) {
+        mixer_null_write();
+        return;
+    }
+    // blocks once the device buffer is full, which paces the loop
+    snd_pcm_sframes_t ret = snd_pcm_writei(s_pcm, out, s_period);
+    if (ret < 0) {
+        s_stats.underruns++;
+        snd_pcm_recover(s_pcm, ret, 1);
+    } else {
+        snd_pcm_sframes_t delay = 0;
+        if (snd_pcm_delay(s_pcm, &delay) == 0 && delay > 0) {
+            s_stats.output_delay_us = (uint32_t)(delay * 1000000LL / MIXER_RATE);
+        }
+        s_stats.periods++;
+    }
+}
+
+/*
+ * Move towards the duck level while alert audio was heard recently, back to
+ * unity otherwise, one step per period. Dialog does not duck: the media
+ * thread plays one item at a time, so speech never overlaps content.
+ */
+static void mixer_update_duck(gint64 now)
+{
+    const int step = MIXER_GAIN_UNITY * (int64_t)s_period * 1000LL
+                     / MIXER_RATE / MIXER_DUCK_RAMP_MS;
+    int16_t target = MIXER_GAIN_UNITY;
+
+    if (now - s_streams[MIXER_STREAM_ALERT].last_data < MIXER_DUCK_HOLD_MS * 1000LL) {
+        target = gain_q15(MIXER_DUCK_GAIN);
+    }
+    if (s_duck > target) {
+        s_duck = s_duck - step > target ? s_duck - step : target;
+    } else if (s_duck < target) {
+        s_duck = s_duck + step < target ? s_duck + step : target;
+    }
+}
+
+/*
+ * Scale both sides of a running crossfade for this period. One cos and one
+ * sin per period; the curve is stepped per period, 4 ms by default.
+ */
+static void mixer_update_fade(int16_t *gain)
+{
+    double t = (double)s_fade.done / s_fade.frames;
+
+    if (t > 1.0) {
+        t = 1.0;
+    }
+    gain[s_fade.from] = (gain[s_fade.from] * gain_q15(cos(t * M_PI_2))) >> 15;
+    gain[s_fade.to] = (gain[s_fade.to] * gain_q15(sin(t * M_PI_2))) >> 15;
+    if (s_fade.done < s_fade.frames) {
+        s_fade.done += s_period;
+    }
+}
+
+static void mixer_thread()
+{
+    static int16_t tmp[MIXER_STREAM_NUM][MIXER_PERIOD_FRAMES_MAX * MIXER_CHANNELS];
+    static int16_t out[MIXER_PERIOD_FRAMES_MAX * MIXER_CHANNELS];
+    size_t taken[MIXER_STREAM_NUM];
+    size_t queued[MIXER_STREAM_NUM];
+    int16_t gain[MIXER_STREAM_NUM];
+    duer_mixer_drained_cb drained[MIXER_STREAM_NUM];
+    void *drained_param[MIXER_STREAM_NUM];
+    int marked[MIXER_STREAM_NUM];   // offset of the marked frame in this period, -1: none
+    gint64 idle_since = 0;
+
+    while (s_running) {
+        pthread_mutex_lock(&s_mixer_lock);
+        if (!mixer_has_data() && idle_since
+                && g_get_monotonic_time() - idle_since > MIXER_IDLE_MS * 1000LL) {
+            // nothing to play for a while: stop the device and sleep
+            if (s_pcm) {
+                snd_pcm_drop(s_pcm);
+                snd_pcm_prepare(s_pcm);
+            }
+            while (s_running && !mixer_has_data()) {
+                pthread_cond_wait(&s_data_cond, &s_mixer_lock);
+            }
+            idle_since = 0;
+            s_null_clock = 0;
+        }
+
+        gint64 now = g_get_monotonic_time();
+        for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+            mixer_stream_t *st = &s_streams[i];
+            size_t n = st->level < s_period ? st->level : s_period;
+            size_t first = st->frames - st->head < n ? st->frames - st->head : n;
+
+            memcpy(tmp[i], st->buf + st->head * MIXER_CHANNELS,
+                   first * MIXER_CHANNELS * sizeof(int16_t));
+            memcpy(tmp[i] + first * MIXER_CHANNELS, st->buf,
+                   (n - first) * MIXER_CHANNELS * sizeof(int16_t));
+            st->head = (st->head + n) % st->frames;
+            queued[i] = st->level;
+            st->level -= n;
+            st->taken += n;
+            if (n) {
+                st->last_data = now;
+            }
+            taken[i] = n;
+            gain[i] = st->gain;
+
+            marked[i] = -1;
+            if (st->mark_pending && st->mark < st->taken) {
+                marked[i] = (int)(st->mark + n - st->taken);
+                st->mark_pending = false;
+                st->mark_taken = true;
+            }
+            drained[i] = NULL;
+            if (st->drain_cb && !st->drain_at && st->taken >= st->drain_mark) {
+                // the last frame goes out with this period, behind the device buffer
+                st->drain_at = now + s_stats.output_delay_us
+                               + (gint64)s_period * 1000000LL / MIXER_RATE;
+            }
+            if (st->drain_cb && st->drain_at && now >= st->drain_at) {
+                drained[i] = st->drain_cb;
+                drained_param[i] = st->drain_param;
+                st->drain_cb = NULL;
+            }
+        }
+        mixer_update_duck(now);
+        gain[MIXER_STREAM_CONTENT] = (gain[MIXER_STREAM_CONTENT] * s_duck) >> 15;
+        gain[MIXER_STREAM_CONTENT_B] = (gain[MIXER_STREAM_CONTENT_B] * s_duck) >> 15;
+        bool fading = s_fade.frames != 0;
+        if (fading) {
+            mixer_update_fade(gain);
+        }
+        // folded into the per-stream gains, so volume costs no extra pass
+        for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+            gain[i] = s_mute ? 0 : (gain[i] * s_master) >> 15;
+        }
+        pthread_cond_broadcast(&s_space_cond);
+        pthread_mutex_unlock(&s_mixer_lock);
+
+        for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+            if (drained[i]) {
+                drained[i]((duer_mixer_stream_t)i, drained_param[i]);
+            }
+        }
+        memset(out, 0, s_period * MIXER_CHANNELS * sizeof(int16_t));
+        bool any = false;
+        for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+            if (taken[i]) {
+                mix_s16(out, tmp[i], gain[i], taken[i] * MIXER_CHANNELS);
+                any = true;
+                // a frame written now waits behind the queue and the device buffer
+                duer_histogram_add(&s_latency[i], (uint32_t)(queued[i] * 1000000LL / MIXER_RATE)
+                                   + s_stats.output_delay_us);
+            }
+        }
+        gint64 mix_us = g_get_monotonic_time() - now;
+        s_stats.mix_us += mix_us;
+        if (fading) {
+            s_stats.fade_us += mix_us;
+            s_stats.fade_periods++;
+        }
+        if (!any && !idle_since) {
+            idle_since = now;
+        } else if (any) {
+            idle_since = 0;
+        }
+
+        mixer_output(out);
+
+        // the delay read right after the write ends with this period's last
+        // frame, the marked one is heard that much earlier
+        for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+            if (marked[i] >= 0) {
+                gint64 heard = g_get_monotonic_time() + s_stats.output_delay_us
+                               - (gint64)(s_period - marked[i]) * 1000000LL / MIXER_RATE;
+                pthread_mutex_lock(&s_mixer_lock);
+                if (s_streams[i].mark_taken) {
+                    s_streams[i].mark_taken = false;
+                    s_streams[i].mark_heard = heard;
+                }
+                pthread_cond_broadcast(&s_space_cond);
+                pthread_mutex_unlock(&s_mixer_lock);
+            }
+        }
+    }
+}
+
+void duer_mixer_set_device(const char *device)
+{
+    if (device && device[0]) {
+        s_device = device;
+    }
+}
+
+void duer_mixer_set_period(int frames)
+{
+    if (frames < MIXER_PERIOD_FRAMES_MIN) {
+        frames = MIXER_PERIOD_FRAMES_MIN;
+    } else if (frames > MIXER_PERIOD_FRAMES_MAX) {
+        frames = MIXER_PERIOD_FRAMES_MAX;
+    }
+    s_period = frames;
+}
+
+void duer_mixer_set_ring_ms(duer_mixer_stream_t stream, int ms)
+{
+    if (ms <= 0) {
+        return;
+    }
+    s_ring_ms[stream] = ms < MIXER_RING_MS_MAX ? ms : MIXER_RING_MS_MAX;
+}
+
+int duer_mixer_get_period(void)
+{
+    return (int)s_period;
+}
+
+int duer_mixer_get_ring_ms(duer_mixer_stream_t stream)
+{
+    return s_ring_ms[stream];
+}
+
+int duer_mixer_init(void)
+{
+    static const char *names[MIXER_STREAM_NUM] = {
+        "content output", "content b output", "dialog output", "alert output", "tone output"
+    };
+    int ret = 0;
+
+    ret = mixer_open(s_device);
+    if (ret < 0) {
+        return ret;
+    }
+    for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+        int ms = s_ring_ms[i] < MIXER_RING_MS_MAX ? s_ring_ms[i] : MIXER_RING_MS_MAX;
+        s_streams[i].gain = MIXER_GAIN_UNITY;
+        s_streams[i].frames = MIXER_RATE / 1000 * ms;
+        // the mixer takes a period at a time, the ring must hold at least one
+        if (s_streams[i].frames < s_period) {
+            s_streams[i].frames = s_period;
+        }
+        duer_histogram_init(&s_latency[i], names[i], "us");
+        DUER_LOGI("mixer %s: ring %u ms", names[i],
+                  (unsigned int)(s_streams[i].frames * 1000 / MIXER_RATE));
+    }
+
+    s_running = true;
+    ret = pthread_create(&s_mixer_tid, NULL, (void *)mixer_thread, NULL);
+    if (ret) {
+        DUER_LOGE("Create mixer pthread error!");
+        s_running = false;
+        if (s_pcm) {
+            snd_pcm_close(s_pcm);
+            s_pcm = NULL;
+        }
+        return -1;
+    }
+    pthread_setname_np(s_mixer_tid, "dcs3_demo_mixer");
+
+    return 0;
+}
+
+void duer_mixer_destroy(void)
+{
+    if (!s_running) {
+        return;
+    }
+    pthread_mutex_lock(&s_mixer_lock);
+    s_running = false;
+    for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+        s_streams[i].active = false;
+        s_streams[i].level = 0;
+        s_streams[i].drain_cb = NULL;
+        s_streams[i].mark_pending = false;
+        s_streams[i].mark_taken = false;
+    }
+    pthread_cond_broadcast(&s_data_cond);
+    pthread_cond_broadcast(&s_space_cond);
+    pthread_mutex_unlock(&s_mixer_lock);
+
+    pthread_join(s_mixer_tid, NULL);
+    if (s_pcm) {
+        snd_pcm_close(s_pcm);
+        s_pcm = NULL;
+    }
+    DUER_LOGI("mixer: %u periods, %u underruns, avg mix %u us, %u us over %u crossfade periods",
+              s_stats.periods, s_stats.underruns,
+              s_stats.periods ? (uint32_t)(s_stats.mix_us / s_stats.periods) : 0,
+              s_stats.fade_periods ? (uint32_t)(s_stats.fade_us / s_stats.fade_periods) : 0,
+              s_stats.fade_periods);
+    duer_mixer_log_latency();
+}
+
+void duer_mixer_log_latency(void)
+{
+    DUER_LOGI("mixer output: device %s, period %lu frames x %d",
+              s_device, (unsigned long)s_period, MIXER_PERIODS);
+    for (int i = 0; i < MIXER_STREAM_NUM; i++) {
+        duer_histogram_log(&s_latency[i]);
+    }
+}
+
+size_t duer_mixer_write(duer_mixer_stream_t stream, const int16_t *pcm,
+                        size_t frames, int channels)
+{
+    mixer_stream_t *st = &s_streams[stream];
+    size_t done = 0;
+
+    pthread_mutex_lock(&s_mixer_lock);
+    while (done < frames && st->active && s_running) {
+        if (st->level == st->frames) {
+            pthread_cond_wait(&s_space_cond, &s_mixer_lock);
+            continue;
+        }
+        size_t tail = (st->head + st->level) % st->frames;
+        size_t n = st->frames - st->level;
+        if (n > st->frames - tail) {
+            n = st->frames - tail;
+        }
+        if (n > frames - done) {
+            n = frames - done;
+        }
+        int16_t *dst = st->buf + tail * MIXER_CHANNELS;
+        const int16_t *src = pcm + done * channels;
+        if (MIXER_CHANNELS == channels) {
+            memcpy(dst, src, n * MIXER_CHANNELS * sizeof(int16_t));
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                dst[2 * i] = dst[2 * i + 1] = src[i];
+            }
+        }
+        st->level += n;
+        st->written += n;
+        done += n;
+        pthread_cond_signal(&s_data_cond);
+    }
+    pthread_mutex_unlock(&s_mixer_lock);
+
+    return done;
+}
+
+void duer_mixer_set_active(duer_mixer_stream_t stream, bool active)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_streams[stream].active = active;
+    if (!active) {
+        s_streams[stream].taken += s_streams[stream].level;
+        s_streams[stream].level = 0;
+        s_streams[stream].drain_cb = NULL;
+        s_streams[stream].mark_pending = false;
+        s_streams[stream].mark_taken = false;
+        if (s_fade.frames && (stream == s_fade.from || stream == s_fade.to)) {
+            s_fade.frames = 0;
+        }
+        pthread_cond_broadcast(&s_space_cond);
+    }
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+void duer_mixer_drain(duer_mixer_stream_t stream)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    while (s_streams[stream].level && s_streams[stream].active && s_running) {
+        pthread_cond_wait(&s_space_cond, &s_mixer_lock);
+    }
+    pthread_mutex_unlock(&s_mixer_lock);
+    // the last period taken is still in the device buffer
+    usleep(s_stats.output_delay_us);
+}
+
+void duer_mixer_drain_async(duer_mixer_stream_t stream, duer_mixer_drained_cb cb, void *param)
+{
+    mixer_stream_t *st = &s_streams[stream];
+
+    pthread_mutex_lock(&s_mixer_lock);
+    st->drain_cb = s_running ? cb : NULL;
+    st->drain_param = param;
+    st->drain_mark = st->written;
+    st->drain_at = 0;
+    // wake an idle mixer, the callback needs its clock
+    pthread_cond_signal(&s_data_cond);
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+void duer_mixer_mark(duer_mixer_stream_t stream)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_streams[stream].mark = s_streams[stream].written;
+    s_streams[stream].mark_pending = true;
+    s_streams[stream].mark_taken = false;
+    s_streams[stream].mark_heard = 0;
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+gint64 duer_mixer_mark_heard(duer_mixer_stream_t stream)
+{
+    mixer_stream_t *st = &s_streams[stream];
+    gint64 heard = 0;
+
+    pthread_mutex_lock(&s_mixer_lock);
+    while (st->active && s_running
+            && (st->mark_taken || (st->mark_pending && st->written > st->mark))) {
+        pthread_cond_wait(&s_space_cond, &s_mixer_lock);
+    }
+    heard = st->mark_heard;
+    pthread_mutex_unlock(&s_mixer_lock);
+
+    return heard;
+}
+
+void duer_mixer_set_gain(duer_mixer_stream_t stream, double gain)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_streams[stream].gain = gain_q15(gain);
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+void duer_mixer_crossfade(duer_mixer_stream_t from, duer_mixer_stream_t to, int ms)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_fade.from = from;
+    s_fade.to = to;
+    s_fade.done = 0;
+    s_fade.frames = ms > 0 ? MIXER_RATE / 1000 * (size_t)ms : 0;
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+uint32_t duer_mixer_queued_ms(duer_mixer_stream_t stream)
+{
+    uint32_t ms = 0;
+
+    pthread_mutex_lock(&s_mixer_lock);
+    ms = (uint32_t)(s_streams[stream].level * 1000 / MIXER_RATE);
+    pthread_mutex_unlock(&s_mixer_lock);
+
+    return ms;
+}
+
+void duer_mixer_set_master(double gain)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_master = gain_q15(gain);
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+void duer_mixer_set_mute(bool mute)
+{
+    pthread_mutex_lock(&s_mixer_lock);
+    s_mute = mute;
+    pthread_mutex_unlock(&s_mixer_lock);
+}
+
+uint32_t duer_mixer_output_delay_us(void)
+{
+    return s_stats.output_delay_us;
+}
+
+void duer_mixer_get_stats(duer_mixer_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_mixer_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_mixer_lock);
+    }
+}
+
+static GstFlowReturn on_new_sample(GstElement *sink, gpointer data)
+{
+    GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+    GstMapInfo map;
+
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (buffer && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        // looked up per buffer, the stream changes between tracks
+        duer_mixer_stream_t stream = (duer_mixer_stream_t)GPOINTER_TO_INT(
+                g_object_get_data(G_OBJECT(sink), MIXER_SINK_STREAM));
+        duer_mixer_write(stream, (const int16_t *)map.data,
+                         map.size / (MIXER_CHANNELS * sizeof(int16_t)), MIXER_CHANNELS);
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+
+    return GST_FLOW_OK;
+}
+
+GstElement *duer_mixer_make_sink(duer_mixer_stream_t stream)
+{
+    char desc[256];
+    GError *error = NULL;
+
+    // the ring blocks the streaming thread, so the mixer paces the pipeline
+    snprintf(desc, sizeof(desc), "audioconvert ! audioresample"
+             " ! audio/x-raw,format=S16LE,layout=interleaved,rate=%d,channels=%d"
+             " ! appsink name=mixsink sync=false emit-signals=true",
+             MIXER_RATE, MIXER_CHANNELS);
+    GstElement *bin = gst_parse_bin_from_description(desc, TRUE, &error);
+    if (!bin) {
+        DUER_LOGE("mixer sink: %s", error ? error->message : "unknown");
+        if (error) {
+            g_error_free(error);
+        }
+        return NULL;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(bin), "mixsink");
+    g_object_set_data(G_OBJECT(sink), MIXER_SINK_STREAM, GINT_TO_POINTER(stream));
+    g_signal_connect(sink, "new-sample", G_CALLBACK(on_new_sample), NULL);
+    gst_object_unref(sink);
+
+    return bin;
+}
+
+void duer_mixer_sink_set_stream(GstElement *bin, duer_mixer_stream_t stream)
+{
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(bin), "mixsink");
+
+    if (sink) {
+        g_object_set_data(G_OBJECT(sink), MIXER_SINK_STREAM, GINT_TO_POINTER(stream));
+        gst_object_unref(sink);
+    }
+}
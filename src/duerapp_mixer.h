@@ -0,0 +1,165 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_mixer.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Software mixer owning the playback device.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_H
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+#include "duerapp_config.h"
+
+#define MIXER_DEVICE_DEFAULT "default"
+#define MIXER_DEVICE_NULL    "null"      // no sound card, paced in real time
+#define MIXER_DEVICE_NULL_FAST "null:fast" // no sound card, as fast as it mixes
+#define MIXER_RATE           (48000)
+#define MIXER_CHANNELS       (2)
+#define MIXER_PERIOD_FRAMES  (192)  // 4 ms
+#define MIXER_PERIOD_FRAMES_MIN (48)
+#define MIXER_PERIOD_FRAMES_MAX (1024)
+#define MIXER_PERIODS        (4)
+#define MIXER_RING_MS_MAX    (500)
+// audio a stream may queue ahead of the mix: short for prompts, deep for music
+#define MIXER_RING_MS_CONTENT (300)
+#define MIXER_RING_MS_DIALOG  (40)
+#define MIXER_RING_MS_ALERT   (100)
+#define MIXER_RING_MS_TONE    (20)
+#define MIXER_DUCK_GAIN      (0.25) // content level while the alert plays
+
+typedef enum{
+    MIXER_STREAM_CONTENT,   // music, ducked by the alert
+    MIXER_STREAM_CONTENT_B, // the other track of a crossfade, ducked the same
+    MIXER_STREAM_DIALOG,    // speech
+    MIXER_STREAM_ALERT,     // alert bell
+    MIXER_STREAM_TONE,      // prompt tones
+    MIXER_STREAM_NUM,
+}duer_mixer_stream_t;
+
+/*
+ * Called on the mixer thread, without the mixer lock held. Hand the work to
+ * your own thread instead of blocking the mix.
+ */
+typedef void (*duer_mixer_drained_cb)(duer_mixer_stream_t stream, void *param);
+
+typedef struct{
+    uint32_t period_frames;
+    uint32_t periods;       // periods written to the device
+    uint32_t underruns;
+    uint64_t mix_us;        // time spent mixing, without device writes
+    uint32_t fade_periods;  // periods mixed while crossfading
+    uint64_t fade_us;
+    uint32_t output_delay_us;
+}duer_mixer_stats_t;
+
+/*
+ * Output configuration, applied by duer_mixer_init(). A smaller period lowers
+ * the device latency at the cost of more wakeups; ring_ms bounds how far a
+ * stream can run ahead of what is heard.
+ */
+void duer_mixer_set_device(const char *device);
+void duer_mixer_set_period(int frames);
+void duer_mixer_set_ring_ms(duer_mixer_stream_t stream, int ms);
+int duer_mixer_get_period(void);
+int duer_mixer_get_ring_ms(duer_mixer_stream_t stream);
+
+/*
+ * Open the device and start the mixer thread.
+ */
+int duer_mixer_init(void);
+void duer_mixer_destroy(void);
+
+/*
+ * Queue S16 PCM at MIXER_RATE, mono or stereo. Blocks while the stream's
+ * ring is full; returns early with a short count once the stream is
+ * deactivated.
+ */
+size_t duer_mixer_write(duer_mixer_stream_t stream, const int16_t *pcm,
+                        size_t frames, int channels);
+
+/*
+ * An inactive stream drops what it holds and what is written to it. Deactivate
+ * before stopping a pipeline that writes to the stream, so its streaming
+ * thread cannot stay blocked in duer_mixer_write().
+ */
+void duer_mixer_set_active(duer_mixer_stream_t stream, bool active);
+
+/*
+ * Wait until everything queued on the stream has been played out.
+ */
+void duer_mixer_drain(duer_mixer_stream_t stream);
+
+/*
+ * Same without blocking: cb fires once what is queued now has been played
+ * out, whatever is written after. Replaces a pending one; deactivating the
+ * stream drops it.
+ */
+void duer_mixer_drain_async(duer_mixer_stream_t stream, duer_mixer_drained_cb cb, void *param);
+
+/*
+ * Time the next frame written to the stream: duer_mixer_mark_heard() waits
+ * until the mixer wrote it to the device and returns when it is heard, in
+ * g_get_monotonic_time() us, from the device delay read right after that
+ * write. 0 when nothing was written after the mark or the stream was
+ * deactivated first.
+ */
+void duer_mixer_mark(duer_mixer_stream_t stream);
+gint64 duer_mixer_mark_heard(duer_mixer_stream_t stream);
+
+void duer_mixer_set_gain(duer_mixer_stream_t stream, double gain);
+
+/*
+ * Equal-power crossfade over ms: from goes down along cos, to comes up along
+ * sin, so the summed power stays level. Starts with the next period and ends
+ * when either stream is deactivated; from stays silent once the fade is done.
+ */
+void duer_mixer_crossfade(duer_mixer_stream_t from, duer_mixer_stream_t to, int ms);
+
+/*
+ * Audio queued on the stream and not yet taken by the mixer, in ms.
+ */
+uint32_t duer_mixer_queued_ms(duer_mixer_stream_t stream);
+
+/*
+ * Output stage gain and mute, applied to every stream from the next period.
+ */
+void duer_mixer_set_master(double gain);
+void duer_mixer_set_mute(bool mute);
+uint32_t duer_mixer_output_delay_us(void);
+void duer_mixer_get_stats(duer_mixer_stats_t *stats);
+
+/*
+ * Log the measured output latency of every stream: what was queued ahead of
+ * a period when the mixer took it, plus the device delay.
+ */
+void duer_mixer_log_latency(void);
+
+/*
+ * Audio sink for playbin and other pipelines, feeding the given stream.
+ */
+GstElement *duer_mixer_make_sink(duer_mixer_stream_t stream);
+
+/*
+ * Point a sink made above at another stream. Only while its pipeline is not
+ * PLAYING, a buffer in flight may still go to the old one.
+ */
+void duer_mixer_sink_set_stream(GstElement *bin, duer_mixer_stream_t stream);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_H
@@ -0,0 +1,168 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_mixer_bench.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: The calling thread plays the writer of each stream, the mixer runs
+ *       as in the app. A frame counts as heard when duer_mixer_mark_heard()
+ *       says so, from the device delay read after its period was written,
+ *       so the run measures the ring, the mix loop and the device buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "duerapp_mixer_bench.h"
+#include "duerapp_mixer.h"
+
+// longer than MIXER_IDLE_MS, so the device is stopped when a cold frame comes
+#define BENCH_IDLE_US   (300000)
+
+typedef struct{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+}bench_latency_t;
+
+static const int s_periods[] = {48, 96, 192, 384, 1024};
+static const duer_mixer_stream_t s_streams[] = {
+    MIXER_STREAM_CONTENT, MIXER_STREAM_DIALOG, MIXER_STREAM_ALERT, MIXER_STREAM_TONE
+};
+static const char *s_names[] = {"content", "dialog", "alert", "tone"};
+static int16_t s_pcm[MIXER_PERIOD_FRAMES_MAX * MIXER_CHANNELS];
+
+static void bench_add(bench_latency_t *lat, gint64 us)
+{
+    uint32_t value = us > 0 ? (uint32_t)us : 0;
+
+    if (!lat->count || value < lat->min) {
+        lat->min = value;
+    }
+    if (value > lat->max) {
+        lat->max = value;
+    }
+    lat->sum += value;
+    lat->count++;
+}
+
+/*
+ * Write one period behind a mark and return how long after the write the
+ * marked frame is heard, -1 when it never is.
+ */
+static gint64 bench_marked_write(duer_mixer_stream_t stream, size_t frames)
+{
+    duer_mixer_mark(stream);
+    if (duer_mixer_write(stream, s_pcm, frames, MIXER_CHANNELS) != frames) {
+        return -1;
+    }
+    gint64 written = g_get_monotonic_time();
+    gint64 heard = duer_mixer_mark_heard(stream);
+
+    return heard ? heard - written : -1;
+}
+
+static int bench_stream(int index, int rounds)
+{
+    duer_mixer_stream_t stream = s_streams[index];
+    duer_mixer_stats_t stats;
+    bench_latency_t cold = {0};
+    bench_latency_t busy = {0};
+
+    duer_mixer_get_stats(&stats);
+    size_t period = stats.period_frames;
+    // enough to keep the ring full until the marked period goes in
+    size_t fill = (size_t)MIXER_RATE * duer_mixer_get_ring_ms(stream) / 1000 / period + 2;
+
+    duer_mixer_set_active(stream, true);
+    for (int i = 0; i < rounds; i++) {
+        usleep(BENCH_IDLE_US);
+        gint64 us = bench_marked_write(stream, period);
+        if (us < 0) {
+            break;
+        }
+        bench_add(&cold, us);
+
+        for (size_t j = 0; j < fill; j++) {
+            duer_mixer_write(stream, s_pcm, period, MIXER_CHANNELS);
+        }
+        us = bench_marked_write(stream, period);
+        if (us < 0) {
+            break;
+        }
+        bench_add(&busy, us);
+        duer_mixer_drain(stream);
+    }
+    duer_mixer_set_active(stream, false);
+
+    if (cold.count < (uint32_t)rounds || busy.count < (uint32_t)rounds) {
+        DUER_LOGE("mixer run: period %u, %s: a marked frame was not heard",
+                  (unsigned int)period, s_names[index]);
+        return -1;
+    }
+    DUER_LOGI("mixer run: period %4u, %-7s ring %3d ms: idle %u/%u/%u us, "
+              "full ring %u/%u/%u us (min/avg/max)",
+              (unsigned int)period, s_names[index], duer_mixer_get_ring_ms(stream),
+              cold.min, (uint32_t)(cold.sum / cold.count), cold.max,
+              busy.min, (uint32_t)(busy.sum / busy.count), busy.max);
+    return 0;
+}
+
+static int bench_period(int period, int rounds)
+{
+    int failed = 0;
+
+    duer_mixer_set_period(period);
+    if (duer_mixer_init()) {
+        DUER_LOGE("mixer run: device did not open with period %d", period);
+        return -1;
+    }
+    for (int i = 0; i < (int)(sizeof(s_streams) / sizeof(s_streams[0])); i++) {
+        if (bench_stream(i, rounds)) {
+            failed++;
+        }
+    }
+    duer_mixer_destroy();
+
+    return failed ? -1 : 0;
+}
+
+int duer_mixer_bench_run(int rounds)
+{
+    int period = duer_mixer_get_period();
+    int failed = 0;
+
+    if (rounds > MIXER_BENCH_ROUNDS_MAX) {
+        rounds = MIXER_BENCH_ROUNDS_MAX;
+    }
+    // a quiet click, audible on a real device without being loud
+    for (int i = 0; i < MIXER_CHANNELS * 8; i++) {
+        s_pcm[i] = (i / MIXER_CHANNELS) & 1 ? -4000 : 4000;
+    }
+
+    if (bench_period(period, rounds)) {
+        failed++;
+    }
+    for (int i = 0; i < (int)(sizeof(s_periods) / sizeof(s_periods[0])); i++) {
+        if (s_periods[i] != period && bench_period(s_periods[i], rounds)) {
+            failed++;
+        }
+    }
+    duer_mixer_set_period(period);
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_mixer_bench.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Output latency run over the mixer settings, without the cloud.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_BENCH_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_BENCH_H
+
+#include "duerapp_config.h"
+
+#define MIXER_BENCH_ROUNDS_MAX  (100)
+
+/*
+ * On the -o device, with the -k period and then 48, 96, 192, 384 and 1024
+ * frames, time rounds marked frames through each stream at its -R ring:
+ * written to an idle stream, as a prompt starts, and written behind a full
+ * ring, as a playing stream sees it. Logs min, avg and max from the write
+ * to when the device plays the frame. Returns -1 when the device did not
+ * open or a marked frame was never heard.
+ */
+int duer_mixer_bench_run(int rounds);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_MIXER_BENCH_H
@@ -38,8 +38,12 @@
 
 #include "duerapp_recorder.h"
 #include "duerapp_config.h"
+#include "duerapp_uplink.h"
 #include "lightduer_voice.h"
 #include "lightduer_dcs_router.h"
+#include "lightduer_timestamp.h"
+#include "device_vad.h"
+#include "duerapp_media.h"
 #include <alsa/asoundlib.h>
 #include "snowboy-detect-c-wrapper.h"
 
@@ -50,13 +54,19 @@
 #define FRAMES_SIZE  	  ((16/8) *CHANNEL)// bytes / sample * channels
 //#define PCM_STREAM_CAPTURE_DEVICE	"hw:2,0"
 #define PCM_STREAM_CAPTURE_DEVICE	"default"
+#define FOLLOW_UP_WINDOW_S	  (8)    // listen this long after a multi-round answer
+#define FOLLOW_UP_ONSET_MS	  (200)  // continuous non-silence that opens the session
+#define FOLLOW_UP_PREROLL_MS  (600)  // audio before the onset sent with the query
+// pre-roll plus session start-up, which waits for the previous utterance to
+// end and for the library lock; the flush lands in the uplink queue at once,
+// so more would be dropped there
+#define FOLLOW_UP_RING_MS	  (UPLINK_QUEUE_MS)
+#define WAKE_SENSITIVITY	  (0.5)
+#define WAKE_PLAYING_DROP	  (0.25) // confirm detector sensitivity drop at full output level
+#define WAKE_CONFIRM_MS		  (500)  // how close the confirming hit must be
 
 //#define RECORD_DATA_TO_FILE
 
-static int s_duer_rec_snd_fd=-1;
-static int s_duer_rec_recv_fd=-1;
-struct sockaddr_in s_duer_rec_addr;
-
 static duer_rec_state_t s_duer_rec_state = RECORDER_STOP;
 static pthread_t s_rec_threadID;
 static sem_t s_rec_sem;
@@ -65,6 +75,18 @@ static bool s_is_suspend = false;
 static bool s_is_baidu_rec_start = false;
 static pthread_t s_rec_send_threadID;
 static char * s_kws_model_filename = NULL;
+static int s_follow_up_window = FOLLOW_UP_WINDOW_S;
+static volatile uint32_t s_follow_up_deadline = 0; // duer_timestamp(), 0: closed
+static bool s_preroll_pending = false;
+static int16_t *s_preroll = NULL;
+static int s_preroll_size = 0;      // samples
+static int s_preroll_pos = 0;
+static int s_preroll_len = 0;
+static int s_preroll_since_onset = 0;
+static uint32_t s_preroll_truncated = 0;    // follow-up queries that lost their start
+static uint32_t s_preroll_lost_ms = 0;
+static uint32_t s_wake_accepted = 0;     // wakes accepted while media was playing
+static uint32_t s_wake_suppressed = 0;   // wakes rejected as self-wake
 const char *s_tone_url[3] = {"./resources/60.mp3","./resources/61.mp3","./resources/62.mp3"};
 	
 extern 	void event_record_start();
@@ -231,9 +253,165 @@ int  duer_recorder_test_end(void)
 	return 0;
 }
 
+void duer_recorder_set_follow_up(int seconds)
+{
+	s_follow_up_window = seconds > 0 ? seconds : 0;
+}
+
+void duer_recorder_follow_up_start(void)
+{
+	if(s_follow_up_window<=0 || RECORDER_STOP != s_duer_rec_state){
+		return;
+	}
+	uint32_t deadline = duer_timestamp() + s_follow_up_window * 1000;
+	s_follow_up_deadline = deadline ? deadline : 1;
+	DUER_LOGI("follow-up listening for %d s", s_follow_up_window);
+}
+
+void duer_recorder_follow_up_stop(void)
+{
+	s_follow_up_deadline = 0;
+}
+
+void duer_recorder_set_playing(bool playing)
+{
+	if(playing){
+		vad_set_playing();
+	}else{
+		// the VAD has no idle mode, listening is where the answer found it
+		vad_set_wakeup();
+	}
+}
+
+static void duer_preroll_write(const int16_t *data, int samples)
+{
+	if(!s_preroll){
+		return;
+	}
+	for(int i=0;i<samples;i++){
+		s_preroll[s_preroll_pos] = data[i];
+		s_preroll_pos = (s_preroll_pos + 1) % s_preroll_size;
+	}
+	s_preroll_len += samples;
+	if(s_preroll_len > s_preroll_size){
+		s_preroll_len = s_preroll_size;
+	}
+	s_preroll_since_onset += samples;
+}
+
+// queue the pre-roll plus everything captured since the onset, oldest first
+static void duer_preroll_flush(void)
+{
+	int samples = FOLLOW_UP_PREROLL_MS * (SAMPLE_RATE / 1000) + s_preroll_since_onset;
+	int start = 0;
+
+	if(samples > s_preroll_len){
+		int lost_ms = (samples - s_preroll_len) / (SAMPLE_RATE / 1000);
+		s_preroll_truncated++;
+		s_preroll_lost_ms += lost_ms;
+		DUER_LOGW("follow-up: session started %d ms after the onset, %d ms of the query lost "
+				  "(%u queries, %u ms so far)", s_preroll_since_onset / (SAMPLE_RATE / 1000),
+				  lost_ms, s_preroll_truncated, s_preroll_lost_ms);
+		samples = s_preroll_len;
+	}
+	start = (s_preroll_pos - samples + s_preroll_size) % s_preroll_size;
+	if(start + samples > s_preroll_size){
+		duer_uplink_queue_push(s_preroll + start, (s_preroll_size - start) << 1);
+		samples -= s_preroll_size - start;
+		start = 0;
+	}
+	duer_uplink_queue_push(s_preroll + start, samples << 1);
+}
+
+/*
+ * Snowboy's detector doubles as the follow-up VAD: RunDetection() returns -2
+ * for silence and 0 for voice that is not a hotword.
+ */
+static bool duer_follow_up_onset(int result, int frame_ms)
+{
+	static int voiced_ms = 0;
+	uint32_t deadline = s_follow_up_deadline;
+
+	if(!deadline){
+		voiced_ms = 0;
+		return false;
+	}
+	if(RECORDER_START == s_duer_rec_state || (int32_t)(duer_timestamp() - deadline) >= 0){
+		s_follow_up_deadline = 0;
+		voiced_ms = 0;
+		DUER_LOGI("follow-up window closed");
+		return false;
+	}
+
+	voiced_ms = (0 == result) ? voiced_ms + frame_ms : 0;
+	if(voiced_ms < FOLLOW_UP_ONSET_MS){
+		return false;
+	}
+	s_follow_up_deadline = 0;
+	voiced_ms = 0;
+	return true;
+}
+
+static void duer_wake_set_sensitivity(SnowboyDetect *detector, double sensitivity)
+{
+	char str[16];
+	snprintf(str, sizeof(str), "%.2f", sensitivity);
+	SnowboyDetectSetSensitivity(detector, str);
+}
+
+/*
+ * Self-wake suppression: while TTS, music or a tone is playing, a hotword is
+ * only accepted if a second detector, whose sensitivity drops with the output
+ * level, fired on the same audio. Returns the (possibly cleared) result.
+ */
+static int duer_wake_filter(SnowboyDetect *confirm, int result, int16_t *data, int samples)
+{
+	static bool was_playing = false;
+	static int level_tenth = -1;
+	static uint32_t confirm_hit = 0;
+	bool playing = duer_media_is_playing();
+
+	if(playing != was_playing){
+		was_playing = playing;
+		confirm_hit = 0;
+		if(confirm){
+			SnowboyDetectReset(confirm);
+		}
+	}
+	if(!playing){
+		return result;
+	}
+
+	if(confirm){
+		int level = duer_media_get_output_level() / 10;
+		if(level != level_tenth){
+			level_tenth = level;
+			duer_wake_set_sensitivity(confirm, WAKE_SENSITIVITY - WAKE_PLAYING_DROP * level / 10);
+		}
+		if(SnowboyDetectRunDetection(confirm, data, samples, false) > 0){
+			confirm_hit = duer_timestamp();
+			if(!confirm_hit){
+				confirm_hit = 1;
+			}
+		}
+	}
+
+	if(result > 0){
+		if(!confirm || (confirm_hit && duer_timestamp() - confirm_hit <= WAKE_CONFIRM_MS)){
+			s_wake_accepted++;
+			confirm_hit = 0;
+		}else{
+			s_wake_suppressed++;
+			result = 0;
+		}
+		DUER_LOGI("wake during playback: %s (accepted %u, suppressed %u)",
+				  result > 0 ? "accepted" : "suppressed", s_wake_accepted, s_wake_suppressed);
+	}
+	return result;
+}
+
 static void recorder_thread()
 {
-	fd_set fdwrite;
 	int value=0;
 
 	const char resource_filename[] = "resources/common.res";
@@ -242,7 +420,6 @@ static void recorder_thread()
 	//const char sensitivity_str[] = "0.5,0.5";
 	//const char model_filename[] = "resources/models/keywords.pmdl";
 	char *model_filename=s_kws_model_filename;
-	const char sensitivity_str[] = "0.5";
 	float audio_gain = 1.1;
 	bool apply_frontend = false;
 
@@ -253,10 +430,20 @@ static void recorder_thread()
 	// Initializes Snowboy detector.
 	SnowboyDetect* detector = SnowboyDetectConstructor(resource_filename,
 	                                                 (const char*)model_filename);
-	SnowboyDetectSetSensitivity(detector, sensitivity_str);
+	duer_wake_set_sensitivity(detector, WAKE_SENSITIVITY);
 	SnowboyDetectSetAudioGain(detector, audio_gain);
 	SnowboyDetectApplyFrontend(detector, apply_frontend);
 
+	// confirming detector for wakes heard while we are playing something
+	SnowboyDetect* confirm = SnowboyDetectConstructor(resource_filename,
+	                                                (const char*)model_filename);
+	if(confirm){
+		SnowboyDetectSetAudioGain(confirm, audio_gain);
+		SnowboyDetectApplyFrontend(confirm, apply_frontend);
+	}else{
+		DUER_LOGE("create confirm detector failed, wakes during playback are not filtered");
+	}
+
 	// Initializes PortAudio. You may use other tools to capture the audio.
 	value = SnowboyDetectSampleRate(detector);
 	DUER_LOGI("samplerate:%d\n",value);
@@ -298,6 +485,13 @@ static void recorder_thread()
     } else {
         memset(mono_buffer, 0, s_index->size);
     }
+
+    s_preroll_size = FOLLOW_UP_RING_MS * (SAMPLE_RATE / 1000);
+    s_preroll = (int16_t *)malloc(s_preroll_size << 1);
+    if (!s_preroll) {
+        DUER_LOGE("malloc pre-roll failed, follow-up listening disabled!\n");
+        s_follow_up_window = 0;
+    }
 	
     while (1)
     {
@@ -319,12 +513,17 @@ static void recorder_thread()
         }
 
 	mono_data_size = stereo_to_mono(buffer,s_index->size>>1,mono_buffer,s_index->size>>1);
+	duer_preroll_write(mono_buffer, mono_data_size);
 	
 #if 1		
        int result = SnowboyDetectRunDetection(detector,
                                              mono_buffer, mono_data_size, false);
+        result = duer_wake_filter(confirm, result, mono_buffer, mono_data_size);
         if (result > 0) {
             DUER_LOGI("Hotword %d detected!\n", result);
+			vad_set_wakeup();
+			s_follow_up_deadline = 0;
+			s_preroll_pending = false;
 			duer_dcs_dialog_cancel();
 			duer_media_tone_play(s_tone_url[rand()%3],5000);
 			event_record_start();
@@ -337,16 +536,22 @@ static void recorder_thread()
 				    duer_store_voice_start(g_recorder_channel);
 			}
 			#endif
+        } else if (duer_follow_up_onset(result, mono_data_size / (SAMPLE_RATE / 1000))) {
+			DUER_LOGI("follow-up speech detected");
+			s_preroll_since_onset = 0;
+			s_preroll_pending = true;
+			event_record_start();
         }
 #endif
 		
 	if((RECORDER_START == s_duer_rec_state)&&s_is_baidu_rec_start){
-	     struct timeval time = {0, 0};
-	    FD_ZERO(&fdwrite);
-	    FD_SET(s_duer_rec_snd_fd, &fdwrite);
-	    		
-	    if(select(s_duer_rec_snd_fd + 1, NULL, &fdwrite, NULL, &time)>0){
-		 send(s_duer_rec_snd_fd,mono_buffer,mono_data_size<<1,0);
+		 if(s_preroll_pending){
+			 // the pre-roll ring already holds this period
+			 s_preroll_pending = false;
+			 duer_preroll_flush();
+		 }else{
+			 duer_uplink_queue_push(mono_buffer,mono_data_size<<1);
+		 }
 		 #ifdef RECORD_DATA_TO_FILE
 		 duer_store_voice_write(mono_buffer,mono_data_size<<1);
 		 #else
@@ -355,9 +560,6 @@ static void recorder_thread()
 			duer_store_voice_write(mono_buffer,mono_data_size<<1);
 		}
 		 #endif
-             }else{
-		 DUER_LOGI("overloap!!!!!!!!!\n");
-	     }
 	}
     }
     
@@ -369,6 +571,10 @@ static void recorder_thread()
          free(mono_buffer);
 	 mono_buffer=NULL;	
     }
+    if(s_preroll){
+         free(s_preroll);
+	 s_preroll=NULL;
+    }
 	
     snd_pcm_drain(s_index->handle);
     snd_pcm_close(s_index->handle);
@@ -378,37 +584,29 @@ static void recorder_thread()
         s_index = NULL;
     }	
 	SnowboyDetectDestructor(detector);	  
+	if(confirm){
+		SnowboyDetectDestructor(confirm);
+	}
 	return;
 }
 
 static void recorder_data_send_thread()
 {
     char *buffer = NULL;
-	int size = s_index->size;
-	fd_set fdread;
-	struct timeval time = {0, 0};
-	int recvlen=0;
+	int size = 0;
+	int len=0;
 	
     pthread_detach(pthread_self());
 
 	DUER_LOGI("recorder_data_send_thread start!\n");	
 	s_is_baidu_rec_start = false;
-	
-	while(1)
-	{
-		FD_ZERO(&fdread);
-		FD_SET(s_duer_rec_recv_fd, &fdread);
-		if(select(s_duer_rec_recv_fd + 1, &fdread, NULL, NULL, &time)>0){
-			recv(s_duer_rec_recv_fd, buffer, size, 0);
-		}else{
-			break;
-		}
-	}
+	duer_uplink_queue_flush();
 	
 	DUER_LOGI("flush data end %d!\n",s_duer_rec_state);
 	s_is_baidu_rec_start = true;
-    duer_voice_start(16000);
+    duer_uplink_begin(SAMPLE_RATE);
 	
+	size = duer_uplink_frame_bytes();
     buffer = (char *)malloc(size);
     if (!buffer) {
         DUER_LOGE("malloc buffer failed!\n");
@@ -416,31 +614,17 @@ static void recorder_data_send_thread()
         memset(buffer, 0, size);
     }
 	
-    while (RECORDER_START == s_duer_rec_state)
+    while (buffer && RECORDER_START == s_duer_rec_state)
     {
-		FD_ZERO(&fdread);
-		time.tv_sec = 1;
-		time.tv_usec = 0;
-		
-		FD_SET(s_duer_rec_recv_fd, &fdread);
-		if(select(s_duer_rec_recv_fd + 1, &fdread, NULL, NULL, &time)>0){
-			recvlen = recv(s_duer_rec_recv_fd, buffer, size, 0);
-			if(recvlen>0){
-				printf(".&.");
-				duer_voice_send(buffer, recvlen);
-			}else{
-				DUER_LOGE("recv fail!\n");
-			}
+		len = duer_uplink_queue_pop_frame(buffer, 1000);
+		if(len>0){
+			duer_uplink_send(buffer, len, duer_uplink_queue_level());
 		}
     }
 	
 	s_is_baidu_rec_start = false;
-    duer_voice_stop();
-	
-    if(s_is_suspend) {
-        duer_voice_terminate();
-        s_is_suspend = false;
-    }
+    duer_uplink_end(s_is_suspend);
+    s_is_suspend = false;
     if (buffer) {
         free(buffer);
         buffer = NULL;
@@ -565,9 +749,6 @@ int duer_hotwords_detect_start(char *model_filename)
 	int ret=0;
 
 	duer_set_kws_model_file(model_filename);
-    s_duer_rec_addr.sin_family = AF_INET;
-    s_duer_rec_addr.sin_port = htons(19290);
-	s_duer_rec_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 	
     if(sem_init(&s_rec_sem, 0, 1)) {
         DUER_LOGE("Init s_rec_sem failed.");
@@ -585,27 +766,9 @@ int duer_hotwords_detect_start(char *model_filename)
     s_index->val = SAMPLE_RATE; // pcm sample rate
     
     do{
-		s_duer_rec_snd_fd =  socket(AF_INET, SOCK_DGRAM,IPPROTO_UDP);
-		if(s_duer_rec_snd_fd <0){
-			DUER_LOGE("open send socket failed");
-			break;
-		}
-		
-		ret = connect(s_duer_rec_snd_fd, (struct sockaddr *)&s_duer_rec_addr, sizeof(s_duer_rec_addr));
+		ret = duer_uplink_queue_init(SAMPLE_RATE);
 		if(ret!=0){
-			DUER_LOGE("socket connect failed");
-			break;
-		}
-		
-		s_duer_rec_recv_fd =  socket(AF_INET, SOCK_DGRAM,IPPROTO_UDP);
-		if(s_duer_rec_recv_fd <0){
-			DUER_LOGE("open recv socket failed");
-			break;
-		}
-
-		ret = bind(s_duer_rec_recv_fd, (struct sockaddr *) &s_duer_rec_addr, sizeof(s_duer_rec_addr));
-		if(ret<0){
-			DUER_LOGE("socket bind failed");
+			DUER_LOGE("uplink queue init failed");
 			break;
 		}
 		
@@ -635,15 +798,6 @@ int duer_hotwords_detect_start(char *model_filename)
         	free(s_index);
         	s_index = NULL;
     	}
-		if(s_duer_rec_recv_fd>=0){
-			close(s_duer_rec_recv_fd);
-			s_duer_rec_recv_fd = -1;
-		}
-		
-		if(s_duer_rec_snd_fd>=0){
-			close(s_duer_rec_snd_fd);
-			s_duer_rec_snd_fd = -1;
-		}		
 	}
 	
     return ret;
@@ -22,6 +22,7 @@
 #ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_RECORDER_H
 #define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_RECORDER_H
 
+#include <stdbool.h>
 #include <alsa/asoundlib.h>
 
 typedef enum{
@@ -47,4 +48,18 @@ int duer_hotwords_detect_start(char *model_filename);
 
 int duer_set_kws_model_file(char *optarg);
 
+/*
+ * Follow-up listening: after a multi-round answer, speech within the window
+ * opens a voice session without the wake word. 0 seconds disables it.
+ */
+void duer_recorder_set_follow_up(int seconds);
+void duer_recorder_follow_up_start(void);
+void duer_recorder_follow_up_stop(void);
+
+/*
+ * Called by the media thread when speech or music starts or stops being
+ * audible, to switch the VAD in and out of its playing mode.
+ */
+void duer_recorder_set_playing(bool playing);
+
 #endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_RECORDER_H
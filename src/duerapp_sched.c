@@ -0,0 +1,421 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_sched.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Binary min-heap of timers ordered by deadline. One timerfd is armed
+ *       at the earliest deadline; its thread fires everything due within the
+ *       next tick, then re-arms. Add, move and cancel are O(log n).
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "duerapp_sched.h"
+#include "duerapp_histogram.h"
+
+static duer_sched_timer_t **s_heap = NULL;
+static int s_heap_num = 0;
+static int s_heap_cap = 0;
+static int s_tfd = -1;
+static pthread_t s_sched_tid;
+static pthread_mutex_t s_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_fired_cond = PTHREAD_COND_INITIALIZER;
+static volatile bool s_running = false;
+// virtual time: no thread, duer_sched_advance() moves the clock
+static bool s_virtual = false;
+static int64_t s_virtual_now = 0;
+static duer_sched_timer_t *s_firing = NULL;    // callback running now
+static duer_sched_cb_t s_tick_cb = NULL;
+static void *s_tick_param = NULL;
+static duer_sched_stats_t s_stats;
+// owned by the scheduler thread, read after it stopped
+static duer_histogram_t s_lateness;
+
+int64_t duer_sched_now_us(void)
+{
+    struct timespec ts;
+
+    if (s_virtual) {
+        return s_virtual_now;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void heap_set(int i, duer_sched_timer_t *timer)
+{
+    s_heap[i] = timer;
+    timer->index = i;
+}
+
+static void heap_up(int i)
+{
+    duer_sched_timer_t *timer = s_heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (s_heap[parent]->deadline_us <= timer->deadline_us) {
+            break;
+        }
+        heap_set(i, s_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, timer);
+}
+
+static void heap_down(int i)
+{
+    duer_sched_timer_t *timer = s_heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= s_heap_num) {
+            break;
+        }
+        if (child + 1 < s_heap_num
+                && s_heap[child + 1]->deadline_us < s_heap[child]->deadline_us) {
+            child++;
+        }
+        if (timer->deadline_us <= s_heap[child]->deadline_us) {
+            break;
+        }
+        heap_set(i, s_heap[child]);
+        i = child;
+    }
+    heap_set(i, timer);
+}
+
+static void heap_remove(duer_sched_timer_t *timer)
+{
+    int i = timer->index;
+    duer_sched_timer_t *last = s_heap[--s_heap_num];
+
+    timer->index = -1;
+    if (last != timer) {
+        heap_set(i, last);
+        // the moved timer may belong above or below its new slot
+        heap_up(i);
+        heap_down(last->index);
+    }
+}
+
+/*
+ * Point the timerfd at the earliest deadline, or disarm it.
+ */
+static void sched_arm()
+{
+    struct itimerspec its;
+
+    if (s_virtual) {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    if (s_heap_num) {
+        int64_t deadline = s_heap[0]->deadline_us > 0 ? s_heap[0]->deadline_us : 1;
+        its.it_value.tv_sec = deadline / 1000000;
+        its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    timerfd_settime(s_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Fire everything due within the tick. Called and returns with the lock
+ * held, drops it around each callback.
+ */
+static void sched_fire(int64_t now)
+{
+    uint32_t fired = s_stats.fired;
+
+    while (s_heap_num && s_heap[0]->deadline_us <= now + SCHED_TICK_MS * 1000LL) {
+        duer_sched_timer_t *timer = s_heap[0];
+        heap_remove(timer);
+        s_firing = timer;
+        s_stats.fired++;
+        duer_histogram_add(&s_lateness, now > timer->deadline_us
+                           ? (uint32_t)(now - timer->deadline_us) : 0);
+        pthread_mutex_unlock(&s_sched_lock);
+        timer->cb(timer->param);
+        pthread_mutex_lock(&s_sched_lock);
+        s_firing = NULL;
+        pthread_cond_broadcast(&s_fired_cond);
+    }
+    if (s_tick_cb && s_stats.fired != fired) {
+        pthread_mutex_unlock(&s_sched_lock);
+        s_tick_cb(s_tick_param);
+        pthread_mutex_lock(&s_sched_lock);
+    }
+}
+
+static void sched_thread()
+{
+    uint64_t expirations = 0;
+
+    pthread_mutex_lock(&s_sched_lock);
+    while (s_running) {
+        pthread_mutex_unlock(&s_sched_lock);
+        if (read(s_tfd, &expirations, sizeof(expirations)) < 0 && errno != EINTR) {
+            DUER_LOGE("sched timerfd read: %s", strerror(errno));
+        }
+        pthread_mutex_lock(&s_sched_lock);
+        if (!s_running) {
+            break;
+        }
+        s_stats.wakeups++;
+        sched_fire(duer_sched_now_us());
+        sched_arm();
+        s_stats.pending = s_heap_num;
+    }
+    pthread_mutex_unlock(&s_sched_lock);
+}
+
+int duer_sched_init(void)
+{
+    if (s_running) {
+        return 0;
+    }
+    s_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (s_tfd < 0) {
+        DUER_LOGE("sched timerfd: %s", strerror(errno));
+        return -1;
+    }
+    s_heap = (duer_sched_timer_t **)malloc(SCHED_HEAP_INIT * sizeof(duer_sched_timer_t *));
+    if (!s_heap) {
+        close(s_tfd);
+        s_tfd = -1;
+        return -1;
+    }
+    s_heap_cap = SCHED_HEAP_INIT;
+    s_heap_num = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    duer_histogram_init(&s_lateness, "sched fire lateness", "us");
+
+    s_running = true;
+    int ret = pthread_create(&s_sched_tid, NULL, (void *)sched_thread, NULL);
+    if (ret) {
+        DUER_LOGE("Create sched pthread error!");
+        s_running = false;
+        free(s_heap);
+        s_heap = NULL;
+        close(s_tfd);
+        s_tfd = -1;
+        return -1;
+    }
+    pthread_setname_np(s_sched_tid, "dcs3_demo_sched");
+
+    return 0;
+}
+
+int duer_sched_init_virtual(int64_t start_us)
+{
+    if (s_running) {
+        return -1;
+    }
+    s_heap = (duer_sched_timer_t **)malloc(SCHED_HEAP_INIT * sizeof(duer_sched_timer_t *));
+    if (!s_heap) {
+        return -1;
+    }
+    s_heap_cap = SCHED_HEAP_INIT;
+    s_heap_num = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    duer_histogram_init(&s_lateness, "sched fire lateness", "us");
+    s_virtual = true;
+    s_virtual_now = start_us;
+    // callbacks run on the thread that advances time
+    s_sched_tid = pthread_self();
+    s_running = true;
+
+    return 0;
+}
+
+int duer_sched_advance(int64_t until_us)
+{
+    uint32_t fired = 0;
+
+    pthread_mutex_lock(&s_sched_lock);
+    if (!s_virtual) {
+        pthread_mutex_unlock(&s_sched_lock);
+        return -1;
+    }
+    fired = s_stats.fired;
+    while (s_heap_num && s_heap[0]->deadline_us <= until_us) {
+        // wake exactly at the earliest deadline, like the timerfd would
+        if (s_heap[0]->deadline_us > s_virtual_now) {
+            s_virtual_now = s_heap[0]->deadline_us;
+        }
+        s_stats.wakeups++;
+        sched_fire(s_virtual_now);
+    }
+    if (until_us > s_virtual_now) {
+        s_virtual_now = until_us;
+    }
+    s_stats.pending = s_heap_num;
+    fired = s_stats.fired - fired;
+    pthread_mutex_unlock(&s_sched_lock);
+
+    return (int)fired;
+}
+
+void duer_sched_destroy(void)
+{
+    struct itimerspec its;
+
+    if (!s_running) {
+        return;
+    }
+    pthread_mutex_lock(&s_sched_lock);
+    s_running = false;
+    if (!s_virtual) {
+        // an expiry in the past wakes the thread at once
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_nsec = 1;
+        timerfd_settime(s_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+    pthread_mutex_unlock(&s_sched_lock);
+
+    if (!s_virtual) {
+        pthread_join(s_sched_tid, NULL);
+        close(s_tfd);
+        s_tfd = -1;
+    }
+    s_virtual = false;
+    for (int i = 0; i < s_heap_num; i++) {
+        s_heap[i]->index = -1;
+    }
+    free(s_heap);
+    s_heap = NULL;
+    s_heap_num = s_heap_cap = 0;
+    DUER_LOGI("sched: %u fired in %u wakeups", s_stats.fired, s_stats.wakeups);
+    duer_histogram_log(&s_lateness);
+}
+
+void duer_sched_set_tick_cb(duer_sched_cb_t cb, void *param)
+{
+    pthread_mutex_lock(&s_sched_lock);
+    s_tick_cb = cb;
+    s_tick_param = param;
+    pthread_mutex_unlock(&s_sched_lock);
+}
+
+void duer_sched_timer_init(duer_sched_timer_t *timer, duer_sched_cb_t cb, void *param)
+{
+    timer->deadline_us = 0;
+    timer->index = -1;
+    timer->cb = cb;
+    timer->param = param;
+}
+
+static void heap_move(duer_sched_timer_t *timer, int64_t deadline_us)
+{
+    int64_t old = timer->deadline_us;
+
+    timer->deadline_us = deadline_us;
+    if (deadline_us < old) {
+        heap_up(timer->index);
+    } else {
+        heap_down(timer->index);
+    }
+}
+
+int duer_sched_add(duer_sched_timer_t *timer, int64_t deadline_us)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&s_sched_lock);
+    if (!s_running) {
+        ret = -1;
+    } else if (timer->index >= 0) {
+        heap_move(timer, deadline_us);
+    } else {
+        if (s_heap_num == s_heap_cap) {
+            duer_sched_timer_t **heap = (duer_sched_timer_t **)realloc(s_heap,
+                    2 * s_heap_cap * sizeof(duer_sched_timer_t *));
+            if (!heap) {
+                pthread_mutex_unlock(&s_sched_lock);
+                DUER_LOGE("sched: no memory for %d timers", 2 * s_heap_cap);
+                return -1;
+            }
+            s_heap = heap;
+            s_heap_cap *= 2;
+        }
+        timer->deadline_us = deadline_us;
+        s_heap[s_heap_num] = timer;
+        timer->index = s_heap_num++;
+        heap_up(timer->index);
+    }
+    // only a new earliest deadline moves the timerfd; the thread re-arms
+    // after firing anyway
+    if (!ret && s_heap[0] == timer && s_firing == NULL) {
+        sched_arm();
+    }
+    s_stats.pending = s_heap_num;
+    pthread_mutex_unlock(&s_sched_lock);
+
+    return ret;
+}
+
+bool duer_sched_move(duer_sched_timer_t *timer, int64_t deadline_us)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&s_sched_lock);
+    if (timer->index >= 0) {
+        bool first = timer->index == 0;
+        heap_move(timer, deadline_us);
+        queued = true;
+        if ((first || s_heap[0] == timer) && s_firing == NULL) {
+            sched_arm();
+        }
+    }
+    pthread_mutex_unlock(&s_sched_lock);
+
+    return queued;
+}
+
+bool duer_sched_cancel(duer_sched_timer_t *timer)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&s_sched_lock);
+    if (timer->index >= 0) {
+        bool first = timer->index == 0;
+        heap_remove(timer);
+        queued = true;
+        if (first && s_firing == NULL) {
+            sched_arm();
+        }
+    }
+    while (s_firing == timer && !pthread_equal(pthread_self(), s_sched_tid)) {
+        pthread_cond_wait(&s_fired_cond, &s_sched_lock);
+    }
+    s_stats.pending = s_heap_num;
+    pthread_mutex_unlock(&s_sched_lock);
+
+    return queued;
+}
+
+void duer_sched_get_stats(duer_sched_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_sched_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_sched_lock);
+    }
+}
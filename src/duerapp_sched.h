@@ -0,0 +1,99 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_sched.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: One-thread timer scheduler on absolute monotonic deadlines.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_SCHED_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_SCHED_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define SCHED_TICK_MS       (10)    // timers due within one tick fire together
+#define SCHED_HEAP_INIT     (16)
+
+typedef void (*duer_sched_cb_t)(void *param);
+
+/*
+ * Embedded in the owner's object, no allocation per timer. Only the
+ * scheduler touches the fields after duer_sched_timer_init().
+ */
+typedef struct{
+    int64_t deadline_us;    // CLOCK_MONOTONIC
+    int index;              // slot in the heap, -1 when not queued
+    duer_sched_cb_t cb;
+    void *param;
+}duer_sched_timer_t;
+
+typedef struct{
+    uint32_t pending;
+    uint32_t fired;
+    uint32_t wakeups;       // one wakeup may fire several timers
+}duer_sched_stats_t;
+
+int duer_sched_init(void);
+void duer_sched_destroy(void);
+
+/*
+ * A scheduler on virtual time, for benchmarks: no thread and no timerfd.
+ * Time stands at start_us until duer_sched_advance() moves it, and
+ * callbacks run on the thread that moves it.
+ */
+int duer_sched_init_virtual(int64_t start_us);
+
+/*
+ * Virtual scheduler only: jump from deadline to deadline up to until_us,
+ * firing timers as the thread would. Returns how many fired.
+ */
+int duer_sched_advance(int64_t until_us);
+
+int64_t duer_sched_now_us(void);
+
+/*
+ * Called on the scheduler thread once all timers of a tick have fired, so
+ * their owners can act on them as one batch.
+ */
+void duer_sched_set_tick_cb(duer_sched_cb_t cb, void *param);
+
+void duer_sched_timer_init(duer_sched_timer_t *timer, duer_sched_cb_t cb, void *param);
+
+/*
+ * Queue the timer, or move it when already queued. O(log n). Callbacks run
+ * on the scheduler thread, one at a time, and must not block for long.
+ */
+int duer_sched_add(duer_sched_timer_t *timer, int64_t deadline_us);
+
+/*
+ * Like duer_sched_add() but only for a timer that is still queued, so a
+ * timer whose callback already ran is not queued again. Returns true when
+ * it was moved.
+ */
+bool duer_sched_move(duer_sched_timer_t *timer, int64_t deadline_us);
+
+/*
+ * Take the timer off the queue. If its callback is running on another
+ * thread, wait for it to return, so the owner may free it afterwards.
+ * Returns true when it was still queued.
+ */
+bool duer_sched_cancel(duer_sched_timer_t *timer);
+
+void duer_sched_get_stats(duer_sched_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_SCHED_H
@@ -0,0 +1,235 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_tone.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Tones are decoded once to mono S16 PCM and written straight into
+ *       the mixer's tone stream, so a tone costs no pipeline setup, no
+ *       decoding and no device open.
+ */
+
+#include <dirent.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+
+#include "duerapp_tone.h"
+#include "duerapp_mixer.h"
+
+#define TONE_CACHE_MAX      (16)
+#define TONE_PATH_LEN       (128)
+#define TONE_DECODE_TIMEOUT (2 * GST_SECOND)
+#define TONE_CHUNK_FRAMES   (MIXER_PERIOD_FRAMES)
+
+typedef struct{
+    char path[TONE_PATH_LEN];
+    int16_t *pcm;   // mono, MIXER_RATE
+    size_t frames;
+}tone_entry_t;
+
+static tone_entry_t s_tones[TONE_CACHE_MAX];
+static int s_tone_num = 0;
+static pthread_mutex_t s_tone_lock = PTHREAD_MUTEX_INITIALIZER;
+static duer_tone_stats_t s_stats;
+
+static int tone_decode(const char *path, int16_t **pcm, size_t *frames)
+{
+    char desc[TONE_PATH_LEN + 192];
+    GError *error = NULL;
+    GstSample *sample = NULL;
+    GstMapInfo map;
+    size_t size = 0;
+    size_t cap = 0;
+    uint8_t *data = NULL;
+
+    snprintf(desc, sizeof(desc), "filesrc location=\"%s\" ! decodebin ! audioconvert"
+             " ! audioresample ! audio/x-raw,format=S16LE,rate=%d,channels=1"
+             " ! appsink name=sink sync=false", path, MIXER_RATE);
+    GstElement *pip = gst_parse_launch(desc, &error);
+    if (!pip) {
+        DUER_LOGE("tone pipeline: %s", error ? error->message : "unknown");
+        if (error) {
+            g_error_free(error);
+        }
+        return -1;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pip), "sink");
+
+    gst_element_set_state(pip, GST_STATE_PLAYING);
+    // NULL on EOS, and on a decode error once the timeout expired
+    while ((sample = gst_app_sink_try_pull_sample(GST_APP_SINK(sink), TONE_DECODE_TIMEOUT))) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        if (buffer && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            if (size + map.size > cap) {
+                cap = (size + map.size) * 2;
+                uint8_t *tmp = realloc(data, cap);
+                if (!tmp) {
+                    gst_buffer_unmap(buffer, &map);
+                    gst_sample_unref(sample);
+                    break;
+                }
+                data = tmp;
+            }
+            memcpy(data + size, map.data, map.size);
+            size += map.size;
+            gst_buffer_unmap(buffer, &map);
+        }
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pip, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pip);
+
+    if (!size) {
+        free(data);
+        DUER_LOGE("decode tone %s failed", path);
+        return -1;
+    }
+    // shrink to what was decoded
+    uint8_t *tmp = realloc(data, size);
+    *pcm = (int16_t *)(tmp ? tmp : data);
+    *frames = size / sizeof(int16_t);
+
+    return 0;
+}
+
+static int tone_write(const int16_t *pcm, size_t frames, gint64 start)
+{
+    duer_mixer_set_active(MIXER_STREAM_TONE, true);
+    duer_mixer_mark(MIXER_STREAM_TONE);
+
+    // a small first chunk gets the head of the tone into the next period
+    size_t n = frames < TONE_CHUNK_FRAMES ? frames : TONE_CHUNK_FRAMES;
+    if (duer_mixer_write(MIXER_STREAM_TONE, pcm, n, 1) != n) {
+        return -1;
+    }
+    if (duer_mixer_write(MIXER_STREAM_TONE, pcm + n, frames - n, 1) != frames - n) {
+        return -1;
+    }
+    // when the mixer wrote the first sample, plus the device delay behind it
+    gint64 heard = duer_mixer_mark_heard(MIXER_STREAM_TONE);
+    if (heard > start) {
+        uint32_t latency = (uint32_t)(heard - start);
+        s_stats.last_latency_us = latency;
+        s_stats.total_latency_us += latency;
+        if (latency > s_stats.max_latency_us) {
+            s_stats.max_latency_us = latency;
+        }
+    }
+    duer_mixer_drain(MIXER_STREAM_TONE);
+    duer_mixer_set_active(MIXER_STREAM_TONE, false);
+
+    return 0;
+}
+
+static bool tone_is_audio(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (strcasecmp(ext, ".mp3") == 0 || strcasecmp(ext, ".wav") == 0);
+}
+
+static void tone_load_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *ent = NULL;
+
+    if (!d) {
+        DUER_LOGW("no tone dir %s", dir);
+        return;
+    }
+    while ((ent = readdir(d)) && s_tone_num < TONE_CACHE_MAX) {
+        if (!tone_is_audio(ent->d_name)) {
+            continue;
+        }
+        tone_entry_t *tone = &s_tones[s_tone_num];
+        snprintf(tone->path, sizeof(tone->path), "%s/%s", dir, ent->d_name);
+        if (tone_decode(tone->path, &tone->pcm, &tone->frames) == 0) {
+            s_stats.cache_bytes += tone->frames * sizeof(int16_t);
+            s_tone_num++;
+        }
+    }
+    closedir(d);
+}
+
+int duer_tone_init(void)
+{
+    tone_load_dir(TONE_DIR);
+    DUER_LOGI("tone cache: %d tones, %u bytes", s_tone_num, s_stats.cache_bytes);
+
+    return s_tone_num ? 0 : -1;
+}
+
+void duer_tone_destroy(void)
+{
+    pthread_mutex_lock(&s_tone_lock);
+    for (int i = 0; i < s_tone_num; i++) {
+        free(s_tones[i].pcm);
+        s_tones[i].pcm = NULL;
+    }
+    s_tone_num = 0;
+    s_stats.cache_bytes = 0;
+    pthread_mutex_unlock(&s_tone_lock);
+}
+
+int duer_tone_play(const char *path)
+{
+    gint64 start = g_get_monotonic_time();
+    tone_entry_t *tone = NULL;
+    int16_t *pcm = NULL;
+    size_t frames = 0;
+    int ret = 0;
+
+    if (!path) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_tone_lock);
+    for (int i = 0; i < s_tone_num; i++) {
+        if (strcmp(s_tones[i].path, path) == 0) {
+            tone = &s_tones[i];
+            break;
+        }
+    }
+
+    if (tone) {
+        ret = tone_write(tone->pcm, tone->frames, start);
+    } else {
+        s_stats.misses++;
+        ret = tone_decode(path, &pcm, &frames);
+        if (ret == 0) {
+            ret = tone_write(pcm, frames, start);
+            free(pcm);
+        }
+    }
+    if (ret == 0) {
+        s_stats.plays++;
+        DUER_LOGI("tone %s: %u us to first sample (%s), avg %u us",
+                  path, s_stats.last_latency_us, tone ? "cached" : "decoded",
+                  (uint32_t)(s_stats.total_latency_us / s_stats.plays));
+    }
+    pthread_mutex_unlock(&s_tone_lock);
+
+    return ret;
+}
+
+void duer_tone_get_stats(duer_tone_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_tone_lock);
+        *stats = s_stats;
+        pthread_mutex_unlock(&s_tone_lock);
+    }
+}
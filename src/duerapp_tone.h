@@ -0,0 +1,54 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_tone.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Decoded tone cache API.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_TONE_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_TONE_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define TONE_DIR            "./resources"
+
+typedef struct{
+    uint32_t plays;
+    uint32_t misses;            // decoded on demand, e.g. recorded test prompts
+    uint32_t last_latency_us;   // call to first sample heard, as the mixer measured it
+    uint32_t max_latency_us;
+    uint64_t total_latency_us;
+    uint32_t cache_bytes;
+}duer_tone_stats_t;
+
+/*
+ * Decode every mp3/wav under TONE_DIR. gst_init() must have been called.
+ */
+int duer_tone_init(void);
+void duer_tone_destroy(void);
+
+/*
+ * Play a tone and return once it has been played out. Files that are not in
+ * the cache are decoded on the spot and not kept.
+ */
+int duer_tone_play(const char *path);
+
+void duer_tone_get_stats(duer_tone_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_TONE_H
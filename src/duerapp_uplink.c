@@ -0,0 +1,786 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_uplink.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Voice uplink stage. The capture thread queues PCM, an encoder thread
+ *       speex-encodes it as it comes in and queues the encoded chunks, and the
+ *       recorder send thread hands them to duer_voice_send() one send unit at
+ *       a time. Picks the speex quality per utterance and counts what each
+ *       one cost.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "duerapp_uplink.h"
+#include "lightduer_voice.h"
+#include "lightduer_speex.h"
+
+// wideband (16k) speex bitrate in bit/s for quality 0..10
+static const uint32_t s_speex_wb_bps[11] = {
+    3950, 5750, 7750, 9800, 12800, 16800, 20600, 23800, 27800, 34200, 42200
+};
+
+// keep the encoded stream at or below this share of the measured capacity
+#define UPLINK_HEADROOM_PERCENT     (50)
+// step down one more quality when this much speech (ms) was ever queued
+#define UPLINK_BACKLOG_HIGH_MS      (300)
+// longest the capture thread may wait for room under UPLINK_POLICY_BLOCK
+#define UPLINK_BLOCK_TIMEOUT_MS     (100)
+// queue level (percent) at which UPLINK_POLICY_CACHE diverts to the voice cache
+#define UPLINK_CACHE_HIGH_PERCENT   (50)
+// how long to stay cached before trying to flush over the link again
+#define UPLINK_CACHE_PROBE_MS       (1000)
+// PCM the encoder takes at a time, one speex frame
+#define UPLINK_ENCODE_MS            (20)
+// encoded queue room per ms of speech; speex at quality 10 needs about 5.3
+#define UPLINK_CODED_BYTES_PER_MS   (8)
+
+// one encoded chunk as duer_speex_encode() delivered it, the payload follows
+typedef struct{
+    uint16_t size;
+    uint16_t pcm;       // PCM bytes the chunk completes, 0 when a later one does
+}duer_uplink_chunk_t;
+
+static int s_quality = UPLINK_QUALITY_DEFAULT;
+static int s_quality_min = UPLINK_QUALITY_MIN;
+static int s_quality_max = UPLINK_QUALITY_MAX;
+static int s_samplerate = 16000;
+static uint32_t s_capacity_bps = 0; // EWMA of what the link carried, 0: unknown
+// all threads update it, always under s_queue_lock
+static duer_uplink_stats_t s_stats;
+
+// PCM from the capture thread to the encoder, under s_queue_lock
+static pthread_mutex_t s_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_queue_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_queue_space = PTHREAD_COND_INITIALIZER;
+static char *s_queue = NULL;
+static size_t s_queue_size = 0;
+static size_t s_queue_head = 0;
+static size_t s_queue_len = 0;
+// encoded chunks from the encoder to the send thread, also under s_queue_lock
+static pthread_cond_t s_coded_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_coded_space = PTHREAD_COND_INITIALIZER;
+static char *s_coded = NULL;
+static size_t s_coded_size = 0;
+static size_t s_coded_head = 0;
+static size_t s_coded_len = 0;
+static size_t s_coded_pcm = 0;      // PCM bytes the queued chunks stand for
+static size_t s_coded_pcm_max = 0;
+// the encoder of the current utterance, NULL between utterances
+static pthread_cond_t s_encode_idle = PTHREAD_COND_INITIALIZER;
+static duer_speex_handler s_speex = NULL;
+static bool s_encoding = false;
+static size_t s_encoding_pcm = 0;   // PCM taken off the queue, not yet queued encoded
+static char s_stage[1024];          // chunks of one duer_speex_encode() call
+static size_t s_stage_len = 0;
+
+static duer_uplink_policy_t s_policy = UPLINK_POLICY_CACHE;
+static bool s_is_cached = false;
+static uint64_t s_cached_since = 0;
+static int s_frame_ms = UPLINK_FRAME_MS_DEFAULT;
+static int s_flush_ms = UPLINK_FLUSH_MS_DEFAULT;
+
+// the batch duer_uplink_send() is handing to duer_voice_send()
+static const char *s_send_batch = NULL;
+static size_t s_send_len = 0;
+
+// mock transport: write each send's speex payload to /dev/null
+static bool s_mock = false;
+static int s_mock_fd = -1;
+static char s_mock_buf[UPLINK_MOCK_SEND_MAX];
+
+void __real_duer_speex_encode(duer_speex_handler handler, const void *data, size_t size,
+                              duer_encoded_func func);
+
+/*
+ * duer_voice_send() only takes PCM: it runs duer_speex_encode() under the
+ * library lock and the callback queues the result for the CA thread. The
+ * build wraps duer_speex_encode (-Wl,--wrap in the Makefile), so when the
+ * library encodes a batch from duer_uplink_send(), the chunks the encoder
+ * thread already made go to the callback instead. Any other call encodes.
+ */
+void __wrap_duer_speex_encode(duer_speex_handler handler, const void *data, size_t size,
+                              duer_encoded_func func)
+{
+    duer_uplink_chunk_t chunk;
+
+    if (!s_send_batch || data != s_send_batch) {
+        __real_duer_speex_encode(handler, data, size, func);
+        return;
+    }
+    for (size_t off = 0; off + sizeof(chunk) <= s_send_len; off += sizeof(chunk) + chunk.size) {
+        memcpy(&chunk, s_send_batch + off, sizeof(chunk));
+        func(s_send_batch + off + sizeof(chunk), chunk.size);
+    }
+}
+
+static int duer_uplink_voice_start(int samplerate)
+{
+    if (!s_mock) {
+        return duer_voice_start(samplerate);
+    }
+    if (s_mock_fd < 0) {
+        s_mock_fd = open("/dev/null", O_WRONLY);
+    }
+    return s_mock_fd >= 0 ? DUER_OK : DUER_ERR_FAILED;
+}
+
+/*
+ * Returns once the library took the batch: duer_voice_send() copies the
+ * chunks and queues them with duer_data_report_async(), the mock writes
+ * them in one go, like one datagram.
+ */
+static int duer_uplink_voice_send(const char *batch, size_t len, size_t pcm)
+{
+    duer_uplink_chunk_t chunk;
+    size_t size = 0;
+    int ret = DUER_OK;
+
+    if (!s_mock) {
+        s_send_batch = batch;
+        s_send_len = len;
+        ret = duer_voice_send(batch, pcm);
+        s_send_batch = NULL;
+        return ret;
+    }
+    for (size_t off = 0; off + sizeof(chunk) <= len; off += sizeof(chunk) + chunk.size) {
+        memcpy(&chunk, batch + off, sizeof(chunk));
+        if (size + chunk.size <= sizeof(s_mock_buf)) {
+            memcpy(s_mock_buf + size, batch + off + sizeof(chunk), chunk.size);
+            size += chunk.size;
+        }
+    }
+    if (size && write(s_mock_fd, s_mock_buf, size) < 0) {
+        return DUER_ERR_FAILED;
+    }
+    return DUER_OK;
+}
+
+static int duer_uplink_voice_stop(void)
+{
+    return s_mock ? DUER_OK : duer_voice_stop();
+}
+
+static void duer_uplink_voice_cache(bool cached)
+{
+    if (!s_mock) {
+        duer_voice_cache(cached ? DUER_TRUE : DUER_FALSE);
+    }
+}
+
+static void duer_uplink_voice_terminate(void)
+{
+    if (!s_mock) {
+        duer_voice_terminate();
+    }
+}
+
+static uint64_t duer_uplink_clock_us(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t duer_uplink_bytes_to_ms(size_t bytes)
+{
+    return (uint64_t)bytes * 1000 / (s_samplerate * 2);
+}
+
+static void duer_uplink_timeout(struct timespec *ts, int timeout_ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// caller holds s_queue_lock
+static void duer_uplink_queue_discard(size_t size)
+{
+    s_queue_head = (s_queue_head + size) % s_queue_size;
+    s_queue_len -= size;
+}
+
+// caller holds s_queue_lock and has made room
+static void duer_uplink_queue_write(const char *data, size_t size)
+{
+    size_t tail = (s_queue_head + s_queue_len) % s_queue_size;
+    size_t first = s_queue_size - tail;
+
+    if (first > size) {
+        first = size;
+    }
+    memcpy(s_queue + tail, data, first);
+    memcpy(s_queue, data + first, size - first);
+    s_queue_len += size;
+}
+
+// caller holds s_queue_lock; whole 16 bit samples only
+static size_t duer_uplink_queue_take(char *dst, size_t size)
+{
+    size_t first = 0;
+
+    if (size > s_queue_len) {
+        size = s_queue_len;
+    }
+    size &= ~(size_t)1;
+    first = s_queue_size - s_queue_head;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(dst, s_queue + s_queue_head, first);
+    memcpy(dst + first, s_queue, size - first);
+    duer_uplink_queue_discard(size);
+    return size;
+}
+
+// caller holds s_queue_lock
+static void duer_uplink_coded_copy(size_t pos, char *dst, size_t size)
+{
+    size_t first = s_coded_size - pos;
+
+    if (first > size) {
+        first = size;
+    }
+    memcpy(dst, s_coded + pos, first);
+    memcpy(dst + first, s_coded, size - first);
+}
+
+// caller holds s_queue_lock and has made room
+static void duer_uplink_coded_write(const char *data, size_t size, size_t pcm)
+{
+    size_t tail = (s_coded_head + s_coded_len) % s_coded_size;
+    size_t first = s_coded_size - tail;
+
+    if (first > size) {
+        first = size;
+    }
+    memcpy(s_coded + tail, data, first);
+    memcpy(s_coded, data + first, size - first);
+    s_coded_len += size;
+    s_coded_pcm += pcm;
+}
+
+// caller holds s_queue_lock; the head chunk, header and payload
+static size_t duer_uplink_coded_head(duer_uplink_chunk_t *chunk)
+{
+    duer_uplink_coded_copy(s_coded_head, (char *)chunk, sizeof(*chunk));
+    return sizeof(*chunk) + chunk->size;
+}
+
+// caller holds s_queue_lock
+static void duer_uplink_coded_clear(void)
+{
+    s_coded_head = 0;
+    s_coded_len = 0;
+    s_coded_pcm = 0;
+    pthread_cond_broadcast(&s_coded_space);
+}
+
+static void duer_uplink_encoded(const void *data, size_t size)
+{
+    duer_uplink_chunk_t chunk = {(uint16_t)size, 0};
+
+    if (s_stage_len + sizeof(chunk) + size > sizeof(s_stage)) {
+        DUER_LOGW("uplink: %u encoded bytes lost", (unsigned int)size);
+        return;
+    }
+    memcpy(s_stage + s_stage_len, &chunk, sizeof(chunk));
+    memcpy(s_stage + s_stage_len + sizeof(chunk), data, size);
+    s_stage_len += sizeof(chunk) + size;
+}
+
+/*
+ * Encodes whatever PCM the capture thread queued, with the encoder of the
+ * current utterance, and queues the chunks for the send thread. It waits
+ * when that queue is full, so a stalled link backs up into the PCM queue
+ * where the capture thread applies the stall policy.
+ */
+static void *duer_uplink_encode_thread(void *arg)
+{
+    char pcm[16000 * 2 * UPLINK_ENCODE_MS / 1000];
+    size_t carry = 0;       // PCM encoded without a chunk out yet
+    duer_uplink_chunk_t last;
+
+    pthread_mutex_lock(&s_queue_lock);
+    while (true) {
+        while (!s_speex || !s_queue_len) {
+            pthread_cond_wait(&s_queue_data, &s_queue_lock);
+        }
+        size_t size = (size_t)s_samplerate * 2 * UPLINK_ENCODE_MS / 1000;
+        size = duer_uplink_queue_take(pcm, size < sizeof(pcm) ? size : sizeof(pcm));
+        duer_speex_handler speex = s_speex;
+        s_encoding = true;
+        s_encoding_pcm = size;
+        pthread_cond_signal(&s_queue_space);
+        pthread_mutex_unlock(&s_queue_lock);
+
+        uint64_t cpu = duer_uplink_clock_us(CLOCK_THREAD_CPUTIME_ID);
+        s_stage_len = 0;
+        __real_duer_speex_encode(speex, pcm, size, duer_uplink_encoded);
+        cpu = duer_uplink_clock_us(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+        // the last chunk stands for all PCM since the previous one
+        carry += size;
+        size_t chunk_pcm = 0;
+        if (s_stage_len) {
+            size_t off = 0;
+            size_t next = 0;
+            for (; off < s_stage_len; off = next) {
+                memcpy(&last, s_stage + off, sizeof(last));
+                next = off + sizeof(last) + last.size;
+                if (next >= s_stage_len) {
+                    break;
+                }
+            }
+            last.pcm = (uint16_t)carry;
+            memcpy(s_stage + off, &last, sizeof(last));
+            chunk_pcm = carry;
+            carry = 0;
+        }
+
+        pthread_mutex_lock(&s_queue_lock);
+        s_encoding = false;
+        s_encoding_pcm = 0;
+        pthread_cond_broadcast(&s_encode_idle);
+        if (speex != s_speex) {
+            // the utterance ended meanwhile
+            carry = 0;
+            continue;
+        }
+        s_stats.encode_cpu_us += cpu;
+        while (speex == s_speex && s_stage_len
+                && (s_coded_size - s_coded_len < s_stage_len
+                    || s_coded_pcm + chunk_pcm > s_coded_pcm_max)) {
+            pthread_cond_wait(&s_coded_space, &s_queue_lock);
+        }
+        if (speex == s_speex && s_stage_len) {
+            duer_uplink_coded_write(s_stage, s_stage_len, chunk_pcm);
+            pthread_cond_signal(&s_coded_data);
+        }
+    }
+    return NULL;
+}
+
+int duer_uplink_queue_init(int samplerate)
+{
+    static bool started = false;
+    pthread_t thread;
+
+    s_samplerate = samplerate;
+    pthread_mutex_lock(&s_queue_lock);
+    if (!s_queue) {
+        s_queue_size = (size_t)samplerate * 2 * UPLINK_QUEUE_MS / 1000;
+        s_queue = (char *)malloc(s_queue_size);
+    }
+    if (!s_coded) {
+        s_coded_size = (size_t)UPLINK_CODED_BYTES_PER_MS * UPLINK_QUEUE_MS;
+        s_coded = (char *)malloc(s_coded_size);
+    }
+    s_coded_pcm_max = s_queue_size;
+    s_queue_head = 0;
+    s_queue_len = 0;
+    duer_uplink_coded_clear();
+    pthread_mutex_unlock(&s_queue_lock);
+
+    if (!s_queue || !s_coded) {
+        DUER_LOGE("malloc uplink queue failed!");
+        return -1;
+    }
+    if (!started) {
+        if (pthread_create(&thread, NULL, duer_uplink_encode_thread, NULL)) {
+            DUER_LOGE("create uplink encode thread failed!");
+            return -1;
+        }
+        pthread_detach(thread);
+        started = true;
+    }
+    return 0;
+}
+
+int duer_uplink_queue_push(const void *data, size_t size)
+{
+    const char *src = (const char *)data;
+    int ret = 0;
+    uint64_t blocked = 0;
+    struct timespec deadline;
+
+    if (!s_queue || !size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_queue_lock);
+    if (size > s_queue_size) {
+        // keep only the newest audio that fits
+        s_stats.dropped_ms += duer_uplink_bytes_to_ms(size - s_queue_size);
+        src += size - s_queue_size;
+        size = s_queue_size;
+    }
+
+    if (UPLINK_POLICY_BLOCK == s_policy && s_queue_size - s_queue_len < size) {
+        blocked = duer_uplink_clock_us(CLOCK_MONOTONIC);
+        duer_uplink_timeout(&deadline, UPLINK_BLOCK_TIMEOUT_MS);
+        while (s_queue_size - s_queue_len < size) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&s_queue_space, &s_queue_lock, &deadline)) {
+                break;
+            }
+        }
+        s_stats.delayed_ms += (duer_uplink_clock_us(CLOCK_MONOTONIC) - blocked) / 1000;
+    }
+
+    if (s_queue_size - s_queue_len < size) {
+        if (UPLINK_POLICY_BLOCK == s_policy) {
+            // timed out: losing the newest period keeps the queued audio contiguous
+            s_stats.dropped_ms += duer_uplink_bytes_to_ms(size);
+            ret = -1;
+        } else {
+            size_t drop = size - (s_queue_size - s_queue_len);
+            duer_uplink_queue_discard(drop);
+            s_stats.dropped_ms += duer_uplink_bytes_to_ms(drop);
+        }
+    }
+
+    if (!ret) {
+        duer_uplink_queue_write(src, size);
+        if (duer_uplink_bytes_to_ms(s_queue_len) > s_stats.queue_peak_ms) {
+            s_stats.queue_peak_ms = duer_uplink_bytes_to_ms(s_queue_len);
+        }
+        pthread_cond_signal(&s_queue_data);
+    }
+    pthread_mutex_unlock(&s_queue_lock);
+
+    return ret;
+}
+
+int duer_uplink_queue_pop_frame(void *data, int timeout_ms)
+{
+    char *dst = (char *)data;
+    size_t room = duer_uplink_frame_bytes();
+    size_t unit = room;
+    size_t len = 0;
+    size_t pcm = 0;
+    duer_uplink_chunk_t chunk;
+    struct timespec deadline;
+
+    if (!s_coded) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_queue_lock);
+    duer_uplink_timeout(&deadline, timeout_ms);
+    while (pcm < unit) {
+        if (!s_coded_len) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&s_coded_data, &s_queue_lock, &deadline)) {
+                break;
+            }
+            continue;
+        }
+        size_t size = duer_uplink_coded_head(&chunk);
+        if (len + size > room) {
+            break;
+        }
+        duer_uplink_coded_copy(s_coded_head, dst + len, size);
+        s_coded_head = (s_coded_head + size) % s_coded_size;
+        s_coded_len -= size;
+        s_coded_pcm -= chunk.pcm;
+        pthread_cond_signal(&s_coded_space);
+        if (!len) {
+            // don't hold a partial unit back longer than the flush interval
+            duer_uplink_timeout(&deadline, s_flush_ms);
+        }
+        len += size;
+        pcm += chunk.pcm;
+    }
+    pthread_mutex_unlock(&s_queue_lock);
+
+    return (int)len;
+}
+
+void duer_uplink_set_frame(int frame_ms, int flush_ms)
+{
+    if (frame_ms < 20 || frame_ms > UPLINK_QUEUE_MS / 2 || flush_ms < 1) {
+        DUER_LOGE("invalid uplink unit %d ms, flush %d ms", frame_ms, flush_ms);
+        return;
+    }
+    s_frame_ms = frame_ms;
+    s_flush_ms = flush_ms;
+}
+
+void duer_uplink_set_mock(bool mock)
+{
+    s_mock = mock;
+}
+
+size_t duer_uplink_frame_bytes(void)
+{
+    return (size_t)s_samplerate * 2 * s_frame_ms / 1000;
+}
+
+void duer_uplink_queue_flush(void)
+{
+    pthread_mutex_lock(&s_queue_lock);
+    s_queue_head = 0;
+    s_queue_len = 0;
+    duer_uplink_coded_clear();
+    pthread_cond_broadcast(&s_queue_space);
+    pthread_mutex_unlock(&s_queue_lock);
+}
+
+size_t duer_uplink_queue_level(void)
+{
+    size_t level = 0;
+    pthread_mutex_lock(&s_queue_lock);
+    level = s_queue_len + s_encoding_pcm + s_coded_pcm;
+    pthread_mutex_unlock(&s_queue_lock);
+    return level;
+}
+
+void duer_uplink_set_policy(duer_uplink_policy_t policy)
+{
+    s_policy = policy;
+}
+
+duer_uplink_policy_t duer_uplink_get_policy(void)
+{
+    return s_policy;
+}
+
+/*
+ * UPLINK_POLICY_CACHE: a stalled link shows up as a filling queue, because the
+ * send thread waits in duer_voice_send() on the library's report queue. Divert into the voice cache so the
+ * queue drains, then periodically leave the cache, which flushes it over the
+ * link; if the link is still slow the queue refills and we divert again.
+ */
+static void duer_uplink_update_cache(size_t backlog)
+{
+    uint64_t now = duer_uplink_clock_us(CLOCK_MONOTONIC);
+
+    if (UPLINK_POLICY_CACHE != s_policy) {
+        return;
+    }
+    if (!s_is_cached && backlog * 100 > s_queue_size * UPLINK_CACHE_HIGH_PERCENT) {
+        duer_uplink_voice_cache(true);
+        s_is_cached = true;
+        s_cached_since = now;
+        pthread_mutex_lock(&s_queue_lock);
+        s_stats.cache_switches++;
+        pthread_mutex_unlock(&s_queue_lock);
+        DUER_LOGI("uplink stalled, caching voice (backlog %u ms)",
+                  duer_uplink_bytes_to_ms(backlog));
+    } else if (s_is_cached && now - s_cached_since >= UPLINK_CACHE_PROBE_MS * 1000) {
+        duer_uplink_voice_cache(false);
+        s_is_cached = false;
+    }
+}
+
+static int duer_uplink_pick_quality(uint32_t backlog_peak)
+{
+    int quality = s_quality;
+
+    if (s_capacity_bps) {
+        uint32_t budget = s_capacity_bps / 100 * UPLINK_HEADROOM_PERCENT;
+        quality = s_quality_min;
+        for (int q = s_quality_max; q >= s_quality_min; q--) {
+            if (s_speex_wb_bps[q] <= budget) {
+                quality = q;
+                break;
+            }
+        }
+    }
+
+    uint32_t backlog_ms = duer_uplink_bytes_to_ms(backlog_peak);
+    if (backlog_ms > UPLINK_BACKLOG_HIGH_MS && quality > s_quality_min) {
+        quality--;
+    }
+
+    if (quality < s_quality_min) {
+        quality = s_quality_min;
+    } else if (quality > s_quality_max) {
+        quality = s_quality_max;
+    }
+    return quality;
+}
+
+/*
+ * Encoding happens before the send, so send_wall_us is what the library took
+ * to accept the encoded speech: next to nothing while the CA thread keeps up,
+ * the back-pressure of its report queue when the link does not.
+ */
+static void duer_uplink_update_capacity(const duer_uplink_stats_t *stats)
+{
+    uint32_t speech_us = 0;
+    uint32_t bps = 0;
+
+    if (!stats->pcm_bytes || !stats->encoded_bytes || !stats->send_wall_us) {
+        return;
+    }
+    speech_us = (uint64_t)stats->pcm_bytes * 1000000 / (s_samplerate * 2);
+    if (stats->cache_switches) {
+        // cached sends return without touching the link, they say nothing about it
+        bps = (uint64_t)stats->encoded_bytes * 8 * 1000000 / speech_us;
+    } else {
+        // the link took the encoded speech in send_wall time
+        bps = (uint64_t)stats->encoded_bytes * 8 * 1000000 / stats->send_wall_us;
+    }
+    if (s_capacity_bps) {
+        s_capacity_bps = (s_capacity_bps * 3 + bps) / 4;
+    } else {
+        s_capacity_bps = bps;
+    }
+}
+
+void duer_uplink_set_quality_range(int min, int max)
+{
+    if (min < 0 || max > 10 || min > max) {
+        DUER_LOGE("invalid speex quality range %d..%d", min, max);
+        return;
+    }
+    s_quality_min = min;
+    s_quality_max = max;
+}
+
+
+int duer_uplink_begin(int samplerate)
+{
+    s_samplerate = samplerate;
+    pthread_mutex_lock(&s_queue_lock);
+    uint32_t backlog_peak = s_stats.backlog_peak;
+    pthread_mutex_unlock(&s_queue_lock);
+    s_quality = duer_uplink_pick_quality(backlog_peak);
+    if (!s_mock) {
+        duer_voice_set_speex_quality(s_quality);
+    }
+    duer_speex_handler speex = duer_speex_create(samplerate, s_quality);
+    if (!speex) {
+        DUER_LOGE("create uplink speex encoder failed!");
+        return DUER_ERR_FAILED;
+    }
+
+    pthread_mutex_lock(&s_queue_lock);
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.quality = s_quality;
+    s_speex = speex;
+    pthread_cond_signal(&s_queue_data);
+    pthread_mutex_unlock(&s_queue_lock);
+    s_is_cached = false;
+
+    return duer_uplink_voice_start(samplerate);
+}
+
+int duer_uplink_send(const void *data, size_t size, size_t backlog)
+{
+    const char *batch = (const char *)data;
+    duer_uplink_chunk_t chunk;
+    size_t pcm = 0;
+    size_t payload = 0;
+
+    for (size_t off = 0; off + sizeof(chunk) <= size; off += sizeof(chunk) + chunk.size) {
+        memcpy(&chunk, batch + off, sizeof(chunk));
+        pcm += chunk.pcm;
+        payload += chunk.size;
+    }
+    if (!pcm) {
+        return DUER_OK;
+    }
+
+    duer_uplink_update_cache(backlog);
+    uint64_t wall = duer_uplink_clock_us(CLOCK_MONOTONIC);
+    int ret = duer_uplink_voice_send(batch, size, pcm);
+    wall = duer_uplink_clock_us(CLOCK_MONOTONIC) - wall;
+
+    pthread_mutex_lock(&s_queue_lock);
+    if (s_is_cached) {
+        s_stats.delayed_ms += duer_uplink_bytes_to_ms(pcm);
+    }
+    s_stats.send_wall_us += wall;
+    s_stats.encode_calls++;
+    s_stats.pcm_bytes += pcm;
+    s_stats.encoded_bytes += payload;
+    if (backlog > s_stats.backlog_peak) {
+        s_stats.backlog_peak = backlog;
+    }
+    pthread_mutex_unlock(&s_queue_lock);
+    return ret;
+}
+
+int duer_uplink_end(bool terminate)
+{
+    pthread_mutex_lock(&s_queue_lock);
+    duer_speex_handler speex = s_speex;
+    s_speex = NULL;
+    while (s_encoding) {
+        pthread_cond_wait(&s_encode_idle, &s_queue_lock);
+    }
+    // what was not sent by now belongs to no session
+    duer_uplink_coded_clear();
+    pthread_mutex_unlock(&s_queue_lock);
+    if (speex) {
+        duer_speex_destroy(speex);
+    }
+
+    if (s_is_cached) {
+        // hand whatever the cache holds to the link before closing the session
+        duer_uplink_voice_cache(false);
+        s_is_cached = false;
+    }
+    int ret = duer_uplink_voice_stop();
+    if (terminate) {
+        duer_uplink_voice_terminate();
+    }
+
+    duer_uplink_stats_t stats;
+    pthread_mutex_lock(&s_queue_lock);
+    stats = s_stats;
+    pthread_mutex_unlock(&s_queue_lock);
+    uint32_t speech_ms = duer_uplink_bytes_to_ms(stats.pcm_bytes);
+    duer_uplink_update_capacity(&stats);
+
+    DUER_LOGI("uplink: %u ms speech, q%d %u bytes (nominal %u), %u sends, encode cpu %u us, "
+              "send wall %u us, backlog peak %u, capacity %u bps",
+              speech_ms, stats.quality, stats.encoded_bytes,
+              (uint32_t)((uint64_t)s_speex_wb_bps[stats.quality] * speech_ms / 8000),
+              stats.encode_calls, stats.encode_cpu_us, stats.send_wall_us,
+              stats.backlog_peak, s_capacity_bps);
+    if (speech_ms) {
+        DUER_LOGI("uplink per speech second: %u sends, %u us cpu (unit %d ms, flush %d ms)",
+                  stats.encode_calls * 1000 / speech_ms,
+                  (uint32_t)((uint64_t)stats.encode_cpu_us * 1000 / speech_ms),
+                  s_frame_ms, s_flush_ms);
+    }
+    DUER_LOGI("uplink queue: policy %d, high-water %u ms, delayed %u ms, dropped %u ms, "
+              "cache switches %u", s_policy, stats.queue_peak_ms, stats.delayed_ms,
+              stats.dropped_ms, stats.cache_switches);
+    return ret;
+}
+
+void duer_uplink_get_stats(duer_uplink_stats_t *stats)
+{
+    if (stats) {
+        pthread_mutex_lock(&s_queue_lock);
+        memcpy(stats, &s_stats, sizeof(s_stats));
+        pthread_mutex_unlock(&s_queue_lock);
+    }
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_uplink.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Voice uplink (speex encode + send) stage API.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_H
+
+#include <stdint.h>
+
+#include "duerapp_config.h"
+
+#define UPLINK_QUALITY_MIN      (2)
+#define UPLINK_QUALITY_MAX      (8)
+#define UPLINK_QUALITY_DEFAULT  (5)
+#define UPLINK_QUEUE_MS         (2000) // uplink queue capacity in ms of speech
+#define UPLINK_FRAME_MS_DEFAULT (80)   // audio handed to one duer_voice_send()
+#define UPLINK_FLUSH_MS_DEFAULT (120)  // max time a partial unit is held back
+#define UPLINK_MOCK_SEND_MAX    (8192) // speex bytes one mock send can carry
+
+typedef enum{
+    UPLINK_POLICY_BLOCK,        // capture thread waits (bounded) for room
+    UPLINK_POLICY_DROP_OLDEST,  // overwrite the oldest queued audio
+    UPLINK_POLICY_CACHE,        // divert to duer_voice_cache() until the link recovers
+}duer_uplink_policy_t;
+
+typedef struct{
+    uint32_t pcm_bytes;         // raw PCM sent
+    uint32_t encoded_bytes;     // speex payload sent, as the encoder produced it
+    uint32_t encode_calls;      // duer_voice_send() calls (one per batch)
+    uint32_t encode_cpu_us;     // encoder thread CPU spent in duer_speex_encode()
+    uint32_t send_wall_us;      // wall time duer_voice_send() took the batches in
+    uint32_t backlog_peak;      // max PCM bytes waiting when a batch was taken
+    uint32_t queue_peak_ms;     // uplink queue high-water mark
+    uint32_t delayed_ms;        // speech held back by blocking or caching
+    uint32_t dropped_ms;        // speech lost to queue overflow
+    uint32_t cache_switches;    // times the session fell back to duer_voice_cache()
+    int quality;
+}duer_uplink_stats_t;
+
+/*
+ * Create the bounded queues between the capture thread, the encoder thread
+ * and the uplink thread, and start the encoder thread.
+ */
+int duer_uplink_queue_init(int samplerate);
+
+/*
+ * Called by the capture thread; never blocks longer than one policy timeout.
+ */
+int duer_uplink_queue_push(const void *data, size_t size);
+
+/*
+ * Take the encoded chunks of one send unit, or less once the flush interval
+ * expired, into a duer_uplink_frame_bytes() buffer. Returns the bytes taken
+ * for duer_uplink_send(), 0 on idle timeout.
+ */
+int duer_uplink_queue_pop_frame(void *data, int timeout_ms);
+
+/*
+ * Send unit (e.g. 40/80/160 ms) and the max latency of a partially filled one.
+ */
+void duer_uplink_set_frame(int frame_ms, int flush_ms);
+size_t duer_uplink_frame_bytes(void);
+
+/*
+ * Write the speex payload of each send to /dev/null instead of starting a
+ * voice session, to compare send units without the cloud.
+ * Set before duer_uplink_begin().
+ */
+void duer_uplink_set_mock(bool mock);
+
+void duer_uplink_queue_flush(void);
+size_t duer_uplink_queue_level(void);
+
+void duer_uplink_set_policy(duer_uplink_policy_t policy);
+duer_uplink_policy_t duer_uplink_get_policy(void);
+
+/*
+ * Pick the speex quality for the next utterance, create its encoder and
+ * start the voice session.
+ */
+int duer_uplink_begin(int samplerate);
+
+/*
+ * Send one batch from duer_uplink_queue_pop_frame(). backlog is the PCM still
+ * waiting behind it. duer_voice_send() takes the already encoded chunks (the
+ * build wraps duer_speex_encode) and queues them for the CA thread, so the
+ * time spent here is the back-pressure of that queue, not the link's speed.
+ */
+int duer_uplink_send(const void *data, size_t size, size_t backlog);
+
+/*
+ * Finish the utterance, report its statistics and feed the quality estimator.
+ */
+int duer_uplink_end(bool terminate);
+
+void duer_uplink_set_quality_range(int min, int max);
+void duer_uplink_get_stats(duer_uplink_stats_t *stats);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_H
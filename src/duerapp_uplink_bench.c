@@ -0,0 +1,209 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_uplink_bench.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: The calling thread plays the capture thread and a second one the
+ *       recorder send thread, both on the real uplink queue. Syscalls come
+ *       from /proc/self/io, which counts reads and writes only; the mock
+ *       transport does one write per send, as the CoAP one sends one
+ *       datagram.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "duerapp_uplink_bench.h"
+#include "duerapp_uplink.h"
+
+#define BENCH_RATE  (16000)
+
+typedef struct{
+    int64_t syscalls;       // -1: no /proc/self/io
+    int64_t switches;
+    int64_t cpu_us;
+}bench_usage_t;
+
+static const int s_units[] = {20, 40, 80, 160};
+static volatile bool s_capturing = false;
+
+static int64_t bench_clock_us(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int64_t bench_syscalls()
+{
+    char line[64];
+    long long value = 0;
+    int64_t count = -1;
+    FILE *fp = fopen("/proc/self/io", "r");
+
+    if (!fp) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %lld", &value) == 1
+                || sscanf(line, "syscw: %lld", &value) == 1) {
+            count = (count < 0 ? 0 : count) + value;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static void bench_usage(bench_usage_t *usage)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    usage->syscalls = bench_syscalls();
+    usage->switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    usage->cpu_us = bench_clock_us(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// a voiced vowel-ish tone with some noise, so speex has something to code
+static void bench_speech(int16_t *pcm, int samples, int64_t *pos)
+{
+    for (int i = 0; i < samples; i++, (*pos)++) {
+        double t = (double)*pos / BENCH_RATE;
+        double v = 0.5 * sin(2 * M_PI * 180 * t) + 0.3 * sin(2 * M_PI * 720 * t)
+                 + 0.1 * ((double)rand() / RAND_MAX - 0.5);
+        pcm[i] = (int16_t)(v * (1.0 - 0.5 * sin(2 * M_PI * 3 * t)) * 12000);
+    }
+}
+
+static void *bench_send_thread(void *arg)
+{
+    char *buffer = (char *)arg;
+
+    while (s_capturing || duer_uplink_queue_level()) {
+        int len = duer_uplink_queue_pop_frame(buffer, 50);
+        if (len > 0) {
+            duer_uplink_send(buffer, len, duer_uplink_queue_level());
+        }
+    }
+    return NULL;
+}
+
+static int bench_unit(int unit, int seconds)
+{
+    int16_t pcm[BENCH_RATE * UPLINK_BENCH_PERIOD_MS / 1000];
+    int periods = seconds * 1000 / UPLINK_BENCH_PERIOD_MS;
+    int64_t pos = 0;
+    char *buffer = NULL;
+    pthread_t thread;
+    bench_usage_t before;
+    bench_usage_t after;
+    duer_uplink_stats_t stats;
+    struct timespec next;
+
+    duer_uplink_set_frame(unit, unit + unit / 2);
+    buffer = (char *)malloc(duer_uplink_frame_bytes());
+    if (!buffer) {
+        DUER_LOGE("uplink run: no memory for a %d ms unit", unit);
+        return -1;
+    }
+    duer_uplink_queue_flush();
+    if (duer_uplink_begin(BENCH_RATE) != DUER_OK) {
+        DUER_LOGE("uplink run: mock transport did not start");
+        free(buffer);
+        return -1;
+    }
+
+    bench_usage(&before);
+    s_capturing = true;
+    if (pthread_create(&thread, NULL, bench_send_thread, buffer)) {
+        DUER_LOGE("uplink run: no send thread: %s", strerror(errno));
+        s_capturing = false;
+        duer_uplink_end(false);
+        free(buffer);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < periods; i++) {
+        bench_speech(pcm, sizeof(pcm) / sizeof(pcm[0]), &pos);
+        duer_uplink_queue_push(pcm, sizeof(pcm));
+        next.tv_nsec += UPLINK_BENCH_PERIOD_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    s_capturing = false;
+    pthread_join(thread, NULL);
+    bench_usage(&after);
+
+    duer_uplink_end(false);
+    duer_uplink_get_stats(&stats);
+    free(buffer);
+
+    uint32_t speech_ms = (uint64_t)stats.pcm_bytes * 1000 / (BENCH_RATE * 2);
+    if (!stats.encode_calls || !speech_ms) {
+        DUER_LOGE("uplink run: %d ms unit sent nothing", unit);
+        return -1;
+    }
+    DUER_LOGI("uplink run: unit %3d ms: %u sends/s, %lld syscalls/s, %lld switches/s, "
+              "%lld us cpu/s, %u us encode/s, %u bytes/s, %u ms per send",
+              unit, stats.encode_calls * 1000 / speech_ms,
+              after.syscalls < 0 ? -1LL
+                                 : (long long)((after.syscalls - before.syscalls) * 1000 / speech_ms),
+              (long long)((after.switches - before.switches) * 1000 / speech_ms),
+              (long long)((after.cpu_us - before.cpu_us) * 1000 / speech_ms),
+              (uint32_t)((uint64_t)stats.encode_cpu_us * 1000 / speech_ms),
+              (uint32_t)((uint64_t)stats.encoded_bytes * 1000 / speech_ms),
+              speech_ms / stats.encode_calls);
+    if (stats.dropped_ms) {
+        DUER_LOGE("uplink run: %d ms unit dropped %u ms of speech", unit, stats.dropped_ms);
+        return -1;
+    }
+    return 0;
+}
+
+int duer_uplink_bench_run(int seconds)
+{
+    int failed = 0;
+
+    if (seconds > UPLINK_BENCH_SECONDS_MAX) {
+        seconds = UPLINK_BENCH_SECONDS_MAX;
+    }
+    if (duer_uplink_queue_init(BENCH_RATE)) {
+        return -1;
+    }
+    duer_uplink_set_mock(true);
+    if (bench_syscalls() < 0) {
+        DUER_LOGW("uplink run: no /proc/self/io, syscalls are not counted");
+    }
+    for (int i = 0; i < (int)(sizeof(s_units) / sizeof(s_units[0])); i++) {
+        if (bench_unit(s_units[i], seconds)) {
+            failed++;
+        }
+    }
+    duer_uplink_set_mock(false);
+    duer_uplink_set_frame(UPLINK_FRAME_MS_DEFAULT, UPLINK_FLUSH_MS_DEFAULT);
+
+    return failed ? -1 : 0;
+}
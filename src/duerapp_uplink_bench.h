@@ -0,0 +1,39 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_uplink_bench.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Uplink send unit run on the mock transport, without the cloud.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_BENCH_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_BENCH_H
+
+#include "duerapp_config.h"
+
+#define UPLINK_BENCH_PERIOD_MS  (20)    // audio the capture side pushes at a time
+#define UPLINK_BENCH_SECONDS_MAX (600)
+
+/*
+ * For each send unit of 20, 40, 80 and 160 ms, push seconds of synthetic
+ * speech in real time through the uplink queue and the speex encoder, one
+ * period at a time, and send it on the mock transport. Logs per second of
+ * speech the sends, read/write syscalls, context switches and process CPU.
+ * Returns -1 when a run could not start, sent nothing or dropped audio.
+ */
+int duer_uplink_bench_run(int seconds);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_UPLINK_BENCH_H
@@ -0,0 +1,165 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_volume.c
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Output volume. The card's playback control is set once per change
+ *       so the samples pass untouched; without one, the mixer applies a
+ *       single software gain to its output. Mute is always done by the
+ *       mixer, it takes effect on the next period for every stream.
+ */
+
+#include <math.h>
+#include <alsa/asoundlib.h>
+
+#include "duerapp_volume.h"
+#include "duerapp_mixer.h"
+
+static const char *s_card = VOLUME_CARD_DEFAULT;
+static const char *s_element = VOLUME_ELEMENT_DEFAULT;
+static long s_db_min = VOLUME_DB_MIN_DEFAULT;
+static snd_mixer_t *s_handle = NULL;
+static snd_mixer_elem_t *s_elem = NULL;
+static bool s_has_db = false;
+static long s_range_min = 0;    // 0.01 dB when s_has_db, raw steps otherwise
+static long s_range_max = 0;
+
+void duer_volume_set_control(const char *card, const char *element)
+{
+    if (card && card[0]) {
+        s_card = card;
+    }
+    if (element && element[0]) {
+        s_element = element;
+    }
+}
+
+void duer_volume_set_db_min(long db_min)
+{
+    if (db_min < 0) {
+        s_db_min = db_min;
+    }
+}
+
+static int volume_open()
+{
+    snd_mixer_selem_id_t *sid = NULL;
+    int ret = 0;
+
+    ret = snd_mixer_open(&s_handle, 0);
+    if (ret < 0) {
+        s_handle = NULL;
+        return ret;
+    }
+    if ((ret = snd_mixer_attach(s_handle, s_card)) < 0
+            || (ret = snd_mixer_selem_register(s_handle, NULL, NULL)) < 0
+            || (ret = snd_mixer_load(s_handle)) < 0) {
+        snd_mixer_close(s_handle);
+        s_handle = NULL;
+        return ret;
+    }
+
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_index(sid, 0);
+    snd_mixer_selem_id_set_name(sid, s_element);
+    s_elem = snd_mixer_find_selem(s_handle, sid);
+    if (!s_elem || !snd_mixer_selem_has_playback_volume(s_elem)) {
+        snd_mixer_close(s_handle);
+        s_handle = NULL;
+        s_elem = NULL;
+        return -ENOENT;
+    }
+
+    if (snd_mixer_selem_get_playback_dB_range(s_elem, &s_range_min, &s_range_max) == 0
+            && s_range_max > s_range_min) {
+        s_has_db = true;
+        // no boost above 0 dB, and the floor no lower than the card goes
+        s_range_max = s_range_max < 0 ? s_range_max : 0;
+        s_range_min = s_range_min > s_db_min ? s_range_min : s_db_min;
+    } else {
+        snd_mixer_selem_get_playback_volume_range(s_elem, &s_range_min, &s_range_max);
+    }
+
+    return 0;
+}
+
+void duer_volume_init(void)
+{
+    int ret = volume_open();
+
+    if (ret < 0) {
+        DUER_LOGI("volume: no control %s on %s (%s), software gain",
+                  s_element, s_card, snd_strerror(ret));
+        return;
+    }
+    DUER_LOGI("volume: control %s on %s, %s %ld..%ld", s_element, s_card,
+              s_has_db ? "0.01 dB" : "steps", s_range_min, s_range_max);
+}
+
+void duer_volume_destroy(void)
+{
+    if (s_handle) {
+        snd_mixer_close(s_handle);
+        s_handle = NULL;
+        s_elem = NULL;
+    }
+}
+
+void duer_volume_set(double level)
+{
+    long db = 0;
+
+    if (level <= 0.0) {
+        // the bottom of a card's range is rarely silent
+        duer_mixer_set_master(0.0);
+        if (s_elem) {
+            if (s_has_db) {
+                snd_mixer_selem_set_playback_dB_all(s_elem, s_range_min, 1);
+            } else {
+                snd_mixer_selem_set_playback_volume_all(s_elem, s_range_min);
+            }
+        }
+        return;
+    }
+    if (level > 1.0) {
+        level = 1.0;
+    }
+    if (!s_elem) {
+        db = s_db_min + (long)(-s_db_min * level);
+        duer_mixer_set_master(pow(10.0, db / 2000.0));
+        return;
+    }
+
+    duer_mixer_set_master(1.0);
+    if (s_has_db) {
+        db = s_range_min + (long)((s_range_max - s_range_min) * level);
+        // dir 1: round up to the nearest step the card has
+        snd_mixer_selem_set_playback_dB_all(s_elem, db, 1);
+    } else {
+        snd_mixer_selem_set_playback_volume_all(s_elem,
+                s_range_min + (long)((s_range_max - s_range_min) * level));
+    }
+}
+
+void duer_volume_set_mute(bool mute)
+{
+    duer_mixer_set_mute(mute);
+}
+
+bool duer_volume_is_hardware(void)
+{
+    return s_elem != NULL;
+}
@@ -0,0 +1,55 @@
+/**
+ * Copyright (2019) Yundeaiot Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * File: duerapp_volume.h
+ * Auth: Jim meng (alongmh@163.com)
+ * Desc: Output volume, on the sound card's mixer control when it has one.
+ */
+
+#ifndef BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_VOLUME_H
+#define BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_VOLUME_H
+
+#include "duerapp_config.h"
+
+#define VOLUME_CARD_DEFAULT     "default"
+#define VOLUME_ELEMENT_DEFAULT  "Master"
+#define VOLUME_DB_MIN_DEFAULT   (-5000) // 0.01 dB, level 1 of 100; level 0 is silence
+
+/*
+ * Card and simple mixer element to drive. Call before duer_volume_init().
+ */
+void duer_volume_set_control(const char *card, const char *element);
+
+/*
+ * Floor of the volume curve in 0.01 dB. Levels map linearly in dB from the
+ * floor to 0 dB, which sounds even across the range.
+ */
+void duer_volume_set_db_min(long db_min);
+
+/*
+ * Use the mixer control if it is there, else the mixer's software gain.
+ */
+void duer_volume_init(void);
+void duer_volume_destroy(void);
+
+/*
+ * level: 0.0 .. 1.0
+ */
+void duer_volume_set(double level);
+void duer_volume_set_mute(bool mute);
+bool duer_volume_is_hardware(void);
+
+#endif // BAIDU_DUER_LIBDUER_DEVICE_EXAMPLES_DCS3_LINUX_DUERAPP_VOLUME_H